@@ -1,5 +1,12 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include <vulkan/vulkan.h>
@@ -33,13 +40,26 @@ VkPhysicalDevice get_physical_device(VkInstance inst) {
 	return pdev;
 }
 
-VkDevice create_device(VkInstance inst, VkPhysicalDevice pdev) {
+/* Returns the first queue family with all of flags, or UINT32_MAX. */
+uint32_t find_queue_family(VkPhysicalDevice pdev, VkQueueFlags flags) {
+	uint32_t n = 16;
+	VkQueueFamilyProperties props[16];
+	vkGetPhysicalDeviceQueueFamilyProperties(pdev, &n, props);
+	for (uint32_t i=0; i<n; i++)
+		if (props[i].queueCount && (props[i].queueFlags & flags) == flags)
+			return i;
+	fprintf(stderr, "ERROR: find_queue_family() failed.\n");
+	return UINT32_MAX;
+}
+
+VkDevice create_device(VkInstance inst, VkPhysicalDevice pdev, uint32_t family) {
 	const char *extensions[] = {
 		VK_KHR_SWAPCHAIN_EXTENSION_NAME
 	};
 	float priority = 1.0f;
 	VkDeviceQueueCreateInfo infoQueue = {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+		.queueFamilyIndex = family,
 		.queueCount = 1,
 		.pQueuePriorities = &priority
 	};
@@ -58,21 +78,113 @@ VkDevice create_device(VkInstance inst, VkPhysicalDevice pdev) {
 	return dev;
 }
 
-VkSurfaceKHR create_surface(VkInstance inst, VkPhysicalDevice pdev) {
-	uint32_t n = 1;
-	VkDisplayPropertiesKHR propsDisplay;
-	vkGetPhysicalDeviceDisplayPropertiesKHR(pdev, &n, &propsDisplay);
-	if (n == 0) {
+/* 0 means the native resolution at its highest refresh rate. */
+struct mode_request {
+	uint32_t width, height;
+	uint32_t refresh; // mHz
+};
+
+static int has_mode_size(const VkDisplayModePropertiesKHR *modes,
+uint32_t count, VkExtent2D size) {
+	for (uint32_t i = 0; i < count; i++)
+		if (modes[i].parameters.visibleRegion.width == size.width &&
+		modes[i].parameters.visibleRegion.height == size.height)
+			return 1;
+	return 0;
+}
+
+/* The requested resolution if listed, else the native one, else the largest
+ * listed; then the refresh rate closest to the requested one, or the
+ * highest. VK_KHR_display does not tell interlaced modes apart. count must
+ * not be 0. */
+uint32_t choose_mode(const VkDisplayModePropertiesKHR *modes, uint32_t count,
+VkExtent2D native, const struct mode_request *want) {
+	VkExtent2D size = native;
+	if (!has_mode_size(modes, count, size)) {
+		size = modes[0].parameters.visibleRegion;
+		for (uint32_t i = 1; i < count; i++) {
+			VkExtent2D e = modes[i].parameters.visibleRegion;
+			if ((uint64_t)e.width * e.height > (uint64_t)size.width * size.height)
+				size = e;
+		}
+	}
+	if (want->width) {
+		VkExtent2D wanted = {want->width, want->height};
+		if (has_mode_size(modes, count, wanted))
+			size = wanted;
+		else
+			printf("no %ux%u mode, using %ux%u\n", want->width, want->height,
+			size.width, size.height);
+	}
+
+	uint32_t best = count;
+	for (uint32_t i = 0; i < count; i++) {
+		VkExtent2D e = modes[i].parameters.visibleRegion;
+		if (e.width != size.width || e.height != size.height)
+			continue;
+		int r = modes[i].parameters.refreshRate;
+		int b = best < count ? (int)modes[best].parameters.refreshRate : 0;
+		int w = want->refresh;
+		if (best == count || (w ? abs(r - w) < abs(b - w) : r > b))
+			best = i;
+	}
+	return best;
+}
+
+#define max_displays 4
+#define max_planes 16
+
+/* Each display needs a plane of its own: the first one not in used that can
+ * show disp. Returns max_planes if none is left. */
+uint32_t find_plane(VkPhysicalDevice pdev, VkDisplayKHR disp, uint32_t used,
+uint32_t *stack_index) {
+	uint32_t n = max_planes;
+	VkDisplayPlanePropertiesKHR planes[max_planes];
+	vkGetPhysicalDeviceDisplayPlanePropertiesKHR(pdev, &n, planes);
+	for (uint32_t i = 0; i < n; i++) {
+		if (used & (1u << i))
+			continue;
+		uint32_t count = max_displays;
+		VkDisplayKHR displays[max_displays];
+		vkGetDisplayPlaneSupportedDisplaysKHR(pdev, i, &count, displays);
+		for (uint32_t j = 0; j < count; j++) {
+			if (displays[j] == disp) {
+				*stack_index = planes[i].currentStackIndex;
+				return i;
+			}
+		}
+	}
+	return max_planes;
+}
+
+/* Marks the plane it takes in used_planes. */
+#define max_modes 64
+VkSurfaceKHR create_surface(VkInstance inst, VkPhysicalDevice pdev,
+const VkDisplayPropertiesKHR *disp, const struct mode_request *want,
+uint32_t *used_planes) {
+	uint32_t stack_index;
+	uint32_t plane = find_plane(pdev, disp->display, *used_planes,
+	&stack_index);
+	if (plane == max_planes) {
 		fprintf(stderr, "ERROR: create_surface() failed.\n");
 		return VK_NULL_HANDLE;
 	}
 
-	VkDisplayModePropertiesKHR props;
-	vkGetDisplayModePropertiesKHR(pdev, propsDisplay.display, &n, &props);
+	VkDisplayModePropertiesKHR modes[max_modes];
+	uint32_t n = max_modes;
+	vkGetDisplayModePropertiesKHR(pdev, disp->display, &n, modes);
+	if (n == 0) {
+		fprintf(stderr, "ERROR: create_surface() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	uint32_t i = choose_mode(modes, n, disp->physicalResolution, want);
+	VkDisplayModePropertiesKHR props = modes[i];
 
 	VkDisplaySurfaceCreateInfoKHR info = {
 		.sType = VK_STRUCTURE_TYPE_DISPLAY_SURFACE_CREATE_INFO_KHR,
 		.displayMode = props.displayMode,
+		.planeIndex = plane,
+		.planeStackIndex = stack_index,
 		.transform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
 		.alphaMode = VK_DISPLAY_PLANE_ALPHA_OPAQUE_BIT_KHR,
 		.imageExtent = props.parameters.visibleRegion
@@ -82,17 +194,86 @@ VkSurfaceKHR create_surface(VkInstance inst, VkPhysicalDevice pdev) {
 		fprintf(stderr, "ERROR: create_surface() failed.\n");
 		return VK_NULL_HANDLE;
 	}
+	*used_planes |= 1u << plane;
 	return surf;
 }
+#undef max_modes
+#undef max_planes
+
+/* Surface creation does not need the VkDevice, so it runs on a worker
+ * thread while the device is created. Every display gets a surface. */
+struct surface_setup {
+	VkInstance inst;
+	VkPhysicalDevice pdev;
+	struct mode_request mode;
+	VkSurfaceKHR surfs[max_displays];
+	uint32_t surf_count;
+};
+
+static void *surface_thread(void *arg) {
+	struct surface_setup *s = arg;
+	uint32_t n = max_displays;
+	VkDisplayPropertiesKHR displays[max_displays];
+	vkGetPhysicalDeviceDisplayPropertiesKHR(s->pdev, &n, displays);
+	uint32_t used_planes = 0;
+	s->surf_count = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		VkSurfaceKHR surf = create_surface(s->inst, s->pdev, &displays[i],
+		&s->mode, &used_planes);
+		if (surf != VK_NULL_HANDLE)
+			s->surfs[s->surf_count++] = surf;
+	}
+	return NULL;
+}
+
+static const struct {
+	const char *name;
+	VkPresentModeKHR mode;
+} present_modes[] = {
+	{"immediate", VK_PRESENT_MODE_IMMEDIATE_KHR},
+	{"mailbox", VK_PRESENT_MODE_MAILBOX_KHR},
+	{"fifo", VK_PRESENT_MODE_FIFO_KHR},
+	{"fifo_relaxed", VK_PRESENT_MODE_FIFO_RELAXED_KHR}
+};
+
+int parse_present_mode(const char *name, VkPresentModeKHR *mode) {
+	for (int i=0; i<sizeof(present_modes)/sizeof(present_modes[0]); i++) {
+		if (!strcmp(present_modes[i].name, name)) {
+			*mode = present_modes[i].mode;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+VkPresentModeKHR choose_present_mode(VkPhysicalDevice pdev, VkSurfaceKHR surf,
+VkPresentModeKHR wanted) {
+	uint32_t n = 8;
+	VkPresentModeKHR modes[8];
+	vkGetPhysicalDeviceSurfacePresentModesKHR(pdev, surf, &n, modes);
+	for (int i=0; i<n; i++)
+		if (modes[i] == wanted)
+			return wanted;
+	fprintf(stderr, "WARNING: present mode not supported, using FIFO.\n");
+	return VK_PRESENT_MODE_FIFO_KHR;
+}
 
-VkSwapchainKHR create_swapchain(VkPhysicalDevice pdev, VkDevice dev, VkSurfaceKHR surf) {
+#define max_swapchain_images 8
+
+/* As few images as the surface allows: only one frame is ever shown. */
+VkSwapchainKHR create_swapchain(VkPhysicalDevice pdev, VkDevice dev,
+VkSurfaceKHR surf, VkPresentModeKHR mode) {
 	VkSurfaceCapabilitiesKHR caps;
 	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(pdev, surf, &caps);
+	if (caps.minImageCount > max_swapchain_images) {
+		fprintf(stderr, "ERROR: create_swapchain() failed.\n");
+		return VK_NULL_HANDLE;
+	}
 
 	VkSwapchainCreateInfoKHR info = {
 		.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
 		.surface = surf,
-		.minImageCount = 1,
+		.minImageCount = caps.minImageCount,
 		.imageFormat = VK_FORMAT_B8G8R8A8_UNORM,
 		.imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR,
 		.imageExtent = caps.currentExtent,
@@ -102,7 +283,7 @@ VkSwapchainKHR create_swapchain(VkPhysicalDevice pdev, VkDevice dev, VkSurfaceKH
 		.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
 		.preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
 		.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-		.presentMode = VK_PRESENT_MODE_FIFO_KHR,
+		.presentMode = choose_present_mode(pdev, surf, mode),
 		.clipped = VK_TRUE,
 		.oldSwapchain = VK_NULL_HANDLE,
 	};
@@ -114,9 +295,10 @@ VkSwapchainKHR create_swapchain(VkPhysicalDevice pdev, VkDevice dev, VkSurfaceKH
 	return swp;
 }
 
-VkCommandPool create_command_pool(VkDevice dev) {
+VkCommandPool create_command_pool(VkDevice dev, uint32_t family) {
 	VkCommandPoolCreateInfo info = {
 		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.queueFamilyIndex = family,
 	};
 	VkCommandPool pool;
 	if (vkCreateCommandPool(dev, &info, NULL, &pool)) {
@@ -126,7 +308,44 @@ VkCommandPool create_command_pool(VkDevice dev) {
 	return pool;
 }
 
-VkCommandBuffer record_command_clear(VkDevice dev, VkCommandPool pool, VkImage img) {
+/* Two timestamps per pass: before and after. */
+VkQueryPool create_query_pool(VkDevice dev, uint32_t passes) {
+	VkQueryPoolCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+		.queryType = VK_QUERY_TYPE_TIMESTAMP,
+		.queryCount = 2 * passes
+	};
+	VkQueryPool pool;
+	if (vkCreateQueryPool(dev, &info, NULL, &pool)) {
+		fprintf(stderr, "ERROR: create_query_pool() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return pool;
+}
+
+/* Returns the GPU time of a pass in ms, or a negative value on failure. */
+double get_pass_time(VkPhysicalDevice pdev, VkDevice dev, uint32_t queue_family,
+VkQueryPool queries, uint32_t pass) {
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(pdev, &props);
+	uint32_t n = 16;
+	VkQueueFamilyProperties families[16];
+	vkGetPhysicalDeviceQueueFamilyProperties(pdev, &n, families);
+	if (queue_family >= n || families[queue_family].timestampValidBits == 0)
+		return -1;
+	VkQueueFamilyProperties family = families[queue_family];
+
+	uint64_t ts[2];
+	if (vkGetQueryPoolResults(dev, queries, 2 * pass, 2, sizeof(ts), ts,
+	sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT))
+		return -1;
+	uint64_t mask = family.timestampValidBits >= 64 ? UINT64_MAX :
+	(1ull << family.timestampValidBits) - 1;
+	return ((ts[1] - ts[0]) & mask) * props.limits.timestampPeriod / 1e6;
+}
+
+VkCommandBuffer record_command_clear(VkDevice dev, VkCommandPool pool, VkImage img,
+VkQueryPool queries) {
 	VkCommandBufferAllocateInfo info = {
 		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
 		.commandPool = pool,
@@ -142,76 +361,248 @@ VkCommandBuffer record_command_clear(VkDevice dev, VkCommandPool pool, VkImage i
 	};
 	vkBeginCommandBuffer(cmdbuf, &infoBegin);
 
+	vkCmdResetQueryPool(cmdbuf, queries, 0, 2);
+	vkCmdWriteTimestamp(cmdbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queries, 0);
+
 	VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
 	VkClearColorValue color = {0.8984375f, 0.8984375f, 0.9765625f, 1.0f};
 	vkCmdClearColorImage(cmdbuf, img,
 	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
 
+	vkCmdWriteTimestamp(cmdbuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queries, 1);
 	vkEndCommandBuffer(cmdbuf);
 	return cmdbuf;
 }
 
-int main() {
-	VkInstance instance = create_instance();
-	if (instance == VK_NULL_HANDLE)
-		return EXIT_FAILURE;
-
-	VkPhysicalDevice physical_device = get_physical_device(instance);
-	if (physical_device == VK_NULL_HANDLE)
-		return EXIT_FAILURE;
-
-	VkSurfaceKHR surface = create_surface(instance, physical_device);
-	if (surface == VK_NULL_HANDLE)
-		return EXIT_FAILURE;
-
-	VkDevice device = create_device(instance, physical_device);
-	if (device == VK_NULL_HANDLE)
-		return EXIT_FAILURE;
+/* One display: its own swapchain and clear, presented from a thread of its
+ * own. The queue is shared, so submits and presents hold queue_lock. */
+struct output {
+	VkPhysicalDevice pdev;
+	VkDevice dev;
+	uint32_t family;
+	VkQueue queue;
+	pthread_mutex_t *queue_lock;
+	VkPresentModeKHR present_mode;
+	VkSurfaceKHR surf;
+	VkSwapchainKHR swapchain;
+	VkCommandPool command_pool;
+	VkQueryPool query_pool;
+	VkCommandBuffer cmd_clear;
+	int error;
+};
 
-	VkSwapchainKHR swapchain = create_swapchain(physical_device, device, surface);
-	if (swapchain == VK_NULL_HANDLE)
-		return EXIT_FAILURE;
+int present_output(struct output *o) {
+	VkBool32 present;
+	vkGetPhysicalDeviceSurfaceSupportKHR(o->pdev, o->family, o->surf, &present);
+	if (!present) {
+		fprintf(stderr, "ERROR: queue family %u cannot present.\n", o->family);
+		return -1;
+	}
 
-	VkQueue queue;
-	vkGetDeviceQueue(device, 0, 0, &queue);
+	o->swapchain = create_swapchain(o->pdev, o->dev, o->surf, o->present_mode);
+	if (o->swapchain == VK_NULL_HANDLE)
+		return -1;
 
-	uint32_t n = 1;
-	VkImage image;
-	vkGetSwapchainImagesKHR(device, swapchain, &n, &image);
+	/* The driver may have created more images than asked for. */
+	uint32_t n;
+	VkImage images[max_swapchain_images];
+	if (vkGetSwapchainImagesKHR(o->dev, o->swapchain, &n, NULL) ||
+	n > max_swapchain_images ||
+	vkGetSwapchainImagesKHR(o->dev, o->swapchain, &n, images)) {
+		fprintf(stderr, "ERROR: vkGetSwapchainImagesKHR() failed.\n");
+		return -1;
+	}
 
-	VkCommandPool command_pool = create_command_pool(device);
-	if (command_pool == VK_NULL_HANDLE)
-		return EXIT_FAILURE;
+	o->command_pool = create_command_pool(o->dev, o->family);
+	if (o->command_pool == VK_NULL_HANDLE)
+		return -1;
 
-	VkCommandBuffer cmd_clear = record_command_clear(device, command_pool, image);
+	o->query_pool = create_query_pool(o->dev, 1);
+	if (o->query_pool == VK_NULL_HANDLE)
+		return -1;
 
+	/* Only one frame is ever drawn, so wait for the image on the CPU
+	 * before clearing it. */
+	VkFenceCreateInfo fence_info = {.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+	VkFence acquired;
+	if (vkCreateFence(o->dev, &fence_info, NULL, &acquired)) {
+		fprintf(stderr, "ERROR: vkCreateFence() failed.\n");
+		return -1;
+	}
 	uint32_t index;
-	vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, VK_NULL_HANDLE, VK_NULL_HANDLE, &index);
+	VkResult res = vkAcquireNextImageKHR(o->dev, o->swapchain, UINT64_MAX,
+	VK_NULL_HANDLE, acquired, &index);
+	if ((res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) ||
+	vkWaitForFences(o->dev, 1, &acquired, VK_TRUE, UINT64_MAX)) {
+		fprintf(stderr, "ERROR: vkAcquireNextImageKHR() failed.\n");
+		vkDestroyFence(o->dev, acquired, NULL);
+		return -1;
+	}
+	vkDestroyFence(o->dev, acquired, NULL);
+
+	o->cmd_clear = record_command_clear(o->dev, o->command_pool,
+	images[index], o->query_pool);
 
 	VkSubmitInfo submitInfo = {
 		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
 		.commandBufferCount = 1,
-		.pCommandBuffers = &cmd_clear
+		.pCommandBuffers = &o->cmd_clear
 	};
-	vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-
 	VkPresentInfoKHR presentInfo = {
 		.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
 		.swapchainCount = 1,
-		.pSwapchains = &swapchain,
+		.pSwapchains = &o->swapchain,
 		.pImageIndices = &index
 	};
-	vkQueuePresentKHR(queue, &presentInfo);
+	pthread_mutex_lock(o->queue_lock);
+	vkQueueSubmit(o->queue, 1, &submitInfo, VK_NULL_HANDLE);
+	vkQueuePresentKHR(o->queue, &presentInfo);
+	pthread_mutex_unlock(o->queue_lock);
+
+	double ms = get_pass_time(o->pdev, o->dev, o->family, o->query_pool, 0);
+	if (ms >= 0)
+		printf("GPU clear: %.3f ms\n", ms);
+	return 0;
+}
+
+static void *output_thread(void *arg) {
+	struct output *o = arg;
+	o->error = present_output(o) < 0;
+	return NULL;
+}
+
+/* Keeps the frames on screen for a few seconds, or until SIGINT or SIGTERM
+ * arrives, whichever is first. signals must be blocked in every thread. */
+int wait_for_exit(const sigset_t *signals, time_t seconds) {
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	int signal_fd = signalfd(-1, signals, SFD_CLOEXEC);
+	struct itimerspec timeout = {.it_value = {.tv_sec = seconds}};
+	struct epoll_event timer_ev = {.events = EPOLLIN, .data.fd = timer_fd};
+	struct epoll_event signal_ev = {.events = EPOLLIN, .data.fd = signal_fd};
+	int err = ep < 0 || timer_fd < 0 || signal_fd < 0 ||
+	timerfd_settime(timer_fd, 0, &timeout, NULL) ||
+	epoll_ctl(ep, EPOLL_CTL_ADD, timer_fd, &timer_ev) ||
+	epoll_ctl(ep, EPOLL_CTL_ADD, signal_fd, &signal_ev);
+	struct epoll_event ev;
+	while (!err && epoll_wait(ep, &ev, 1, -1) != 1)
+		err = errno != EINTR;
+	if (err) {
+		fprintf(stderr, "ERROR: wait_for_exit() failed.\n");
+	} else if (ev.data.fd == signal_fd) {
+		struct signalfd_siginfo info;
+		if (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+			printf("stopped by signal %u\n", info.ssi_signo);
+	}
+	if (signal_fd >= 0)
+		close(signal_fd);
+	if (timer_fd >= 0)
+		close(timer_fd);
+	if (ep >= 0)
+		close(ep);
+	return err ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	VkPresentModeKHR present_mode = VK_PRESENT_MODE_FIFO_KHR;
+	struct mode_request mode = {0};
+	double hz = 0;
+	if ((argc > 1 && parse_present_mode(argv[1], &present_mode)) ||
+	(argc > 2 && sscanf(argv[2], "%ux%u@%lf", &mode.width, &mode.height,
+	&hz) < 2) || hz < 0) {
+		fprintf(stderr, "usage: %s [immediate|mailbox|fifo|fifo_relaxed "
+		"[WIDTHxHEIGHT[@HZ]]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	mode.refresh = hz * 1000 + 0.5;
+
+	VkInstance instance = create_instance();
+	if (instance == VK_NULL_HANDLE)
+		return EXIT_FAILURE;
+
+	VkPhysicalDevice physical_device = get_physical_device(instance);
+	if (physical_device == VK_NULL_HANDLE)
+		return EXIT_FAILURE;
+
+	uint32_t queue_family = find_queue_family(physical_device,
+	VK_QUEUE_GRAPHICS_BIT);
+	if (queue_family == UINT32_MAX)
+		return EXIT_FAILURE;
+
+	/* Blocked before any thread starts, so they only ever arrive through
+	 * the signalfd of wait_for_exit(). */
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
-	sleep(1);
+	struct surface_setup surface_setup = {instance, physical_device, mode};
+	pthread_t surface_worker;
+	int threaded = !pthread_create(&surface_worker, NULL, surface_thread,
+	&surface_setup);
 
-	vkFreeCommandBuffers(device, command_pool, 1, &cmd_clear);
+	VkDevice device = create_device(instance, physical_device, queue_family);
+	if (device == VK_NULL_HANDLE) {
+		// The worker still uses the instance
+		if (threaded)
+			pthread_join(surface_worker, NULL);
+		return EXIT_FAILURE;
+	}
 
-	vkDestroyCommandPool(device, command_pool, NULL);
-	vkDestroySwapchainKHR(device, swapchain, NULL);
-	vkDestroySurfaceKHR(instance, surface, NULL);
+	if (threaded)
+		pthread_join(surface_worker, NULL);
+	else
+		surface_thread(&surface_setup);
+	if (surface_setup.surf_count == 0)
+		return EXIT_FAILURE;
+
+	VkQueue queue;
+	vkGetDeviceQueue(device, queue_family, 0, &queue);
+	pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	uint32_t output_count = surface_setup.surf_count;
+	struct output outputs[max_displays];
+	pthread_t threads[max_displays];
+	uint32_t started;
+	for (started = 0; started < output_count; started++) {
+		outputs[started] = (struct output){
+			.pdev = physical_device,
+			.dev = device,
+			.family = queue_family,
+			.queue = queue,
+			.queue_lock = &queue_lock,
+			.present_mode = present_mode,
+			.surf = surface_setup.surfs[started]
+		};
+		if (pthread_create(&threads[started], NULL, output_thread,
+		&outputs[started])) {
+			fprintf(stderr, "ERROR: pthread_create() failed.\n");
+			break;
+		}
+	}
+	int error = started < output_count;
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+		error |= outputs[i].error;
+	}
+
+	if (!error)
+		error = wait_for_exit(&signals, 1) < 0;
+
+	vkDeviceWaitIdle(device);
+	for (uint32_t i = 0; i < started; i++) {
+		struct output *o = &outputs[i];
+		if (o->cmd_clear != VK_NULL_HANDLE)
+			vkFreeCommandBuffers(device, o->command_pool, 1, &o->cmd_clear);
+		vkDestroyQueryPool(device, o->query_pool, NULL);
+		vkDestroyCommandPool(device, o->command_pool, NULL);
+		vkDestroySwapchainKHR(device, o->swapchain, NULL);
+	}
+	for (uint32_t i = 0; i < output_count; i++)
+		vkDestroySurfaceKHR(instance, surface_setup.surfs[i], NULL);
 	vkDestroyDevice(device, NULL);
 	vkDestroyInstance(instance, NULL);
 
-	return EXIT_SUCCESS;
+	return error ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -1,27 +1,79 @@
+#define _GNU_SOURCE // accept4
 #include <vulkan/vulkan.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
-#include <intel_bufmgr.h>
-
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <linux/sync_file.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 static PFN_vkGetMemoryFdKHR vkGetMemoryFd = 0;
+static PFN_vkGetMemoryFdPropertiesKHR vkGetMemoryFdProperties = 0;
+static PFN_vkGetSemaphoreFdKHR vkGetSemaphoreFd = 0;
+static PFN_vkImportSemaphoreFdKHR vkImportSemaphoreFd = 0;
+static PFN_vkGetPhysicalDeviceExternalSemaphorePropertiesKHR
+vkGetExternalSemaphoreProperties = 0;
+static PFN_vkGetPhysicalDeviceFormatProperties2KHR vkGetFormatProperties2 = 0;
+static PFN_vkGetPhysicalDeviceImageFormatProperties2KHR
+vkGetImageFormatProperties2 = 0;
+static PFN_vkGetImageDrmFormatModifierPropertiesEXT
+vkGetImageDrmFormatModifierProperties = 0;
+static PFN_vkGetImageMemoryRequirements2KHR vkGetImageRequirements2 = 0;
+static PFN_vkGetBufferMemoryRequirements2KHR vkGetBufferRequirements2 = 0;
+/* VK_KHR_dedicated_allocation is enabled: allocations may name their image
+ * or buffer. */
+static int dedicated_allocation = 0;
+/* VK_KHR_external_semaphore_fd is enabled: needed for sync_file export. */
+static int external_semaphore_fd = 0;
+
+int has_instance_layer(const char *name) {
+	uint32_t count = 0;
+	vkEnumerateInstanceLayerProperties(&count, NULL);
+	VkLayerProperties *props = malloc(count * sizeof(*props));
+	vkEnumerateInstanceLayerProperties(&count, props);
+	int found = 0;
+	for (uint32_t i=0; i<count && !found; i++)
+		found = !strcmp(props[i].layerName, name);
+	free(props);
+	return found;
+}
 
-VkInstance create_instance() {
+/* Validation is left out in fast-start mode, and when it is not installed. */
+VkInstance create_instance(int fast_start) {
 	const char *extensions[] = {
 		VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
-		VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME
+		VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME,
+		VK_KHR_EXTERNAL_SEMAPHORE_CAPABILITIES_EXTENSION_NAME
 	};
 	const char *layers[] = {"VK_LAYER_KHRONOS_validation"};
+	int validation = !fast_start && has_instance_layer(layers[0]);
 	VkInstanceCreateInfo info = {
 		.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
-		.enabledLayerCount = sizeof(layers)/sizeof(char*),
+		.enabledLayerCount = validation ? 1 : 0,
 		.ppEnabledLayerNames = layers,
 		.enabledExtensionCount = sizeof(extensions)/sizeof(char*),
 		.ppEnabledExtensionNames = extensions
@@ -32,8 +84,16 @@ VkInstance create_instance() {
 		return VK_NULL_HANDLE;
 	}
 
-	vkGetMemoryFd = (PFN_vkGetMemoryFdKHR) vkGetInstanceProcAddr(inst,
-	"vkGetMemoryFdKHR");
+	/* Device functions are loaded by create_device(). */
+	vkGetExternalSemaphoreProperties =
+	(PFN_vkGetPhysicalDeviceExternalSemaphorePropertiesKHR)
+	vkGetInstanceProcAddr(inst,
+	"vkGetPhysicalDeviceExternalSemaphorePropertiesKHR");
+	vkGetFormatProperties2 = (PFN_vkGetPhysicalDeviceFormatProperties2KHR)
+	vkGetInstanceProcAddr(inst, "vkGetPhysicalDeviceFormatProperties2KHR");
+	vkGetImageFormatProperties2 =
+	(PFN_vkGetPhysicalDeviceImageFormatProperties2KHR)
+	vkGetInstanceProcAddr(inst, "vkGetPhysicalDeviceImageFormatProperties2KHR");
 
 	return inst;
 }
@@ -49,15 +109,76 @@ VkPhysicalDevice get_physical_device(VkInstance inst) {
 	return pdev;
 }
 
-VkDevice create_device(VkInstance inst, VkPhysicalDevice pdev) {
-	const char *extensions[] = {
-		VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME,
-		VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME,
-		VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME
-	};
+int has_device_extension(VkPhysicalDevice pdev, const char *name) {
+	uint32_t count = 0;
+	vkEnumerateDeviceExtensionProperties(pdev, NULL, &count, NULL);
+	VkExtensionProperties *props = malloc(count * sizeof(*props));
+	vkEnumerateDeviceExtensionProperties(pdev, NULL, &count, props);
+	int found = 0;
+	for (uint32_t i=0; i<count && !found; i++)
+		found = !strcmp(props[i].extensionName, name);
+	free(props);
+	return found;
+}
+
+/* Returns the first queue family with all of flags, or UINT32_MAX. */
+uint32_t find_queue_family(VkPhysicalDevice pdev, VkQueueFlags flags) {
+	uint32_t n = 16;
+	VkQueueFamilyProperties props[16];
+	vkGetPhysicalDeviceQueueFamilyProperties(pdev, &n, props);
+	for (uint32_t i=0; i<n; i++)
+		if (props[i].queueCount && (props[i].queueFlags & flags) == flags)
+			return i;
+	fprintf(stderr, "ERROR: find_queue_family() failed.\n");
+	return UINT32_MAX;
+}
+
+/* Only the dma-buf export is required. The DRM format modifier extensions
+ * and the foreign queue family (for client buffers) are enabled when main
+ * found them; the memory requirements and dedicated allocation extensions,
+ * which a device with modifiers always has, when the device has them. */
+#define max_device_extensions 16
+VkDevice create_device(VkInstance inst, VkPhysicalDevice pdev, uint32_t family,
+int modifiers, int foreign) {
+	const char *extensions[max_device_extensions];
+	uint32_t extensionCount = 0;
+	extensions[extensionCount++] = VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME;
+	extensions[extensionCount++] = VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME;
+	extensions[extensionCount++] = VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME;
+	/* Without them the CPU waits for each render before the commit. */
+	external_semaphore_fd = has_device_extension(pdev,
+	VK_KHR_EXTERNAL_SEMAPHORE_EXTENSION_NAME) && has_device_extension(pdev,
+	VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME);
+	if (external_semaphore_fd) {
+		extensions[extensionCount++] = VK_KHR_EXTERNAL_SEMAPHORE_EXTENSION_NAME;
+		extensions[extensionCount++] =
+		VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME;
+	}
+	int requirements2 = has_device_extension(pdev,
+	VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME);
+	if (requirements2)
+		extensions[extensionCount++] =
+		VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME;
+	dedicated_allocation = requirements2 && has_device_extension(pdev,
+	VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME);
+	if (dedicated_allocation)
+		extensions[extensionCount++] = VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME;
+	if (modifiers) {
+		extensions[extensionCount++] = VK_KHR_MAINTENANCE1_EXTENSION_NAME;
+		extensions[extensionCount++] = VK_KHR_BIND_MEMORY_2_EXTENSION_NAME;
+		extensions[extensionCount++] = VK_KHR_IMAGE_FORMAT_LIST_EXTENSION_NAME;
+		extensions[extensionCount++] =
+		VK_KHR_SAMPLER_YCBCR_CONVERSION_EXTENSION_NAME;
+		extensions[extensionCount++] =
+		VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME;
+		if (foreign)
+			extensions[extensionCount++] =
+			VK_EXT_QUEUE_FAMILY_FOREIGN_EXTENSION_NAME;
+	}
 	float priority = 1.0f;
 	VkDeviceQueueCreateInfo infoQueue = {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+		.queueFamilyIndex = family,
 		.queueCount = 1,
 		.pQueuePriorities = &priority
 	};
@@ -65,7 +186,7 @@ VkDevice create_device(VkInstance inst, VkPhysicalDevice pdev) {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
 		.queueCreateInfoCount = 1,
 		.pQueueCreateInfos = &infoQueue,
-		.enabledExtensionCount = sizeof(extensions)/sizeof(char*),
+		.enabledExtensionCount = extensionCount,
 		.ppEnabledExtensionNames = extensions,
 	};
 	VkDevice dev;
@@ -73,13 +194,261 @@ VkDevice create_device(VkInstance inst, VkPhysicalDevice pdev) {
 		fprintf(stderr, "ERROR: create_device() failed.\n");
 		return VK_NULL_HANDLE;
 	}
+
+	/* Straight from the driver, without the instance dispatch. Functions of
+	 * extensions that are not enabled stay NULL. */
+	vkGetMemoryFd = (PFN_vkGetMemoryFdKHR) vkGetDeviceProcAddr(dev,
+	"vkGetMemoryFdKHR");
+	vkGetMemoryFdProperties = (PFN_vkGetMemoryFdPropertiesKHR)
+	vkGetDeviceProcAddr(dev, "vkGetMemoryFdPropertiesKHR");
+	if (external_semaphore_fd) {
+		vkGetSemaphoreFd = (PFN_vkGetSemaphoreFdKHR) vkGetDeviceProcAddr(dev,
+		"vkGetSemaphoreFdKHR");
+		vkImportSemaphoreFd = (PFN_vkImportSemaphoreFdKHR)
+		vkGetDeviceProcAddr(dev, "vkImportSemaphoreFdKHR");
+	}
+	if (modifiers)
+		vkGetImageDrmFormatModifierProperties =
+		(PFN_vkGetImageDrmFormatModifierPropertiesEXT)
+		vkGetDeviceProcAddr(dev, "vkGetImageDrmFormatModifierPropertiesEXT");
+	if (requirements2) {
+		vkGetImageRequirements2 = (PFN_vkGetImageMemoryRequirements2KHR)
+		vkGetDeviceProcAddr(dev, "vkGetImageMemoryRequirements2KHR");
+		vkGetBufferRequirements2 = (PFN_vkGetBufferMemoryRequirements2KHR)
+		vkGetDeviceProcAddr(dev, "vkGetBufferMemoryRequirements2KHR");
+	}
+	if (!vkGetMemoryFd || !vkGetMemoryFdProperties) {
+		fprintf(stderr, "ERROR: create_device() failed.\n");
+		vkDestroyDevice(dev, NULL);
+		return VK_NULL_HANDLE;
+	}
 	return dev;
 }
+#undef max_device_extensions
+
+/* Whether a semaphore signal can be exported as a sync_file for KMS. Only
+ * valid after create_device(), which may leave the extensions out. */
+int sync_fd_supported(VkPhysicalDevice pdev) {
+	VkPhysicalDeviceExternalSemaphoreInfo info = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_SEMAPHORE_INFO,
+		.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT
+	};
+	VkExternalSemaphoreProperties props = {
+		.sType = VK_STRUCTURE_TYPE_EXTERNAL_SEMAPHORE_PROPERTIES
+	};
+	if (!external_semaphore_fd || !vkGetExternalSemaphoreProperties ||
+	!vkGetSemaphoreFd || !vkImportSemaphoreFd)
+		return 0;
+	vkGetExternalSemaphoreProperties(pdev, &info, &props);
+	return (props.externalSemaphoreFeatures &
+	(VK_EXTERNAL_SEMAPHORE_FEATURE_EXPORTABLE_BIT |
+	VK_EXTERNAL_SEMAPHORE_FEATURE_IMPORTABLE_BIT)) ==
+	(VK_EXTERNAL_SEMAPHORE_FEATURE_EXPORTABLE_BIT |
+	VK_EXTERNAL_SEMAPHORE_FEATURE_IMPORTABLE_BIT);
+}
+
+VkSemaphore create_semaphore(VkDevice dev, int exportable) {
+	VkExportSemaphoreCreateInfo exportInfo = {
+		.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO,
+		.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT
+	};
+	VkSemaphoreCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		.pNext = exportable ? &exportInfo : NULL
+	};
+	VkSemaphore sem;
+	if (vkCreateSemaphore(dev, &info, NULL, &sem)) {
+		fprintf(stderr, "ERROR: create_semaphore() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return sem;
+}
+
+VkFence create_fence(VkDevice dev) {
+	VkFenceCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+		.flags = VK_FENCE_CREATE_SIGNALED_BIT
+	};
+	VkFence fence;
+	if (vkCreateFence(dev, &info, NULL, &fence)) {
+		fprintf(stderr, "ERROR: create_fence() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return fence;
+}
+
+/* Returns a sync_file that signals with the semaphore, which must have a
+ * pending signal operation. */
+int export_sync_file(VkDevice dev, VkSemaphore sem) {
+	VkSemaphoreGetFdInfoKHR info = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR,
+		.semaphore = sem,
+		.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT
+	};
+	int fd;
+	if (vkGetSemaphoreFd(dev, &info, &fd)) {
+		fprintf(stderr, "vkGetSemaphoreFdKHR failed\n");
+		return -1;
+	}
+	return fd;
+}
+
+/* Takes ownership of fd. The next wait on sem waits for the sync_file. */
+int import_sync_file(VkDevice dev, VkSemaphore sem, int fd) {
+	VkImportSemaphoreFdInfoKHR info = {
+		.sType = VK_STRUCTURE_TYPE_IMPORT_SEMAPHORE_FD_INFO_KHR,
+		.semaphore = sem,
+		.flags = VK_SEMAPHORE_IMPORT_TEMPORARY_BIT,
+		.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+		.fd = fd
+	};
+	if (vkImportSemaphoreFd(dev, &info)) {
+		fprintf(stderr, "vkImportSemaphoreFdKHR failed\n");
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Takes ownership of both sync_files, either of which may be -1. Returns one
+ * that signals once both have, or -1. */
+int merge_sync_files(int a, int b) {
+	if (a < 0 || b < 0)
+		return a < 0 ? b : a;
+	struct sync_merge_data data = {.name = "merged", .fd2 = b};
+	int err = ioctl(a, SYNC_IOC_MERGE, &data);
+	close(a);
+	close(b);
+	if (err) {
+		perror("SYNC_IOC_MERGE");
+		return -1;
+	}
+	return data.fence;
+}
+
+/* A DRM format modifier and the number of memory planes it uses. */
+struct modifier {
+	uint64_t modifier;
+	uint32_t planes;
+};
+
+#define max_modifiers 64
+
+/* Fills mods with the modifiers of format that support usage (transfers and
+ * color attachment only) and can be exported as a dma-buf at this size. Returns how many there
+ * are. */
+uint32_t get_vulkan_modifiers(VkPhysicalDevice pdev, VkFormat format,
+uint32_t width, uint32_t height, VkImageUsageFlags usage,
+struct modifier *mods, uint32_t max) {
+	VkDrmFormatModifierPropertiesListEXT list = {
+		.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT
+	};
+	VkFormatProperties2 props = {
+		.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
+		.pNext = &list
+	};
+	if (!vkGetFormatProperties2 || !vkGetImageFormatProperties2)
+		return 0;
+	vkGetFormatProperties2(pdev, format, &props);
+	VkDrmFormatModifierPropertiesEXT all[max_modifiers];
+	if (list.drmFormatModifierCount > max_modifiers)
+		list.drmFormatModifierCount = max_modifiers;
+	list.pDrmFormatModifierProperties = all;
+	vkGetFormatProperties2(pdev, format, &props);
+
+	VkFormatFeatureFlags features = 0;
+	if (usage & VK_IMAGE_USAGE_TRANSFER_DST_BIT)
+		features |= VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+	if (usage & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)
+		features |= VK_FORMAT_FEATURE_TRANSFER_SRC_BIT;
+	if (usage & VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT)
+		features |= VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT;
+	uint32_t n = 0;
+	for (uint32_t i=0; i<list.drmFormatModifierCount && n<max; i++) {
+		if ((all[i].drmFormatModifierTilingFeatures & features) != features ||
+		all[i].drmFormatModifierPlaneCount > 4)
+			continue;
+		VkPhysicalDeviceImageDrmFormatModifierInfoEXT modifierInfo = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT,
+			.drmFormatModifier = all[i].drmFormatModifier,
+			.sharingMode = VK_SHARING_MODE_EXCLUSIVE
+		};
+		VkPhysicalDeviceExternalImageFormatInfo externalInfo = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO,
+			.pNext = &modifierInfo,
+			.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT
+		};
+		VkPhysicalDeviceImageFormatInfo2 info = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2,
+			.pNext = &externalInfo,
+			.format = format,
+			.type = VK_IMAGE_TYPE_2D,
+			.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT,
+			.usage = usage
+		};
+		VkExternalImageFormatProperties externalProps = {
+			.sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES
+		};
+		VkImageFormatProperties2 imageProps = {
+			.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2,
+			.pNext = &externalProps
+		};
+		if (vkGetImageFormatProperties2(pdev, &info, &imageProps) ||
+		!(externalProps.externalMemoryProperties.externalMemoryFeatures &
+		VK_EXTERNAL_MEMORY_FEATURE_EXPORTABLE_BIT) ||
+		imageProps.imageFormatProperties.maxExtent.width < width ||
+		imageProps.imageFormatProperties.maxExtent.height < height)
+			continue;
+		mods[n].modifier = all[i].drmFormatModifier;
+		mods[n].planes = all[i].drmFormatModifierPlaneCount;
+		n++;
+	}
+	return n;
+}
+
+/* Keeps the entries of mods that are also in plane_mods. Linear is only kept
+ * if nothing else is left. Returns the new count. */
+uint32_t intersect_modifiers(struct modifier *mods, uint32_t count,
+const uint64_t *plane_mods, uint32_t plane_count) {
+	uint32_t n = 0, linear = 0;
+	for (uint32_t i=0; i<count; i++)
+		for (uint32_t j=0; j<plane_count; j++) {
+			if (mods[i].modifier != plane_mods[j])
+				continue;
+			if (mods[i].modifier == DRM_FORMAT_MOD_LINEAR)
+				linear = 1;
+			else
+				mods[n++] = mods[i];
+			break;
+		}
+	if (n == 0 && linear) {
+		mods[0].modifier = DRM_FORMAT_MOD_LINEAR;
+		mods[0].planes = 1;
+		n = 1;
+	}
+	return n;
+}
 
-VkImage create_image(VkDevice dev, uint32_t width, uint32_t height) {
+/* Without modifiers the image is linear. Otherwise the driver picks the best
+ * of the given modifiers. */
+VkImage create_image(VkDevice dev, uint32_t width, uint32_t height,
+VkImageUsageFlags usage, const struct modifier *mods, uint32_t mod_count) {
+	uint64_t modifiers[max_modifiers];
+	for (uint32_t i=0; i<mod_count; i++)
+		modifiers[i] = mods[i].modifier;
+	VkImageDrmFormatModifierListCreateInfoEXT modifierInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT,
+		.drmFormatModifierCount = mod_count,
+		.pDrmFormatModifiers = modifiers
+	};
+	VkExternalMemoryImageCreateInfo externalInfo = {
+		.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+		.pNext = mod_count ? &modifierInfo : NULL,
+		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT
+	};
 	VkImageCreateInfo imageCreateInfo = {
 		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-		.pNext = 0,
+		.pNext = &externalInfo,
 		.flags = 0,
 		.imageType = VK_IMAGE_TYPE_2D,
 		.format = VK_FORMAT_B8G8R8A8_UNORM, // TODO
@@ -87,8 +456,9 @@ VkImage create_image(VkDevice dev, uint32_t width, uint32_t height) {
 		.mipLevels = 1,
 		.arrayLayers = 1,
 		.samples = VK_SAMPLE_COUNT_1_BIT,
-		.tiling = VK_IMAGE_TILING_LINEAR,
-		.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT, // or SRC
+		.tiling = mod_count ? VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT :
+		VK_IMAGE_TILING_LINEAR,
+		.usage = usage,
 		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
 //		.queueFamilyIndexCount = 0, ignored
 //		.pQueueFamilyIndices = 0, ignored
@@ -102,248 +472,4477 @@ VkImage create_image(VkDevice dev, uint32_t width, uint32_t height) {
 	return img;
 }
 
-uint32_t findMemoryType(VkPhysicalDevice pdev, uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-	VkPhysicalDeviceMemoryProperties memProperties;
-	vkGetPhysicalDeviceMemoryProperties(pdev, &memProperties);
+/* Imports a dma-buf someone else rendered into, for the GPU to copy from.
+ * Every memory plane has to be in fd, which stays open. Returns
+ * VK_NULL_HANDLE if the driver does not take the layout. */
+VkImage import_image(VkDevice dev, int fd, uint32_t width, uint32_t height,
+uint64_t modifier, uint32_t planes, const uint32_t *strides,
+const uint32_t *offsets, VkDeviceMemory *memory) {
+	VkSubresourceLayout layouts[4] = {0};
+	for (uint32_t i=0; i<planes; i++) {
+		layouts[i].offset = offsets[i];
+		layouts[i].rowPitch = strides[i];
+	}
+	VkImageDrmFormatModifierExplicitCreateInfoEXT modifierInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT,
+		.drmFormatModifier = modifier,
+		.drmFormatModifierPlaneCount = planes,
+		.pPlaneLayouts = layouts
+	};
+	VkExternalMemoryImageCreateInfo externalInfo = {
+		.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+		.pNext = &modifierInfo,
+		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT
+	};
+	VkImageCreateInfo imageCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.pNext = &externalInfo,
+		.imageType = VK_IMAGE_TYPE_2D,
+		.format = VK_FORMAT_B8G8R8A8_UNORM,
+		.extent = {width, height, 1},
+		.mipLevels = 1,
+		.arrayLayers = 1,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT,
+		.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+	};
+	VkImage img;
+	if (vkCreateImage(dev, &imageCreateInfo, NULL, &img)) {
+		fprintf(stderr, "ERROR: import_image() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+
+	VkMemoryFdPropertiesKHR fdProps = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR
+	};
+	VkMemoryRequirements req;
+	vkGetImageMemoryRequirements(dev, img, &req);
+	uint32_t types = req.memoryTypeBits;
+	if (vkGetMemoryFdProperties(dev,
+	VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT, fd, &fdProps) == VK_SUCCESS)
+		types &= fdProps.memoryTypeBits;
+	uint32_t type = 0;
+	while (type < 32 && !(types & (1u << type)))
+		type++;
+	/* The import takes ownership of the fd, but only if it succeeds. */
+	VkMemoryDedicatedAllocateInfo dedicatedInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+		.image = img
+	};
+	VkImportMemoryFdInfoKHR importInfo = {
+		.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR,
+		.pNext = dedicated_allocation ? &dedicatedInfo : NULL,
+		.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+		.fd = dup(fd)
+	};
+	VkMemoryAllocateInfo allocInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.pNext = &importInfo,
+		.allocationSize = req.size,
+		.memoryTypeIndex = type
+	};
+	if (type == 32 || importInfo.fd < 0 ||
+	vkAllocateMemory(dev, &allocInfo, NULL, memory)) {
+		fprintf(stderr, "ERROR: import_image() failed.\n");
+		if (importInfo.fd >= 0)
+			close(importInfo.fd);
+		vkDestroyImage(dev, img, NULL);
+		return VK_NULL_HANDLE;
+	}
+	if (vkBindImageMemory(dev, img, *memory, 0)) {
+		fprintf(stderr, "vkBindImageMemory failed\n");
+		vkFreeMemory(dev, *memory, NULL);
+		vkDestroyImage(dev, img, NULL);
+		return VK_NULL_HANDLE;
+	}
+	return img;
+}
 
-	for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++)
-		if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties)
+/* Returns UINT32_MAX if no allowed memory type has all the properties. */
+uint32_t findMemoryType(const VkPhysicalDeviceMemoryProperties *memProperties,
+uint32_t typeFilter, VkMemoryPropertyFlags properties) {
+	for (uint32_t i = 0; i < memProperties->memoryTypeCount; i++)
+		if ((typeFilter & (1 << i)) && (memProperties->memoryTypes[i].propertyFlags & properties) == properties)
 			return i;
 
-	return 0;
+	return UINT32_MAX;
 }
 
-VkDeviceMemory allocate_memory(VkPhysicalDevice pdev, VkDevice dev, VkImage img) {
-	VkMemoryRequirements memreq;
-	vkGetImageMemoryRequirements(dev, img, &memreq);
+/* Images and buffers are placed in large blocks of one memory type, so the
+ * number of vkAllocateMemory calls stays far below maxMemoryAllocationCount.
+ * Resources that need their own VkDeviceMemory get a dedicated allocation;
+ * that is only known with VK_KHR_get_memory_requirements2. This is the
+ * allocator of the top-level main.c with dma-buf export added, copied since
+ * every directory builds on its own. */
+#define block_size (64ull << 20)
 
-	uint32_t index = findMemoryType(pdev, memreq.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+struct mem_range {
+	VkDeviceSize offset, size;
+	int linear;
+};
 
-	VkMemoryAllocateInfo memoryAllocateInfo = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		.pNext = 0,
-		.allocationSize = memreq.size,
-		.memoryTypeIndex = index
+struct mem_block {
+	VkDeviceMemory memory;
+	uint32_t type;
+	VkDeviceSize size;
+	void *mapped; // the whole block, NULL until map_memory() needs it
+	/* Sorted by offset. */
+	struct mem_range *ranges;
+	uint32_t count, capacity;
+};
+
+struct allocator {
+	VkDevice dev;
+	VkPhysicalDeviceMemoryProperties props;
+	/* Linear and non-linear resources must not share a page this big. */
+	VkDeviceSize granularity;
+	struct mem_block *blocks;
+	uint32_t block_count;
+	uint32_t dedicated_count;
+	VkDeviceSize used, dedicated_bytes;
+};
+
+struct allocation {
+	VkDeviceMemory memory;
+	VkDeviceSize offset, size;
+	int dedicated;
+};
+
+void init_allocator(struct allocator *a, VkPhysicalDevice pdev, VkDevice dev) {
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(pdev, &props);
+	*a = (struct allocator){
+		.dev = dev,
+		.granularity = props.limits.bufferImageGranularity
 	};
-	VkDeviceMemory mem;
-	if (vkAllocateMemory(dev, &memoryAllocateInfo, NULL, &mem)) {
-		fprintf(stderr, "ERROR: allocate_memory() failed.\n");
-		return VK_NULL_HANDLE;
+	vkGetPhysicalDeviceMemoryProperties(pdev, &a->props);
+}
+
+static VkDeviceSize align_up(VkDeviceSize v, VkDeviceSize alignment) {
+	return alignment > 1 ? (v + alignment - 1) / alignment * alignment : v;
+}
+
+/* First fit. Returns the index of the range to insert before, or -1. */
+static int64_t find_space(const struct allocator *a, const struct mem_block *b,
+const VkMemoryRequirements *req, int linear, VkDeviceSize *offset) {
+	for (uint32_t i=0; i<=b->count; i++) {
+		const struct mem_range *prev = i > 0 ? &b->ranges[i-1] : NULL;
+		const struct mem_range *next = i < b->count ? &b->ranges[i] : NULL;
+		VkDeviceSize start = prev ? prev->offset + prev->size : 0;
+		if (prev && prev->linear != linear)
+			start = align_up(start, a->granularity);
+		start = align_up(start, req->alignment);
+		VkDeviceSize end = start + req->size;
+		if (next && next->linear != linear)
+			end = align_up(end, a->granularity);
+		if (end <= (next ? next->offset : b->size)) {
+			*offset = start;
+			return i;
+		}
 	}
-	return mem;
+	return -1;
 }
 
-VkCommandPool create_command_pool(VkDevice dev) {
-	VkCommandPoolCreateInfo info = {
-		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-	};
-	VkCommandPool pool;
-	if (vkCreateCommandPool(dev, &info, NULL, &pool)) {
-		fprintf(stderr, "ERROR: create_command_pool() failed.\n");
-		return VK_NULL_HANDLE;
+static int insert_range(struct mem_block *b, uint32_t i, struct mem_range r) {
+	if (b->count == b->capacity) {
+		uint32_t capacity = b->capacity ? 2 * b->capacity : 16;
+		struct mem_range *ranges = realloc(b->ranges,
+		capacity * sizeof(*ranges));
+		if (!ranges)
+			return -1;
+		b->ranges = ranges;
+		b->capacity = capacity;
 	}
-	return pool;
+	memmove(&b->ranges[i+1], &b->ranges[i], (b->count - i) * sizeof(r));
+	b->ranges[i] = r;
+	b->count++;
+	return 0;
 }
 
-VkCommandBuffer record_command_clear(VkDevice dev, VkCommandPool pool, VkImage img) {
-	VkCommandBufferAllocateInfo info = {
-		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-		.commandPool = pool,
-		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-		.commandBufferCount = 1
+static int allocate_dedicated(struct allocator *a, const VkMemoryRequirements *req,
+uint32_t type, VkImage img, VkBuffer buf,
+VkExternalMemoryHandleTypeFlags export_types, struct allocation *out) {
+	VkMemoryDedicatedAllocateInfo dedicatedInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+		.image = img,
+		.buffer = buf
 	};
-	VkCommandBuffer cmdbuf;
-	vkAllocateCommandBuffers(dev, &info, &cmdbuf);
-
-	VkCommandBufferBeginInfo infoBegin = {
-		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-		.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT
+	/* Without VK_KHR_dedicated_allocation it is just an allocation of its
+	 * own. */
+	void *dedicated = dedicated_allocation ? &dedicatedInfo : NULL;
+	VkExportMemoryAllocateInfo exportInfo = {
+		.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO,
+		.pNext = dedicated,
+		.handleTypes = export_types
 	};
-	vkBeginCommandBuffer(cmdbuf, &infoBegin);
-
-	VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
-	VkClearColorValue color = {0.8984375f, 0.8984375f, 0.9765625f, 1.0f};
-	vkCmdClearColorImage(cmdbuf, img,
-	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
-
-	vkEndCommandBuffer(cmdbuf);
-	return cmdbuf;
+	VkMemoryAllocateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.pNext = export_types ? (void *)&exportInfo : dedicated,
+		.allocationSize = req->size,
+		.memoryTypeIndex = type
+	};
+	if (vkAllocateMemory(a->dev, &info, NULL, &out->memory)) {
+		fprintf(stderr, "ERROR: allocate_dedicated() failed.\n");
+		return -1;
+	}
+	out->offset = 0;
+	out->size = req->size;
+	out->dedicated = 1;
+	a->dedicated_count++;
+	a->dedicated_bytes += req->size;
+	return 0;
 }
 
-int drm_init() {
-	int fd = open("/dev/dri/card0", O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		return -1;
+static int allocate_range(struct allocator *a, const VkMemoryRequirements *req,
+uint32_t type, int linear, struct allocation *out) {
+	struct mem_block *b = NULL;
+	VkDeviceSize offset = 0;
+	int64_t i = -1;
+	for (uint32_t j=0; j<a->block_count && i<0; j++) {
+		if (a->blocks[j].type != type)
+			continue;
+		b = &a->blocks[j];
+		i = find_space(a, b, req, linear, &offset);
 	}
-	if (!drmIsMaster(fd)) {
-		fprintf(stderr, "not drm master\n");
-		return -1;
+	if (i < 0) {
+		struct mem_block *blocks = realloc(a->blocks,
+		(a->block_count + 1) * sizeof(*blocks));
+		if (!blocks)
+			return -1;
+		a->blocks = blocks;
+		b = &a->blocks[a->block_count];
+		*b = (struct mem_block){.type = type, .size = block_size};
+		VkMemoryAllocateInfo info = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			.allocationSize = b->size,
+			.memoryTypeIndex = type
+		};
+		if (vkAllocateMemory(a->dev, &info, NULL, &b->memory)) {
+			fprintf(stderr, "ERROR: allocate_range() failed.\n");
+			return -1;
+		}
+		a->block_count++;
+		i = 0;
 	}
-	if(drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
-		fprintf(stderr, "no atomic modesetting\n");
+	struct mem_range r = {offset, req->size, linear};
+	if (insert_range(b, i, r) < 0)
 		return -1;
-	}
-	return fd;
+	out->memory = b->memory;
+	out->offset = offset;
+	out->size = req->size;
+	out->dedicated = 0;
+	a->used += req->size;
+	return 0;
 }
 
-int scanout(int fd, uint32_t handle) { //TODO add arguments
-	uint32_t handles[4] = {0};
-	uint32_t strides[4] = {0};
-	uint32_t offsets[4] = {0};
-	uint64_t modifiers[4] = {0};
-
-	uint32_t width = 1366;
-	uint32_t height = 768;
-	uint32_t format = DRM_FORMAT_XRGB8888;
-	handles[0] = handle;
-	strides[0] = 5464;
-	offsets[0] = 0;
-	modifiers[0] = 0;
-
-	drmModeAtomicReq *req = drmModeAtomicAlloc();
-	uint32_t fb_id;
-	if (drmModeAddFB2WithModifiers(fd, width, height, format,
-		 handles, strides, offsets, modifiers, &fb_id, 0)) {
-		perror("drmModeAddFB2WithModifiers");
+/* Dedicated allocations are used when the driver requires one, when the
+ * memory is exported, or when the resource would not fit in a block. */
+static int allocate(struct allocator *a, const VkMemoryRequirements *req,
+int requires_dedicated, VkMemoryPropertyFlags flags, int linear, VkImage img,
+VkBuffer buf, VkExternalMemoryHandleTypeFlags export_types,
+struct allocation *out) {
+	uint32_t type = findMemoryType(&a->props, req->memoryTypeBits, flags);
+	if (type == UINT32_MAX) {
+		fprintf(stderr, "no memory type with properties 0x%x in 0x%x\n",
+		flags, req->memoryTypeBits);
 		return -1;
 	}
-	if (drmModeAtomicAddProperty(req, 28, 16, fb_id) < 0) {
-		perror("drmModeAtomicAddProperty");
+	if (requires_dedicated || export_types || req->size > block_size)
+		return allocate_dedicated(a, req, type, img, buf, export_types, out);
+	return allocate_range(a, req, type, linear, out);
+}
+
+/* Allocates and binds memory for the image. linear is false for optimally
+ * tiled images. */
+int allocate_image_memory(struct allocator *a, VkImage img,
+VkMemoryPropertyFlags flags, int linear,
+VkExternalMemoryHandleTypeFlags export_types, struct allocation *out) {
+	VkImageMemoryRequirementsInfo2 info = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2,
+		.image = img
+	};
+	VkMemoryDedicatedRequirements dedicated = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS
+	};
+	VkMemoryRequirements2 req = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+		.pNext = &dedicated
+	};
+	if (vkGetImageRequirements2)
+		vkGetImageRequirements2(a->dev, &info, &req);
+	else
+		vkGetImageMemoryRequirements(a->dev, img, &req.memoryRequirements);
+	if (allocate(a, &req.memoryRequirements,
+	dedicated.requiresDedicatedAllocation, flags, linear, img, VK_NULL_HANDLE,
+	export_types, out) < 0)
 		return -1;
-	}
-	if (drmModeAtomicCommit(fd, req, DRM_MODE_ATOMIC_NONBLOCK, 0)) {
-		perror("drmModeAtomicCommit");
+	if (vkBindImageMemory(a->dev, img, out->memory, out->offset)) {
+		fprintf(stderr, "vkBindImageMemory failed\n");
 		return -1;
 	}
-	drmModeAtomicFree(req);
+	return 0;
 }
 
-int restore(int fd) {
-	drmModeAtomicReq *req = drmModeAtomicAlloc();
-	if (drmModeAtomicAddProperty(req, 28, 16, 88) < 0) {
-		perror("drmModeAtomicAddProperty");
+int allocate_buffer_memory(struct allocator *a, VkBuffer buf,
+VkMemoryPropertyFlags flags, VkExternalMemoryHandleTypeFlags export_types,
+struct allocation *out) {
+	VkBufferMemoryRequirementsInfo2 info = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2,
+		.buffer = buf
+	};
+	VkMemoryDedicatedRequirements dedicated = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS
+	};
+	VkMemoryRequirements2 req = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+		.pNext = &dedicated
+	};
+	if (vkGetBufferRequirements2)
+		vkGetBufferRequirements2(a->dev, &info, &req);
+	else
+		vkGetBufferMemoryRequirements(a->dev, buf, &req.memoryRequirements);
+	if (allocate(a, &req.memoryRequirements,
+	dedicated.requiresDedicatedAllocation, flags, 1, VK_NULL_HANDLE, buf,
+	export_types, out) < 0)
 		return -1;
-	}
-	if (drmModeAtomicCommit(fd, req, 0, 0)) {
-		perror("drmModeAtomicCommit");
+	if (vkBindBufferMemory(a->dev, buf, out->memory, out->offset)) {
+		fprintf(stderr, "vkBindBufferMemory failed\n");
 		return -1;
 	}
-	drmModeAtomicFree(req);
+	return 0;
 }
 
-void drm_fini(int fd) {
-	close(fd);
+/* A VkDeviceMemory can only be mapped once, so host-visible allocations
+ * share their block's mapping. Freeing the memory also unmaps it. */
+void *map_memory(struct allocator *a, const struct allocation *m) {
+	void *data = NULL;
+	if (m->dedicated) {
+		if (vkMapMemory(a->dev, m->memory, 0, m->size, 0, &data))
+			return NULL;
+		return data;
+	}
+	for (uint32_t j=0; j<a->block_count; j++) {
+		struct mem_block *b = &a->blocks[j];
+		if (b->memory != m->memory)
+			continue;
+		if (!b->mapped && vkMapMemory(a->dev, b->memory, 0, VK_WHOLE_SIZE, 0,
+		&b->mapped))
+			return NULL;
+		return (char *)b->mapped + m->offset;
+	}
+	return NULL;
+}
+
+/* Empty blocks are given back to the driver. */
+void free_memory(struct allocator *a, struct allocation *m) {
+	if (m->dedicated) {
+		vkFreeMemory(a->dev, m->memory, NULL);
+		a->dedicated_count--;
+		a->dedicated_bytes -= m->size;
+		return;
+	}
+	for (uint32_t j=0; j<a->block_count; j++) {
+		struct mem_block *b = &a->blocks[j];
+		if (b->memory != m->memory)
+			continue;
+		for (uint32_t i=0; i<b->count; i++) {
+			if (b->ranges[i].offset != m->offset)
+				continue;
+			memmove(&b->ranges[i], &b->ranges[i+1],
+			(b->count - i - 1) * sizeof(b->ranges[i]));
+			b->count--;
+			a->used -= m->size;
+			break;
+		}
+		if (b->count == 0) {
+			vkFreeMemory(a->dev, b->memory, NULL);
+			free(b->ranges);
+			a->blocks[j] = a->blocks[--a->block_count];
+		}
+		return;
+	}
 }
 
-drm_intel_bufmgr *intel_init(int fd) {
-	drm_intel_bufmgr *bufmgr = drm_intel_bufmgr_gem_init(fd, 32);
-	if (!bufmgr)
-		fprintf(stderr, "drm_intel_bufmgr_gem_init failed\n");
-	return bufmgr;
+void print_allocator(const struct allocator *a) {
+	printf("memory: %u block(s) of %llu MiB, %" PRIu64 " KiB used; "
+	"%u dedicated, %" PRIu64 " KiB\n", a->block_count, block_size >> 20,
+	(uint64_t)a->used >> 10, a->dedicated_count,
+	(uint64_t)a->dedicated_bytes >> 10);
 }
 
-drm_intel_bo *intel_import(drm_intel_bufmgr *bufmgr, int prime_fd) {
-	drm_intel_bo *intel_bo =
-	 drm_intel_bo_gem_create_from_prime(bufmgr, prime_fd, 0); // let it query the size
-	if (!intel_bo)
-		fprintf(stderr, "drm_intel_bo_gem_create_from_prime failed\n");
-	uint32_t tiling_mode, swizzle_mode;
-	if (drm_intel_bo_get_tiling(intel_bo, &tiling_mode, &swizzle_mode)) {
-		fprintf(stderr, "failed to get tiling info\n");
+/* All allocations must have been freed. */
+void fini_allocator(struct allocator *a) {
+	for (uint32_t j=0; j<a->block_count; j++) {
+		vkFreeMemory(a->dev, a->blocks[j].memory, NULL);
+		free(a->blocks[j].ranges);
 	}
-	printf("tiling_mode is %zu\n", tiling_mode);
-	return intel_bo;
+	free(a->blocks);
 }
 
-void intel_fini(drm_intel_bufmgr *bufmgr, drm_intel_bo *intel_bo) {
-	drm_intel_bo_unreference(intel_bo);
-	drm_intel_bufmgr_destroy(bufmgr);
+VkCommandPool create_command_pool(VkDevice dev, uint32_t family) {
+	VkCommandPoolCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.queueFamilyIndex = family,
+		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT
+	};
+	VkCommandPool pool;
+	if (vkCreateCommandPool(dev, &info, NULL, &pool)) {
+		fprintf(stderr, "ERROR: create_command_pool() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return pool;
 }
 
-int main() {
-	VkInstance instance = create_instance();
-	if (instance == VK_NULL_HANDLE)
-		return EXIT_FAILURE;
+/* Two timestamps per pass: before and after. */
+VkQueryPool create_query_pool(VkDevice dev, uint32_t passes) {
+	VkQueryPoolCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+		.queryType = VK_QUERY_TYPE_TIMESTAMP,
+		.queryCount = 2 * passes
+	};
+	VkQueryPool pool;
+	if (vkCreateQueryPool(dev, &info, NULL, &pool)) {
+		fprintf(stderr, "ERROR: create_query_pool() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return pool;
+}
 
-	VkPhysicalDevice physical_device = get_physical_device(instance);
-	if (physical_device == VK_NULL_HANDLE)
-		return EXIT_FAILURE;
+/* Returns the GPU time of a pass in ms, or a negative value on failure. */
+double get_pass_time(VkPhysicalDevice pdev, VkDevice dev, uint32_t queue_family,
+VkQueryPool queries, uint32_t pass) {
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(pdev, &props);
+	uint32_t n = 16;
+	VkQueueFamilyProperties families[16];
+	vkGetPhysicalDeviceQueueFamilyProperties(pdev, &n, families);
+	if (queue_family >= n || families[queue_family].timestampValidBits == 0)
+		return -1;
+	VkQueueFamilyProperties family = families[queue_family];
 
-	VkDevice device = create_device(instance, physical_device);
-	if (device == VK_NULL_HANDLE)
-		return EXIT_FAILURE;
+	uint64_t ts[2];
+	if (vkGetQueryPoolResults(dev, queries, 2 * pass, 2, sizeof(ts), ts,
+	sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT))
+		return -1;
+	uint64_t mask = family.timestampValidBits >= 64 ? UINT64_MAX :
+	(1ull << family.timestampValidBits) - 1;
+	return ((ts[1] - ts[0]) & mask) * props.limits.timestampPeriod / 1e6;
+}
 
-	VkImage image = create_image(device, 1366, 768);
-	VkDeviceMemory memory = allocate_memory(physical_device, device, image);
-	if (vkBindImageMemory(device, image, memory, 0) != VK_SUCCESS) {
-		fprintf(stderr, "vkBindImageMemory failed\n");
-		return EXIT_FAILURE;
+VkCommandBuffer allocate_command_buffer(VkDevice dev, VkCommandPool pool) {
+	VkCommandBufferAllocateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		.commandPool = pool,
+		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+		.commandBufferCount = 1
+	};
+	VkCommandBuffer cmdbuf;
+	if (vkAllocateCommandBuffers(dev, &info, &cmdbuf)) {
+		fprintf(stderr, "ERROR: allocate_command_buffer() failed.\n");
+		return VK_NULL_HANDLE;
 	}
+	return cmdbuf;
+}
 
-	VkQueue queue;
-	vkGetDeviceQueue(device, 0, 0, &queue);
+/* Fullscreen triangle, assembled by hand since the build has no shader
+ * compiler. Equivalent GLSL:
+ *
+ *	void main() {
+ *		vec2 uv = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+ *		gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);
+ *	}
+ */
+static const uint32_t fullscreen_vert[] = {
+	0x07230203, 0x00010000, 0x00000000, 0x0000001c, 0x00000000, 0x00020011,
+	0x00000001, 0x0003000e, 0x00000000, 0x00000001, 0x0007000f, 0x00000000,
+	0x00000001, 0x6e69616d, 0x00000000, 0x00000002, 0x00000003, 0x00040047,
+	0x00000002, 0x0000000b, 0x0000002a, 0x00040047, 0x00000003, 0x0000000b,
+	0x00000000, 0x00020013, 0x00000004, 0x00030021, 0x00000005, 0x00000004,
+	0x00040015, 0x00000006, 0x00000020, 0x00000001, 0x00030016, 0x00000007,
+	0x00000020, 0x00040017, 0x00000008, 0x00000007, 0x00000004, 0x00040020,
+	0x00000009, 0x00000001, 0x00000006, 0x00040020, 0x0000000a, 0x00000003,
+	0x00000008, 0x0004003b, 0x00000009, 0x00000002, 0x00000001, 0x0004003b,
+	0x0000000a, 0x00000003, 0x00000003, 0x0004002b, 0x00000006, 0x0000000b,
+	0x00000001, 0x0004002b, 0x00000006, 0x0000000c, 0x00000002, 0x0004002b,
+	0x00000007, 0x0000000d, 0x00000000, 0x0004002b, 0x00000007, 0x0000000e,
+	0x3f800000, 0x0004002b, 0x00000007, 0x0000000f, 0x40000000, 0x00050036,
+	0x00000004, 0x00000001, 0x00000000, 0x00000005, 0x000200f8, 0x00000010,
+	0x0004003d, 0x00000006, 0x00000011, 0x00000002, 0x000500c4, 0x00000006,
+	0x00000012, 0x00000011, 0x0000000b, 0x000500c7, 0x00000006, 0x00000013,
+	0x00000012, 0x0000000c, 0x000500c7, 0x00000006, 0x00000014, 0x00000011,
+	0x0000000c, 0x0004006f, 0x00000007, 0x00000015, 0x00000013, 0x0004006f,
+	0x00000007, 0x00000016, 0x00000014, 0x00050085, 0x00000007, 0x00000017,
+	0x00000015, 0x0000000f, 0x00050085, 0x00000007, 0x00000018, 0x00000016,
+	0x0000000f, 0x00050083, 0x00000007, 0x00000019, 0x00000017, 0x0000000e,
+	0x00050083, 0x00000007, 0x0000001a, 0x00000018, 0x0000000e, 0x00070050,
+	0x00000008, 0x0000001b, 0x00000019, 0x0000001a, 0x0000000d, 0x0000000e,
+	0x0003003e, 0x00000003, 0x0000001b, 0x000100fd, 0x00010038
+};
 
-	VkCommandPool command_pool = create_command_pool(device);
-	if (command_pool == VK_NULL_HANDLE)
-		return EXIT_FAILURE;
+/*	layout(push_constant) uniform Push { vec4 color; } pc;
+ *	layout(location = 0) out vec4 outColor;
+ *	void main() { outColor = pc.color; }
+ */
+static const uint32_t fullscreen_frag[] = {
+	0x07230203, 0x00010000, 0x00000000, 0x00000011, 0x00000000, 0x00020011,
+	0x00000001, 0x0003000e, 0x00000000, 0x00000001, 0x0006000f, 0x00000004,
+	0x00000001, 0x6e69616d, 0x00000000, 0x00000002, 0x00030010, 0x00000001,
+	0x00000007, 0x00040047, 0x00000002, 0x0000001e, 0x00000000, 0x00050048,
+	0x00000008, 0x00000000, 0x00000023, 0x00000000, 0x00030047, 0x00000008,
+	0x00000002, 0x00020013, 0x00000003, 0x00030021, 0x00000004, 0x00000003,
+	0x00030016, 0x00000005, 0x00000020, 0x00040017, 0x00000006, 0x00000005,
+	0x00000004, 0x00040015, 0x00000007, 0x00000020, 0x00000001, 0x0003001e,
+	0x00000008, 0x00000006, 0x00040020, 0x00000009, 0x00000009, 0x00000008,
+	0x0004003b, 0x00000009, 0x0000000a, 0x00000009, 0x00040020, 0x0000000b,
+	0x00000009, 0x00000006, 0x00040020, 0x0000000c, 0x00000003, 0x00000006,
+	0x0004003b, 0x0000000c, 0x00000002, 0x00000003, 0x0004002b, 0x00000007,
+	0x0000000d, 0x00000000, 0x00050036, 0x00000003, 0x00000001, 0x00000000,
+	0x00000004, 0x000200f8, 0x0000000e, 0x00050041, 0x0000000b, 0x0000000f,
+	0x0000000a, 0x0000000d, 0x0004003d, 0x00000006, 0x00000010, 0x0000000f,
+	0x0003003e, 0x00000002, 0x00000010, 0x000100fd, 0x00010038
+};
 
-	VkCommandBuffer cmd_clear = record_command_clear(device, command_pool, image);
+/* Draws full redraws into the scanout images instead of clearing them. The
+ * pass discards the old contents and leaves the image in
+ * TRANSFER_DST_OPTIMAL, for the layers to be copied over it. */
+struct pipeline {
+	VkRenderPass render_pass;
+	VkPipelineLayout layout;
+	VkPipeline pipeline;
+};
 
-	VkSubmitInfo submitInfo = {
-		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-		.commandBufferCount = 1,
-		.pCommandBuffers = &cmd_clear
+static VkRenderPass create_render_pass(VkDevice dev, VkFormat format) {
+	VkAttachmentDescription attachment = {
+		.format = format,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+		.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+		.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+		.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
 	};
-	vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-	vkQueueWaitIdle(queue);
-
-	VkImageSubresource subresource = {
-		.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-		.mipLevel = 0,
-		.arrayLayer = 0
+	VkAttachmentReference ref = {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+	VkSubpassDescription subpass = {
+		.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+		.colorAttachmentCount = 1,
+		.pColorAttachments = &ref
 	};
-	VkSubresourceLayout layout;
-	vkGetImageSubresourceLayout(device, image, &subresource, &layout);
-	printf("Created image with:\noffset %d\nsize %d\nrowPitch %d\narrayPitch %d\ndepthPitch %d\n",
-	 layout.offset, layout.size, layout.rowPitch, layout.arrayPitch,
-	  layout.depthPitch);
+	/* The first chains with the semaphore wait on the scanout release and
+	 * with the acquire from VK_QUEUE_FAMILY_FOREIGN_EXT, both at the
+	 * transfer stage; the second makes the draw visible to the copies. */
+	VkSubpassDependency dependencies[2] = {
+		{
+			.srcSubpass = VK_SUBPASS_EXTERNAL,
+			.dstSubpass = 0,
+			.srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT |
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			.srcAccessMask = 0,
+			.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+		}, {
+			.srcSubpass = 0,
+			.dstSubpass = VK_SUBPASS_EXTERNAL,
+			.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+			.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT |
+			VK_ACCESS_TRANSFER_WRITE_BIT
+		}
+	};
+	VkRenderPassCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+		.attachmentCount = 1,
+		.pAttachments = &attachment,
+		.subpassCount = 1,
+		.pSubpasses = &subpass,
+		.dependencyCount = 2,
+		.pDependencies = dependencies
+	};
+	VkRenderPass render_pass;
+	if (vkCreateRenderPass(dev, &info, NULL, &render_pass)) {
+		fprintf(stderr, "ERROR: create_render_pass() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return render_pass;
+}
 
-	VkMemoryGetFdInfoKHR getFdInfo = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR,
-		.pNext = NULL,
-		.memory = memory,
-		.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT
+static VkShaderModule create_shader_module(VkDevice dev, const uint32_t *code,
+size_t size) {
+	VkShaderModuleCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = size,
+		.pCode = code
 	};
-	int fd;
-	vkGetMemoryFd(device, &getFdInfo, &fd);
-	printf("Exported fd %d\n", fd);
+	VkShaderModule module;
+	if (vkCreateShaderModule(dev, &info, NULL, &module)) {
+		fprintf(stderr, "ERROR: create_shader_module() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return module;
+}
 
-/* drm code */
-	int drm_fd = drm_init();
-	if (drm_fd < 0)
-		return EXIT_FAILURE;
+/* Named after pipelineCacheUUID, so a driver update that invalidates the
+ * binaries starts a new file. */
+void pipeline_cache_path(VkPhysicalDevice pdev, char *path, size_t size) {
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(pdev, &props);
+	int n = snprintf(path, size, "pipeline-cache-");
+	for (int i=0; i<VK_UUID_SIZE && n < (int)size; i++)
+		n += snprintf(path + n, size - n, "%02x", props.pipelineCacheUUID[i]);
+	if (n < (int)size)
+		snprintf(path + n, size - n, ".bin");
+}
 
-	drm_intel_bufmgr *bufmgr = intel_init(drm_fd);
-	drm_intel_bo *intel_bo = intel_import(bufmgr, fd);
-	if (!intel_bo)
-		return EXIT_FAILURE;
+/* Only data written by this exact device and driver is handed to Vulkan. */
+static int valid_cache_header(VkPhysicalDevice pdev, const uint8_t *data,
+size_t size) {
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(pdev, &props);
+	uint32_t header[4];
+	if (size < sizeof(header) + VK_UUID_SIZE)
+		return 0;
+	memcpy(header, data, sizeof(header));
+	return header[0] >= sizeof(header) + VK_UUID_SIZE &&
+	header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+	header[2] == props.vendorID && header[3] == props.deviceID &&
+	!memcmp(data + sizeof(header), props.pipelineCacheUUID, VK_UUID_SIZE);
+}
 
-	if (scanout(drm_fd, intel_bo->handle) < 0)
-		return EXIT_FAILURE;
-	sleep(1);
-	if (restore(drm_fd) < 0)
-		return EXIT_FAILURE;
-	intel_fini(bufmgr, intel_bo);
-	drm_fini(drm_fd);
+VkPipelineCache load_pipeline_cache(VkPhysicalDevice pdev, VkDevice dev,
+const char *path, int *hit) {
+	void *data = NULL;
+	size_t size = 0;
+	FILE *f = fopen(path, "rb");
+	if (f) {
+		if (!fseek(f, 0, SEEK_END) && (long)(size = ftell(f)) > 0 &&
+		!fseek(f, 0, SEEK_SET) && (data = malloc(size)) &&
+		fread(data, 1, size, f) != size) {
+			free(data);
+			data = NULL;
+		}
+		fclose(f);
+	}
+	*hit = data && valid_cache_header(pdev, data, size);
+	VkPipelineCacheCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+		.initialDataSize = *hit ? size : 0,
+		.pInitialData = *hit ? data : NULL
+	};
+	VkPipelineCache cache;
+	VkResult res = vkCreatePipelineCache(dev, &info, NULL, &cache);
+	free(data);
+	if (res) {
+		fprintf(stderr, "ERROR: load_pipeline_cache() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return cache;
+}
 
-	vkFreeCommandBuffers(device, command_pool, 1, &cmd_clear);
+/* Writes a temporary file first so a crash never leaves a truncated cache. */
+int save_pipeline_cache(VkDevice dev, VkPipelineCache cache, const char *path) {
+	size_t size = 0;
+	if (vkGetPipelineCacheData(dev, cache, &size, NULL))
+		return -1;
+	void *data = malloc(size);
+	if (!data || vkGetPipelineCacheData(dev, cache, &size, data)) {
+		free(data);
+		return -1;
+	}
+	char tmp[256];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(tmp, "wb");
+	int ok = f && fwrite(data, 1, size, f) == size;
+	if (f)
+		ok &= !fclose(f);
+	free(data);
+	if (!ok || rename(tmp, path)) {
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Viewport and scissor are dynamic so the pipeline does not depend on the
+ * mode. */
+int create_pipeline(VkDevice dev, VkPipelineCache cache, VkFormat format,
+struct pipeline *p) {
+	p->render_pass = create_render_pass(dev, format);
+	if (p->render_pass == VK_NULL_HANDLE)
+		return -1;
+
+	VkPushConstantRange range = {VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+	4 * sizeof(float)};
+	VkPipelineLayoutCreateInfo layout_info = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+		.pushConstantRangeCount = 1,
+		.pPushConstantRanges = &range
+	};
+	if (vkCreatePipelineLayout(dev, &layout_info, NULL, &p->layout)) {
+		fprintf(stderr, "ERROR: create_pipeline() failed.\n");
+		return -1;
+	}
+
+	VkShaderModule vert = create_shader_module(dev, fullscreen_vert,
+	sizeof(fullscreen_vert));
+	VkShaderModule frag = create_shader_module(dev, fullscreen_frag,
+	sizeof(fullscreen_frag));
+	if (vert == VK_NULL_HANDLE || frag == VK_NULL_HANDLE)
+		return -1;
+	VkPipelineShaderStageCreateInfo stages[] = {
+		{
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_VERTEX_BIT,
+			.module = vert,
+			.pName = "main"
+		}, {
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+			.module = frag,
+			.pName = "main"
+		}
+	};
+	VkPipelineVertexInputStateCreateInfo vertex_input = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO
+	};
+	VkPipelineInputAssemblyStateCreateInfo input_assembly = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+		.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST
+	};
+	VkPipelineViewportStateCreateInfo viewport = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+		.viewportCount = 1,
+		.scissorCount = 1
+	};
+	VkPipelineRasterizationStateCreateInfo rasterization = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+		.polygonMode = VK_POLYGON_MODE_FILL,
+		.cullMode = VK_CULL_MODE_NONE,
+		.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
+		.lineWidth = 1.0f
+	};
+	VkPipelineMultisampleStateCreateInfo multisample = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+		.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT
+	};
+	VkPipelineColorBlendAttachmentState blend_attachment = {
+		.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+		VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT
+	};
+	VkPipelineColorBlendStateCreateInfo blend = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+		.attachmentCount = 1,
+		.pAttachments = &blend_attachment
+	};
+	VkDynamicState dynamic_states[] = {
+		VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR
+	};
+	VkPipelineDynamicStateCreateInfo dynamic = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+		.dynamicStateCount = 2,
+		.pDynamicStates = dynamic_states
+	};
+	VkGraphicsPipelineCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+		.stageCount = 2,
+		.pStages = stages,
+		.pVertexInputState = &vertex_input,
+		.pInputAssemblyState = &input_assembly,
+		.pViewportState = &viewport,
+		.pRasterizationState = &rasterization,
+		.pMultisampleState = &multisample,
+		.pColorBlendState = &blend,
+		.pDynamicState = &dynamic,
+		.layout = p->layout,
+		.renderPass = p->render_pass,
+		.subpass = 0
+	};
+	VkResult res = vkCreateGraphicsPipelines(dev, cache, 1, &info, NULL,
+	&p->pipeline);
+	vkDestroyShaderModule(dev, vert, NULL);
+	vkDestroyShaderModule(dev, frag, NULL);
+	if (res) {
+		fprintf(stderr, "ERROR: create_pipeline() failed.\n");
+		return -1;
+	}
+	return 0;
+}
+
+void destroy_pipeline(VkDevice dev, struct pipeline *p) {
+	vkDestroyPipeline(dev, p->pipeline, NULL);
+	vkDestroyPipelineLayout(dev, p->layout, NULL);
+	vkDestroyRenderPass(dev, p->render_pass, NULL);
+}
+
+/* An ARGB8888 image shown above the background. It sits on its own plane
+ * when the assignment passed a TEST_ONLY commit; otherwise the GPU copies it
+ * into the background every frame. Layers move, so the planes are tested
+ * again for every frame, which may composite a layer for that frame only. */
+#define max_layers 2
+
+struct layer {
+	const char *name;
+	VkImage image;
+	uint32_t fb_id;
+	uint32_t width, height;
+	int32_t x, y; // position on the CRTC, kept inside the mode
+	uint32_t plane_id; // 0 when composited by the GPU
+	uint32_t assigned_plane; // plane_id as of startup, tried for each frame
+	uint64_t fallback_frames; // composited since the plane refused it
+	const struct plane_props *prop;
+	/* Written outside Vulkan (a client buffer): the queue family copying it
+	 * takes it over from VK_QUEUE_FAMILY_FOREIGN_EXT and gives it back. */
+	int foreign;
+	uint32_t family;
+	int fresh; // foreign and never acquired yet: still UNDEFINED
+};
+
+/* Moves img between family and VK_QUEUE_FAMILY_FOREIGN_EXT: acquired before
+ * transfers read or write it, released after all of them. It is in GENERAL,
+ * except for an imported image's first acquire, which leaves UNDEFINED. */
+static void transfer_ownership(VkCommandBuffer cmdbuf, VkImage img,
+uint32_t family, int acquire, VkImageLayout old_layout) {
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = acquire ? 0 : VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = acquire ? VK_ACCESS_TRANSFER_READ_BIT |
+		VK_ACCESS_TRANSFER_WRITE_BIT : 0,
+		.oldLayout = old_layout,
+		.newLayout = VK_IMAGE_LAYOUT_GENERAL,
+		.srcQueueFamilyIndex = acquire ? VK_QUEUE_FAMILY_FOREIGN_EXT : family,
+		.dstQueueFamilyIndex = acquire ? family : VK_QUEUE_FAMILY_FOREIGN_EXT,
+		.image = img,
+		.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}
+	};
+	vkCmdPipelineBarrier(cmdbuf, acquire ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT :
+	VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, acquire ?
+	VK_PIPELINE_STAGE_TRANSFER_BIT : VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+	0, NULL, 0, NULL, 1, &barrier);
+}
+
+/* Layers without a plane are copied over the background, in order. img is in
+ * TRANSFER_DST_OPTIMAL with its background written; the layer images are in
+ * GENERAL and never change, except foreign ones. */
+static void record_composition(VkCommandBuffer cmdbuf, VkImage img,
+const struct layer *layers, uint32_t count) {
+	VkMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT
+	};
+	for (uint32_t i=0; i<count; i++) {
+		if (layers[i].plane_id)
+			continue;
+		if (layers[i].foreign)
+			transfer_ownership(cmdbuf, layers[i].image, layers[i].family, 1,
+			layers[i].fresh ? VK_IMAGE_LAYOUT_UNDEFINED :
+			VK_IMAGE_LAYOUT_GENERAL);
+		vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
+		VkImageCopy region = {
+			.srcSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
+			.dstSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
+			.dstOffset = {layers[i].x, layers[i].y, 0},
+			.extent = {layers[i].width, layers[i].height, 1}
+		};
+		vkCmdCopyImage(cmdbuf, layers[i].image, VK_IMAGE_LAYOUT_GENERAL, img,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+		if (layers[i].foreign)
+			transfer_ownership(cmdbuf, layers[i].image, layers[i].family, 0,
+			VK_IMAGE_LAYOUT_GENERAL);
+	}
+}
+
+/* Re-recorded every frame; n only changes the color. With a pipeline the
+ * background is drawn into fb rather than cleared. */
+void record_command_clear(VkCommandBuffer cmdbuf, VkImage img,
+VkQueryPool queries, const struct pipeline *p, VkFramebuffer fb,
+uint32_t width, uint32_t height, const struct layer *layers,
+uint32_t layer_count, uint64_t n) {
+	VkCommandBufferBeginInfo infoBegin = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+	};
+	vkBeginCommandBuffer(cmdbuf, &infoBegin);
+
+	vkCmdResetQueryPool(cmdbuf, queries, 0, 2);
+	vkCmdWriteTimestamp(cmdbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queries, 0);
+
+	VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+	VkClearColorValue color = {0.8984375f, 0.8984375f, 0.9765625f, 1.0f};
+	color.float32[2] = (n % 256) / 255.0f;
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = 0,
+		.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = img,
+		.subresourceRange = range
+	};
+	if (p) {
+		VkClearValue clear = {.color = color};
+		VkRenderPassBeginInfo info = {
+			.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+			.renderPass = p->render_pass,
+			.framebuffer = fb,
+			.renderArea = {{0, 0}, {width, height}},
+			.clearValueCount = 1,
+			.pClearValues = &clear
+		};
+		vkCmdBeginRenderPass(cmdbuf, &info, VK_SUBPASS_CONTENTS_INLINE);
+		vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, p->pipeline);
+		VkViewport viewport = {0, 0, width, height, 0, 1};
+		vkCmdSetViewport(cmdbuf, 0, 1, &viewport);
+		vkCmdSetScissor(cmdbuf, 0, 1, &info.renderArea);
+		float triangle[4] = {0.8984375f, 0.8984375f, (n % 256) / 255.0f, 1.0f};
+		vkCmdPushConstants(cmdbuf, p->layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+		sizeof(triangle), triangle);
+		vkCmdDraw(cmdbuf, 3, 1, 0, 0);
+		vkCmdEndRenderPass(cmdbuf);
+	} else {
+		/* Chains with the semaphore wait on the scanout release. */
+		vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+		vkCmdClearColorImage(cmdbuf, img,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
+	}
+	record_composition(cmdbuf, img, layers, layer_count);
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = 0;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+
+	vkCmdWriteTimestamp(cmdbuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queries, 1);
+	vkEndCommandBuffer(cmdbuf);
+}
+
+/* Damage in framebuffer pixels, as half-open drm_mode_rects: what changed
+ * since a buffer was last rendered into, or since the last flip. */
+#define max_damage_rects 8
+
+struct damage {
+	uint32_t count;
+	struct drm_mode_rect rects[max_damage_rects];
+};
+
+static struct drm_mode_rect rect_union(struct drm_mode_rect a,
+struct drm_mode_rect b) {
+	return (struct drm_mode_rect){
+		a.x1 < b.x1 ? a.x1 : b.x1, a.y1 < b.y1 ? a.y1 : b.y1,
+		a.x2 > b.x2 ? a.x2 : b.x2, a.y2 > b.y2 ? a.y2 : b.y2
+	};
+}
+
+/* Once full, the rectangles are merged into their bounding box. */
+void add_damage(struct damage *d, struct drm_mode_rect r) {
+	if (r.x1 >= r.x2 || r.y1 >= r.y2)
+		return;
+	if (d->count == max_damage_rects) {
+		for (uint32_t i=1; i<d->count; i++)
+			d->rects[0] = rect_union(d->rects[0], d->rects[i]);
+		d->count = 1;
+	}
+	d->rects[d->count++] = r;
+}
+
+void merge_damage(struct damage *dst, const struct damage *src) {
+	for (uint32_t i=0; i<src->count; i++)
+		add_damage(dst, src->rects[i]);
+}
+
+/* Overlapping rectangles are counted twice, so clamp to the image. */
+uint64_t damage_area(const struct damage *d, uint32_t width, uint32_t height) {
+	uint64_t area = 0;
+	for (uint32_t i=0; i<d->count; i++)
+		area += (uint64_t)(d->rects[i].x2 - d->rects[i].x1) *
+		(d->rects[i].y2 - d->rects[i].y1);
+	uint64_t pixels = (uint64_t)width * height;
+	return area < pixels ? area : pixels;
+}
+
+int damage_is_full(const struct damage *d, uint32_t width, uint32_t height) {
+	for (uint32_t i=0; i<d->count; i++)
+		if (d->rects[i].x1 <= 0 && d->rects[i].y1 <= 0 &&
+		d->rects[i].x2 >= (int32_t)width && d->rects[i].y2 >= (int32_t)height)
+			return 1;
+	return 0;
+}
+
+/* Damage mode draws a square crossing a static background. */
+struct drm_mode_rect square_rect(uint64_t n, uint32_t size, uint32_t width,
+uint32_t height) {
+	int32_t x = (n * 4) % (width - size + 1);
+	int32_t y = (height - size) / 2;
+	return (struct drm_mode_rect){x, y, x + size, y + size};
+}
+
+/* Outside a render pass clears cannot be limited to a rectangle, so partial
+ * updates copy from solid tiles: the background first, then one tile per
+ * buffer for its square, written by the CPU before each render. */
+struct tiles {
+	VkBuffer buffer;
+	struct allocation memory;
+	uint32_t *data;
+	uint32_t size; // pixels per side
+};
+
+int create_tiles(struct allocator *allocator, VkDevice dev, uint32_t size,
+uint32_t count, struct tiles *t) {
+	t->size = size;
+	VkBufferCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = (VkDeviceSize)size * size * 4 * count,
+		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE
+	};
+	if (vkCreateBuffer(dev, &info, NULL, &t->buffer)) {
+		fprintf(stderr, "ERROR: create_tiles() failed.\n");
+		return -1;
+	}
+	if (allocate_buffer_memory(allocator, t->buffer,
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	0, &t->memory) < 0 || !(t->data = map_memory(allocator, &t->memory))) {
+		fprintf(stderr, "ERROR: create_tiles() failed.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* pixel is B8G8R8A8 read as a little-endian uint32_t. */
+void fill_tile(struct tiles *t, uint32_t tile, uint32_t pixel) {
+	uint32_t *p = t->data + (size_t)tile * t->size * t->size;
+	for (uint32_t i=0; i<t->size * t->size; i++)
+		p[i] = pixel;
+}
+
+void destroy_tiles(struct allocator *allocator, VkDevice dev, struct tiles *t) {
+	vkDestroyBuffer(dev, t->buffer, NULL);
+	free_memory(allocator, &t->memory);
+}
+
+/* Copies covering r with the tile. Returns UINT32_MAX if more than max are
+ * needed. */
+static uint32_t tile_regions(const struct tiles *t, uint32_t tile,
+struct drm_mode_rect r, VkBufferImageCopy *regions, uint32_t max) {
+	uint32_t count = 0;
+	for (int32_t y=r.y1; y<r.y2; y+=t->size) {
+		for (int32_t x=r.x1; x<r.x2; x+=t->size) {
+			if (count == max)
+				return UINT32_MAX;
+			uint32_t w = r.x2 - x < (int32_t)t->size ? r.x2 - x : t->size;
+			uint32_t h = r.y2 - y < (int32_t)t->size ? r.y2 - y : t->size;
+			regions[count++] = (VkBufferImageCopy){
+				.bufferOffset = (VkDeviceSize)tile * t->size * t->size * 4,
+				.bufferRowLength = t->size,
+				.bufferImageHeight = t->size,
+				.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
+				.imageOffset = {x, y, 0},
+				.imageExtent = {w, h, 1}
+			};
+		}
+	}
+	return count;
+}
+
+#define max_tile_regions 256
+
+/* Only rewrites the damaged part of the image; the rest keeps what the
+ * buffer held when it was last scanned out. Full damage (a buffer's first
+ * render) discards the old contents and clears. */
+void record_command_update(VkCommandBuffer cmdbuf, VkImage img,
+VkQueryPool queries, const struct tiles *tiles, uint32_t tile,
+const struct damage *damage, struct drm_mode_rect square, uint32_t width,
+uint32_t height) {
+	VkCommandBufferBeginInfo infoBegin = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+	};
+	vkBeginCommandBuffer(cmdbuf, &infoBegin);
+
+	vkCmdResetQueryPool(cmdbuf, queries, 0, 2);
+	vkCmdWriteTimestamp(cmdbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queries, 0);
+
+	VkBufferImageCopy regions[max_tile_regions];
+	uint32_t count = 0;
+	int full = damage_is_full(damage, width, height);
+	for (uint32_t i=0; i<damage->count && !full; i++) {
+		uint32_t n = tile_regions(tiles, 0, damage->rects[i], regions + count,
+		max_tile_regions - count);
+		if (n == UINT32_MAX)
+			full = 1;
+		else
+			count += n;
+	}
+
+	VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = 0,
+		.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.oldLayout = full ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_GENERAL,
+		.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = img,
+		.subresourceRange = range
+	};
+	/* Chains with the semaphore wait on the scanout release. */
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+	if (full) {
+		VkClearColorValue color = {0.8984375f, 0.8984375f, 0.9765625f, 1.0f};
+		vkCmdClearColorImage(cmdbuf, img,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
+	} else if (count) {
+		vkCmdCopyBufferToImage(cmdbuf, tiles->buffer, img,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, count, regions);
+	}
+	/* The square overwrites part of the background. */
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+	count = tile_regions(tiles, tile, square, regions, max_tile_regions);
+	vkCmdCopyBufferToImage(cmdbuf, tiles->buffer, img,
+	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, count, regions);
+
+	barrier.dstAccessMask = 0;
+	barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+
+	vkCmdWriteTimestamp(cmdbuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queries, 1);
+	vkEndCommandBuffer(cmdbuf);
+}
+
+/* Software fill of host-mapped linear images, one row at a time. Scanout
+ * memory is usually write-combined, so on x86 the kernels use non-temporal
+ * stores, which skip the cache and write whole lines. */
+typedef void (*fill_row_fn)(uint32_t *p, uint32_t count, uint32_t pixel);
+
+struct fill_kernel {
+	const char *name;
+	fill_row_fn row;
+};
+
+static void fill_row_c(uint32_t *p, uint32_t count, uint32_t pixel) {
+	for (uint32_t i=0; i<count; i++)
+		p[i] = pixel;
+}
+
+#if defined(__x86_64__)
+static void fill_row_sse2(uint32_t *p, uint32_t count, uint32_t pixel) {
+	for (; count && ((uintptr_t)p & 15); count--)
+		*p++ = pixel;
+	__m128i v = _mm_set1_epi32(pixel);
+	for (; count >= 4; count -= 4, p += 4)
+		_mm_stream_si128((__m128i *)p, v);
+	fill_row_c(p, count, pixel);
+}
+
+__attribute__((target("avx2")))
+static void fill_row_avx2(uint32_t *p, uint32_t count, uint32_t pixel) {
+	for (; count && ((uintptr_t)p & 31); count--)
+		*p++ = pixel;
+	__m256i v = _mm256_set1_epi32(pixel);
+	for (; count >= 8; count -= 8, p += 8)
+		_mm256_stream_si256((__m256i *)p, v);
+	fill_row_c(p, count, pixel);
+}
+#elif defined(__ARM_NEON)
+static void fill_row_neon(uint32_t *p, uint32_t count, uint32_t pixel) {
+	uint32x4_t v = vdupq_n_u32(pixel);
+	for (; count >= 4; count -= 4, p += 4)
+		vst1q_u32(p, v);
+	fill_row_c(p, count, pixel);
+}
+#endif
+
+/* The widest kernel the CPU runs; SSE2 is always there on x86-64. */
+struct fill_kernel pick_fill_kernel(void) {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return (struct fill_kernel){"avx2", fill_row_avx2};
+	return (struct fill_kernel){"sse2", fill_row_sse2};
+#elif defined(__ARM_NEON)
+	return (struct fill_kernel){"neon", fill_row_neon};
+#else
+	return (struct fill_kernel){"c", fill_row_c};
+#endif
+}
+
+/* base points at pixel (0, 0) and pitch is the rowPitch of the image, which
+ * can be larger than its width. The stores are visible to other devices
+ * when this returns. */
+void fill_rect(const struct fill_kernel *k, uint8_t *base, uint32_t pitch,
+struct drm_mode_rect r, uint32_t pixel) {
+	for (int32_t y=r.y1; y<r.y2; y++)
+		k->row((uint32_t *)(base + (size_t)y * pitch) + r.x1, r.x2 - r.x1,
+		pixel);
+#if defined(__x86_64__)
+	_mm_sfence();
+#endif
+}
+
+static uint64_t clock_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Bring-up phases, each timed from the end of the previous one. */
+#define max_startup_phases 8
+
+struct startup {
+	uint64_t last;
+	uint32_t count;
+	const char *names[max_startup_phases];
+	double ms[max_startup_phases];
+};
+
+/* t is the CLOCK_MONOTONIC time the phase ended. */
+void startup_phase(struct startup *s, const char *name, uint64_t t) {
+	if (s->count < max_startup_phases) {
+		s->names[s->count] = name;
+		s->ms[s->count++] = (t - s->last) / 1e6;
+	}
+	s->last = t;
+}
+
+void print_startup(const struct startup *s) {
+	double total = 0;
+	printf("startup:");
+	for (uint32_t i=0; i<s->count; i++) {
+		printf(" %s %.3f ms,", s->names[i], s->ms[i]);
+		total += s->ms[i];
+	}
+	printf(" total %.3f ms\n", total);
+}
+
+/* One value per frame, in ms. */
+struct samples {
+	double *v;
+	uint64_t count, capacity;
+};
+
+void add_sample(struct samples *s, double v) {
+	if (s->count == s->capacity) {
+		s->capacity = s->capacity ? 2 * s->capacity : 256;
+		s->v = realloc(s->v, s->capacity * sizeof(double));
+	}
+	s->v[s->count++] = v;
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void write_json_samples(FILE *f, const char *name, struct samples *s,
+const char *sep) {
+	if (s->count == 0) {
+		fprintf(f, "\t\"%s\": null%s\n", name, sep);
+		return;
+	}
+	qsort(s->v, s->count, sizeof(double), compare_double);
+	double mean = 0;
+	for (uint64_t i=0; i<s->count; i++)
+		mean += s->v[i];
+	mean /= s->count;
+	fprintf(f, "\t\"%s\": {\"count\": %" PRIu64 ", \"min\": %.6f, "
+	"\"mean\": %.6f, \"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, "
+	"\"max\": %.6f}%s\n", name, s->count, s->v[0], mean,
+	s->v[(s->count - 1) * 50 / 100], s->v[(s->count - 1) * 90 / 100],
+	s->v[(s->count - 1) * 99 / 100], s->v[s->count - 1], sep);
+}
+
+/* The same summary main.c prints per pass. Sorts s. */
+static void print_samples(const char *name, struct samples *s) {
+	if (s->count == 0)
+		return;
+	qsort(s->v, s->count, sizeof(double), compare_double);
+	double mean = 0;
+	for (uint64_t i=0; i<s->count; i++)
+		mean += s->v[i];
+	mean /= s->count;
+	printf("%s over %" PRIu64 " frames: min %.3f ms, mean %.3f ms, "
+	"p99 %.3f ms\n", name, s->count, s->v[0], mean,
+	s->v[(s->count - 1) * 99 / 100]);
+}
+
+/* Every n-th frame is copied into a ring of mapped staging buffers, in the
+ * same submission as its render so the buffer is not scanned out before the
+ * copy is done, and written to disk by a worker thread, which waits on each
+ * slot's fence. The render loop never waits for capture: when every slot is
+ * still busy the frame is skipped. */
+#define max_capture_slots 4
+
+struct capture_slot {
+	VkBuffer buffer;
+	struct allocation memory;
+	const uint8_t *data;
+	VkCommandBuffer cmdbuf;
+	VkFence fence;
+	int busy; // submitted and not yet written
+};
+
+struct capture {
+	VkDevice dev;
+	struct capture_slot slots[max_capture_slots];
+	uint32_t width, height;
+	uint32_t every;
+	FILE *file;
+	uint8_t *yuv; // one converted frame, NULL when writing raw BGRA
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Submitted slots in frame order. */
+	uint32_t queue[max_capture_slots];
+	uint32_t head, queued;
+	int done, error;
+	uint64_t written, skipped;
+	struct samples write_ms; // fence wait and write, on the worker
+};
+
+/* Y4M wants YUV: BT.601 limited range, chroma averaged over 2x2 pixels
+ * (C420jpeg). */
+static void bgra_to_i420(const uint8_t *bgra, uint32_t w, uint32_t h,
+uint8_t *out) {
+	uint32_t cw = (w + 1) / 2, ch = (h + 1) / 2;
+	uint8_t *y = out, *u = out + (size_t)w * h, *v = u + (size_t)cw * ch;
+	for (uint32_t i=0; i<w * h; i++) {
+		const uint8_t *p = bgra + 4 * (size_t)i;
+		y[i] = ((66 * p[2] + 129 * p[1] + 25 * p[0] + 128) >> 8) + 16;
+	}
+	for (uint32_t cy=0; cy<ch; cy++) {
+		for (uint32_t cx=0; cx<cw; cx++) {
+			int r = 0, g = 0, b = 0, count = 0;
+			for (uint32_t py=2*cy; py<2*cy+2 && py<h; py++)
+				for (uint32_t px=2*cx; px<2*cx+2 && px<w; px++) {
+					const uint8_t *p = bgra + 4 * ((size_t)py * w + px);
+					b += p[0];
+					g += p[1];
+					r += p[2];
+					count++;
+				}
+			r /= count;
+			g /= count;
+			b /= count;
+			/* 32896 = (128 << 8) + 128 keeps the sums positive. */
+			u[cy * cw + cx] = (-38 * r - 74 * g + 112 * b + 32896) >> 8;
+			v[cy * cw + cx] = (112 * r - 94 * g - 18 * b + 32896) >> 8;
+		}
+	}
+}
+
+static int write_capture(struct capture *c, const uint8_t *bgra) {
+	size_t size = (size_t)c->width * c->height * 4;
+	if (c->yuv) {
+		size = (size_t)c->width * c->height +
+		2 * (size_t)((c->width + 1) / 2) * ((c->height + 1) / 2);
+		bgra_to_i420(bgra, c->width, c->height, c->yuv);
+		if (fputs("FRAME\n", c->file) == EOF)
+			return -1;
+		bgra = c->yuv;
+	}
+	return fwrite(bgra, 1, size, c->file) == size ? 0 : -1;
+}
+
+static void *capture_thread(void *arg) {
+	struct capture *c = arg;
+	pthread_mutex_lock(&c->lock);
+	for (;;) {
+		while (!c->queued && !c->done)
+			pthread_cond_wait(&c->cond, &c->lock);
+		if (!c->queued)
+			break;
+		struct capture_slot *s = &c->slots[c->queue[c->head]];
+		pthread_mutex_unlock(&c->lock);
+
+		uint64_t start = clock_ns(CLOCK_MONOTONIC);
+		int err = vkWaitForFences(c->dev, 1, &s->fence, VK_TRUE, UINT64_MAX) ||
+		(!c->error && write_capture(c, s->data) < 0);
+		add_sample(&c->write_ms, (clock_ns(CLOCK_MONOTONIC) - start) / 1e6);
+
+		pthread_mutex_lock(&c->lock);
+		if (err)
+			c->error = 1;
+		else if (!c->error)
+			c->written++;
+		c->head = (c->head + 1) % max_capture_slots;
+		c->queued--;
+		s->busy = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+/* Frames go to path as Y4M when it ends in .y4m, otherwise as raw BGRA
+ * rows. refresh is the display's, in Hz. */
+int init_capture(struct allocator *allocator, VkPhysicalDevice pdev,
+VkDevice dev, VkCommandPool pool, uint32_t width, uint32_t height,
+uint32_t every, uint32_t refresh, const char *path, struct capture *c) {
+	*c = (struct capture){
+		.dev = dev,
+		.width = width,
+		.height = height,
+		.every = every
+	};
+	size_t len = strlen(path);
+	int y4m = len >= 4 && !strcmp(path + len - 4, ".y4m");
+	c->file = fopen(path, "wb");
+	if (!c->file) {
+		perror("fopen");
+		return -1;
+	}
+	if (y4m) {
+		c->yuv = malloc((size_t)width * height +
+		2 * (size_t)((width + 1) / 2) * ((height + 1) / 2));
+		if (!c->yuv || fprintf(c->file, "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 "
+		"C420jpeg\n", width, height, refresh ? refresh : 60, every) < 0) {
+			fprintf(stderr, "ERROR: init_capture() failed.\n");
+			return -1;
+		}
+	}
+
+	VkPhysicalDeviceMemoryProperties props;
+	vkGetPhysicalDeviceMemoryProperties(pdev, &props);
+	for (uint32_t i=0; i<max_capture_slots; i++) {
+		struct capture_slot *s = &c->slots[i];
+		VkBufferCreateInfo info = {
+			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+			.size = (VkDeviceSize)width * height * 4,
+			.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			.sharingMode = VK_SHARING_MODE_EXCLUSIVE
+		};
+		if (vkCreateBuffer(dev, &info, NULL, &s->buffer)) {
+			fprintf(stderr, "ERROR: init_capture() failed.\n");
+			return -1;
+		}
+		/* The writer reads every byte, which is slow from uncached memory. */
+		VkMemoryRequirements req;
+		vkGetBufferMemoryRequirements(dev, s->buffer, &req);
+		VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+		if (findMemoryType(&props, req.memoryTypeBits,
+		flags | VK_MEMORY_PROPERTY_HOST_CACHED_BIT) != UINT32_MAX)
+			flags |= VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+		if (allocate_buffer_memory(allocator, s->buffer, flags, 0,
+		&s->memory) < 0 || !(s->data = map_memory(allocator, &s->memory))) {
+			fprintf(stderr, "ERROR: init_capture() failed.\n");
+			return -1;
+		}
+		s->cmdbuf = allocate_command_buffer(dev, pool);
+		s->fence = create_fence(dev);
+		if (s->cmdbuf == VK_NULL_HANDLE || s->fence == VK_NULL_HANDLE)
+			return -1;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	if (pthread_create(&c->thread, NULL, capture_thread, c)) {
+		fprintf(stderr, "ERROR: init_capture() failed.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* The image was left in GENERAL by its render, earlier in the same
+ * submission, and is copied from GENERAL: a layout change would have to be
+ * undone before scanout. The render's last barrier ends at bottom of pipe, so
+ * the copy waits on all commands. */
+static void record_capture(VkCommandBuffer cmdbuf, VkImage img, VkBuffer buf,
+uint32_t width, uint32_t height) {
+	VkCommandBufferBeginInfo infoBegin = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+	};
+	vkBeginCommandBuffer(cmdbuf, &infoBegin);
+	VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+		.oldLayout = VK_IMAGE_LAYOUT_GENERAL,
+		.newLayout = VK_IMAGE_LAYOUT_GENERAL,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = img,
+		.subresourceRange = range
+	};
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+	VkBufferImageCopy region = {
+		.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
+		.imageExtent = {width, height, 1}
+	};
+	/* The next render into the image is ordered after the copy by its own
+	 * barrier on the transfer stage. */
+	vkCmdCopyImageToBuffer(cmdbuf, img, VK_IMAGE_LAYOUT_GENERAL, buf, 1,
+	&region);
+	VkBufferMemoryBarrier host = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.buffer = buf,
+		.offset = 0,
+		.size = VK_WHOLE_SIZE
+	};
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 1, &host, 0, NULL);
+	vkEndCommandBuffer(cmdbuf);
+}
+
+/* Returns the slot whose command buffer copies frame n out of img, to be
+ * submitted after the render in the same batch, or NULL if the frame is not
+ * captured. */
+struct capture_slot *begin_capture(struct capture *c, VkImage img,
+uint64_t n) {
+	if (n % c->every)
+		return NULL;
+	uint32_t i;
+	pthread_mutex_lock(&c->lock);
+	for (i=0; i<max_capture_slots && c->slots[i].busy; i++)
+		;
+	pthread_mutex_unlock(&c->lock);
+	if (i == max_capture_slots) {
+		c->skipped++;
+		return NULL;
+	}
+
+	struct capture_slot *s = &c->slots[i];
+	record_capture(s->cmdbuf, img, s->buffer, c->width, c->height);
+	return s;
+}
+
+/* Call right after the batch holding s was submitted to queue. The slot's
+ * fence goes in an empty submission, which signals once everything before
+ * it on the queue is done. */
+int queue_capture(struct capture *c, struct capture_slot *s, VkQueue queue) {
+	vkResetFences(c->dev, 1, &s->fence);
+	if (vkQueueSubmit(queue, 0, NULL, s->fence)) {
+		fprintf(stderr, "vkQueueSubmit failed\n");
+		return -1;
+	}
+
+	uint32_t i = s - c->slots;
+	pthread_mutex_lock(&c->lock);
+	s->busy = 1;
+	c->queue[(c->head + c->queued) % max_capture_slots] = i;
+	c->queued++;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+void print_capture(struct capture *c) {
+	printf("captured %" PRIu64 " frames, skipped %" PRIu64 " with every slot "
+	"busy%s\n", c->written, c->skipped, c->error ? ", write failed" : "");
+	if (c->write_ms.count) {
+		qsort(c->write_ms.v, c->write_ms.count, sizeof(double), compare_double);
+		printf("capture worker: %.3f ms median per frame\n",
+		c->write_ms.v[(c->write_ms.count - 1) / 2]);
+	}
+}
+
+/* Drains the queue and returns -1 if any frame failed to be written. The
+ * counters and write_ms stay valid. */
+int fini_capture(struct allocator *allocator, VkDevice dev, VkCommandPool pool,
+struct capture *c) {
+	pthread_mutex_lock(&c->lock);
+	c->done = 1;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	pthread_join(c->thread, NULL);
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->lock);
+	for (uint32_t i=0; i<max_capture_slots; i++) {
+		struct capture_slot *s = &c->slots[i];
+		vkDestroyFence(dev, s->fence, NULL);
+		vkFreeCommandBuffers(dev, pool, 1, &s->cmdbuf);
+		vkDestroyBuffer(dev, s->buffer, NULL);
+		free_memory(allocator, &s->memory);
+	}
+	free(c->yuv);
+	int err = fclose(c->file) || c->error;
+	return err ? -1 : 0;
+}
+
+/* Frame pacing. The vblank period and phase are learned from page-flip
+ * timestamps, the cost of a frame from the time up to its commit plus its GPU
+ * time. Each frame then starts just early enough to be ready margin before
+ * the vblank it aims for, rather than as soon as a buffer is free. */
+struct pacer {
+	uint64_t period; // ns
+	uint64_t vblank; // ns, CLOCK_MONOTONIC, of the last flip; 0 before it
+	uint32_t sequence;
+	uint64_t cost; // ns; follows spikes at once and decays slowly
+	uint64_t margin; // ns
+	uint64_t target; // vblank the last started frame aims for
+	uint64_t missed;
+};
+
+void init_pacer(struct pacer *p, const drmModeModeInfo *mode,
+uint64_t margin) {
+	*p = (struct pacer){
+		.period = mode->clock ? (uint64_t)mode->htotal * mode->vtotal *
+		1000000 / mode->clock : 16666667,
+		.margin = margin
+	};
+}
+
+/* A flip aiming for target (or 0) was shown at ts, vblank sequence. */
+void pacer_flip(struct pacer *p, uint32_t sequence, uint64_t ts,
+uint64_t target) {
+	if (p->vblank && sequence > p->sequence) {
+		uint64_t period = (ts - p->vblank) / (sequence - p->sequence);
+		if (period > p->period / 2 && period < 2 * p->period)
+			p->period = (7 * p->period + period) / 8;
+	}
+	p->vblank = ts;
+	p->sequence = sequence;
+	if (target && ts > target + p->period / 2)
+		p->missed++;
+}
+
+void pacer_cost(struct pacer *p, uint64_t cost) {
+	p->cost = cost > p->cost ? cost : p->cost - (p->cost - cost) / 16;
+}
+
+/* Returns the vblank a frame that can start now should aim for, and in start
+ * when it should start. Only one flip can be queued, so it is always after
+ * the vblank of the previous frame. Returns 0 until the first flip. */
+uint64_t pace_frame(struct pacer *p, uint64_t now, uint64_t *start) {
+	*start = now;
+	if (!p->vblank)
+		return 0;
+	uint64_t lead = p->cost + p->margin;
+	uint64_t k = now + lead > p->vblank ?
+	(now + lead - p->vblank + p->period - 1) / p->period : 1;
+	uint64_t target = p->vblank + k * p->period;
+	while (target < p->target + p->period / 2)
+		target += p->period;
+	p->target = target;
+	if (target - lead > now)
+		*start = target - lead;
+	return target;
+}
+
+/* Same layout as the output of the top-level program; times are in ms. */
+/* How the frames of a client were shown. */
+struct client_stats {
+	uint64_t direct_frames, composited_frames;
+};
+
+int write_json(const char *path, uint32_t width, uint32_t height,
+uint32_t buffers, double seconds, double damage_fraction,
+const struct capture *capture, const struct pacer *pacer,
+const struct client_stats *clients,
+const struct startup *startup, struct samples *cpu, struct samples *gpu,
+struct samples *latency) {
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror("fopen");
+		return -1;
+	}
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"scenario\": \"export+scanout\",\n");
+	fprintf(f, "\t\"width\": %u,\n\t\"height\": %u,\n", width, height);
+	fprintf(f, "\t\"present_mode\": null,\n");
+	fprintf(f, "\t\"frames_in_flight\": %u,\n", buffers);
+	fprintf(f, "\t\"frames\": %" PRIu64 ",\n", cpu->count);
+	fprintf(f, "\t\"seconds\": %.6f,\n", seconds);
+	fprintf(f, "\t\"fps\": %.3f,\n", cpu->count / seconds);
+	fprintf(f, "\t\"damage_fraction\": %.6f,\n", damage_fraction);
+	if (capture)
+		fprintf(f, "\t\"capture\": {\"every\": %u, \"written\": %" PRIu64
+		", \"skipped\": %" PRIu64 "},\n", capture->every, capture->written,
+		capture->skipped);
+	else
+		fprintf(f, "\t\"capture\": null,\n");
+	if (pacer)
+		fprintf(f, "\t\"pacing\": {\"margin_ms\": %.3f, \"period_ms\": %.6f, "
+		"\"missed\": %" PRIu64 "},\n", pacer->margin / 1e6,
+		pacer->period / 1e6, pacer->missed);
+	else
+		fprintf(f, "\t\"pacing\": null,\n");
+	if (clients)
+		fprintf(f, "\t\"client_frames\": {\"direct\": %" PRIu64 ", "
+		"\"composited\": %" PRIu64 "},\n", clients->direct_frames,
+		clients->composited_frames);
+	else
+		fprintf(f, "\t\"client_frames\": null,\n");
+	fprintf(f, "\t\"startup_ms\": {");
+	for (uint32_t i=0; i<startup->count; i++)
+		fprintf(f, "%s\"%s\": %.3f", i ? ", " : "", startup->names[i],
+		startup->ms[i]);
+	fprintf(f, "},\n");
+	write_json_samples(f, "cpu_ms", cpu, ",");
+	write_json_samples(f, "gpu_ms", gpu, ",");
+	write_json_samples(f, "latency_ms", latency, "");
+	fprintf(f, "}\n");
+	return fclose(f);
+}
+
+/* Filling size x size pixels on the CPU through a mapping of an exportable
+ * linear image, against clearing an image of that size with
+ * vkCmdClearColorImage, submitted and waited for. Both write the same number
+ * of pixels; the GPU side also pays for the submit round trip. */
+#define fill_bench_iterations 200
+
+struct fill_result {
+	uint32_t size;
+	struct samples cpu, gpu;
+};
+
+static int bench_gpu_clear(struct allocator *allocator, VkDevice dev,
+VkQueue queue, VkCommandBuffer cmdbuf, VkFence fence, uint32_t size,
+struct samples *out) {
+	VkImage img = create_image(dev, size, size, VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+	NULL, 0);
+	if (img == VK_NULL_HANDLE)
+		return -1;
+	struct allocation memory;
+	if (allocate_image_memory(allocator, img,
+	VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 1, 0, &memory) < 0)
+		return -1;
+
+	VkCommandBufferBeginInfo infoBegin = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO
+	};
+	vkBeginCommandBuffer(cmdbuf, &infoBegin);
+	VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = img,
+		.subresourceRange = range
+	};
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+	VkClearColorValue color = {0.8984375f, 0.8984375f, 0.9765625f, 1.0f};
+	vkCmdClearColorImage(cmdbuf, img, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+	&color, 1, &range);
+	vkEndCommandBuffer(cmdbuf);
+
+	VkSubmitInfo submitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.commandBufferCount = 1,
+		.pCommandBuffers = &cmdbuf
+	};
+	int err = 0;
+	for (uint32_t i=0; i<fill_bench_iterations && !err; i++) {
+		uint64_t start = clock_ns(CLOCK_MONOTONIC);
+		vkResetFences(dev, 1, &fence);
+		err = vkQueueSubmit(queue, 1, &submitInfo, fence) ||
+		vkWaitForFences(dev, 1, &fence, VK_TRUE, UINT64_MAX);
+		add_sample(out, (clock_ns(CLOCK_MONOTONIC) - start) / 1e6);
+	}
+	if (err)
+		fprintf(stderr, "vkQueueSubmit failed\n");
+	vkDestroyImage(dev, img, NULL);
+	free_memory(allocator, &memory);
+	return err ? -1 : 0;
+}
+
+int bench_fill(struct allocator *allocator, VkDevice dev, VkQueue queue,
+VkCommandPool pool, const struct fill_kernel *k, uint32_t width,
+uint32_t height, struct fill_result *results, uint32_t count) {
+	VkImage target = create_image(dev, width, height,
+	VK_IMAGE_USAGE_TRANSFER_DST_BIT, NULL, 0);
+	if (target == VK_NULL_HANDLE)
+		return -1;
+	struct allocation memory;
+	uint8_t *data;
+	if (allocate_image_memory(allocator, target,
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	1, VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT, &memory) < 0 ||
+	!(data = map_memory(allocator, &memory))) {
+		fprintf(stderr, "ERROR: bench_fill() failed.\n");
+		return -1;
+	}
+	VkImageSubresource subresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0};
+	VkSubresourceLayout layout;
+	vkGetImageSubresourceLayout(dev, target, &subresource, &layout);
+	uint8_t *base = data + layout.offset;
+
+	VkCommandBuffer cmdbuf = allocate_command_buffer(dev, pool);
+	VkFence fence = create_fence(dev);
+	if (cmdbuf == VK_NULL_HANDLE || fence == VK_NULL_HANDLE)
+		return -1;
+
+	int err = 0;
+	for (uint32_t i=0; i<count && !err; i++) {
+		uint32_t size = results[i].size;
+		struct drm_mode_rect r = {0, 0, size, size};
+		for (uint32_t j=0; j<fill_bench_iterations; j++) {
+			uint64_t start = clock_ns(CLOCK_MONOTONIC);
+			fill_rect(k, base, layout.rowPitch, r, 0xffe5e500 | (j % 256));
+			add_sample(&results[i].cpu,
+			(clock_ns(CLOCK_MONOTONIC) - start) / 1e6);
+		}
+		err = bench_gpu_clear(allocator, dev, queue, cmdbuf, fence, size,
+		&results[i].gpu);
+	}
+
+	vkDestroyFence(dev, fence, NULL);
+	vkFreeCommandBuffers(dev, pool, 1, &cmdbuf);
+	vkDestroyImage(dev, target, NULL);
+	free_memory(allocator, &memory);
+	return err;
+}
+
+static double median(struct samples *s) {
+	qsort(s->v, s->count, sizeof(double), compare_double);
+	return s->v[(s->count - 1) / 2];
+}
+
+void print_fill_results(const char *kernel, struct fill_result *results,
+uint32_t count) {
+	printf("%10s %12s %12s   (median ms, %s kernel)\n", "size", "cpu fill",
+	"gpu clear", kernel);
+	for (uint32_t i=0; i<count; i++) {
+		double cpu = median(&results[i].cpu), gpu = median(&results[i].gpu);
+		printf("%4ux%-5u %12.4f %12.4f   %s\n", results[i].size,
+		results[i].size, cpu, gpu, cpu < gpu ? "cpu" : "gpu");
+	}
+}
+
+int write_fill_json(const char *path, const char *kernel,
+struct fill_result *results, uint32_t count) {
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror("fopen");
+		return -1;
+	}
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"scenario\": \"fill\",\n");
+	fprintf(f, "\t\"kernel\": \"%s\",\n", kernel);
+	fprintf(f, "\t\"iterations\": %u,\n", fill_bench_iterations);
+	fprintf(f, "\t\"sizes\": [\n");
+	for (uint32_t i=0; i<count; i++) {
+		fprintf(f, "\t{\n\t\"size\": %u,\n", results[i].size);
+		write_json_samples(f, "cpu_fill_ms", &results[i].cpu, ",");
+		write_json_samples(f, "gpu_clear_ms", &results[i].gpu, "");
+		fprintf(f, "\t}%s\n", i + 1 < count ? "," : "");
+	}
+	fprintf(f, "\t]\n}\n");
+	return fclose(f);
+}
+
+/* Non-blocking because every render thread waits for events on the fd: the
+ * first one to wake reads them, the others find nothing left. */
+int drm_init(const char *path) {
+	int fd = open(path, O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	if (!drmIsMaster(fd)) {
+		fprintf(stderr, "not drm master\n");
+		return -1;
+	}
+	if(drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		fprintf(stderr, "no atomic modesetting\n");
+		return -1;
+	}
+	return fd;
+}
+
+/* Object and property IDs used in atomic requests, looked up by name so that
+ * any KMS driver works. Optional properties have ID 0 when not exposed. */
+struct plane_props {
+	uint32_t fb_id, crtc_id, src_x, src_y, src_w, src_h;
+	uint32_t crtc_x, crtc_y, crtc_w, crtc_h, in_fence_fd;
+	uint32_t fb_damage_clips;
+};
+
+struct kms {
+	uint32_t connector_id, crtc_id, plane_id;
+	uint32_t crtc_index;
+	drmModeModeInfo mode;
+	/* The CRTC was off or showed another mode: modeset() sets mode_blob. */
+	int modeset;
+	uint32_t mode_blob;
+	/* modeset() set the plane geometry; later commits only flip. */
+	int configured;
+	/* Framebuffers can be created with explicit modifiers. */
+	int fb_modifiers;
+	/* Plane and CRTC state found at startup, put back by restore(). The mode
+	 * blob is 0 if the CRTC was off or the mode is kept. */
+	uint32_t saved_fb_id, saved_crtc_id;
+	drmModeModeInfo saved_mode;
+	uint32_t saved_mode_blob;
+	struct plane_props plane_prop;
+	/* Planes above the primary one that take ARGB8888, 0 if the CRTC has
+	 * none. restore() turns them off again once used. */
+	uint32_t overlay_id, cursor_id;
+	struct plane_props overlay_prop, cursor_prop;
+	int overlay_used, cursor_used;
+	uint32_t cursor_width, cursor_height;
+	/* What the primary plane takes for XRGB8888, filled in only with
+	 * fb_modifiers. */
+	uint64_t plane_mods[max_modifiers];
+	uint32_t plane_mod_count;
+	struct {
+		uint32_t active, mode_id, out_fence_ptr;
+	} crtc_prop;
+	struct {
+		uint32_t crtc_id;
+	} connector_prop;
+};
+
+/* Returns the property ID, or 0 if the object has no such property. The
+ * current value is stored in value if it is not NULL. */
+uint32_t get_property_id(int fd, uint32_t obj_id, uint32_t obj_type,
+const char *name, uint64_t *value) {
+	drmModeObjectProperties *props = drmModeObjectGetProperties(fd, obj_id,
+	obj_type);
+	if (!props)
+		return 0;
+	uint32_t id = 0;
+	for (uint32_t i=0; i<props->count_props && !id; i++) {
+		drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, name)) {
+			id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+	return id;
+}
+
+#define max_heads 4
+
+/* Picks the CRTC driving the connector, or the first one it can use, out of
+ * those not in the used mask. Returns the CRTC index in the resources, or
+ * -1. */
+static int find_crtc(int fd, drmModeRes *res, drmModeConnector *conn,
+uint32_t used) {
+	uint32_t possible = 0;
+	for (int i=0; i<conn->count_encoders; i++) {
+		drmModeEncoder *enc = drmModeGetEncoder(fd, conn->encoders[i]);
+		if (!enc)
+			continue;
+		if (enc->encoder_id == conn->encoder_id && enc->crtc_id)
+			for (int j=0; j<res->count_crtcs; j++)
+				if (res->crtcs[j] == enc->crtc_id && !(used & (1u << j))) {
+					drmModeFreeEncoder(enc);
+					return j;
+				}
+		possible |= enc->possible_crtcs;
+		drmModeFreeEncoder(enc);
+	}
+	for (int j=0; j<res->count_crtcs; j++)
+		if (possible & ~used & (1u << j))
+			return j;
+	return -1;
+}
+
+static int plane_taken(const struct kms *heads, uint32_t count, uint32_t id) {
+	for (uint32_t i=0; i<count; i++)
+		if (heads[i].plane_id == id || heads[i].overlay_id == id ||
+		heads[i].cursor_id == id)
+			return 1;
+	return 0;
+}
+
+/* Returns the first plane of the given type the CRTC can use and none of the
+ * taken heads does, or 0. With a format other than 0 the plane must also
+ * support it. */
+static uint32_t find_plane(int fd, int crtc_index, uint64_t type,
+uint32_t format, const struct kms *taken, uint32_t taken_count) {
+	drmModePlaneRes *planes = drmModeGetPlaneResources(fd);
+	if (!planes)
+		return 0;
+	uint32_t id = 0;
+	for (uint32_t i=0; i<planes->count_planes && !id; i++) {
+		drmModePlane *plane = drmModeGetPlane(fd, planes->planes[i]);
+		if (!plane)
+			continue;
+		int has_format = !format;
+		for (uint32_t j=0; j<plane->count_formats && !has_format; j++)
+			has_format = plane->formats[j] == format;
+		uint64_t plane_type;
+		if ((plane->possible_crtcs & (1u << crtc_index)) && has_format &&
+		!plane_taken(taken, taken_count, plane->plane_id) &&
+		get_property_id(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type",
+		&plane_type) && plane_type == type)
+			id = plane->plane_id;
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(planes);
+	return id;
+}
+
+static int find_plane_properties(int fd, uint32_t plane_id,
+struct plane_props *p) {
+	const struct {
+		const char *name;
+		uint32_t *id;
+		int optional;
+	} props[] = {
+		{"FB_ID", &p->fb_id},
+		{"CRTC_ID", &p->crtc_id},
+		{"SRC_X", &p->src_x},
+		{"SRC_Y", &p->src_y},
+		{"SRC_W", &p->src_w},
+		{"SRC_H", &p->src_h},
+		{"CRTC_X", &p->crtc_x},
+		{"CRTC_Y", &p->crtc_y},
+		{"CRTC_W", &p->crtc_w},
+		{"CRTC_H", &p->crtc_h},
+		{"IN_FENCE_FD", &p->in_fence_fd, 1},
+		{"FB_DAMAGE_CLIPS", &p->fb_damage_clips, 1}
+	};
+	for (size_t i=0; i<sizeof(props)/sizeof(props[0]); i++) {
+		*props[i].id = get_property_id(fd, plane_id, DRM_MODE_OBJECT_PLANE,
+		props[i].name, NULL);
+		if (!*props[i].id && !props[i].optional) {
+			fprintf(stderr, "missing KMS property %s on plane %u\n",
+			props[i].name, plane_id);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int find_properties(int fd, struct kms *kms) {
+	if (find_plane_properties(fd, kms->plane_id, &kms->plane_prop) < 0)
+		return -1;
+	const struct {
+		uint32_t obj_id, obj_type;
+		const char *name;
+		uint32_t *id;
+		int optional;
+	} props[] = {
+		{kms->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE", &kms->crtc_prop.active},
+		{kms->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID", &kms->crtc_prop.mode_id},
+		{kms->crtc_id, DRM_MODE_OBJECT_CRTC, "OUT_FENCE_PTR",
+		&kms->crtc_prop.out_fence_ptr, 1},
+		{kms->connector_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID",
+		&kms->connector_prop.crtc_id}
+	};
+	for (size_t i=0; i<sizeof(props)/sizeof(props[0]); i++) {
+		*props[i].id = get_property_id(fd, props[i].obj_id, props[i].obj_type,
+		props[i].name, NULL);
+		if (!*props[i].id && !props[i].optional) {
+			fprintf(stderr, "missing KMS property %s\n", props[i].name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* A mode asked for on the command line. 0 means any: the preferred
+ * resolution, at its highest refresh rate. */
+struct mode_request {
+	uint32_t width, height;
+	uint32_t refresh; // mHz
+};
+
+/* Parses WIDTHxHEIGHT[@HZ]. */
+int parse_mode_request(const char *s, struct mode_request *r) {
+	double hz = 0;
+	if (sscanf(s, "%ux%u@%lf", &r->width, &r->height, &hz) < 2 || hz < 0)
+		return -1;
+	r->refresh = hz * 1000 + 0.5;
+	return 0;
+}
+
+/* Modes only carry a rounded vrefresh; the timings give the exact rate. */
+uint32_t mode_refresh(const drmModeModeInfo *m) {
+	uint64_t pixels = (uint64_t)m->htotal * m->vtotal;
+	if (!pixels)
+		return m->vrefresh * 1000;
+	uint64_t mhz = (uint64_t)m->clock * 1000000 / pixels;
+	if (m->flags & DRM_MODE_FLAG_INTERLACE)
+		mhz *= 2;
+	if (m->flags & DRM_MODE_FLAG_DBLSCAN)
+		mhz /= 2;
+	return mhz;
+}
+
+static int better_mode(const drmModeModeInfo *a, const drmModeModeInfo *b,
+uint32_t refresh) {
+	int ia = a->flags & DRM_MODE_FLAG_INTERLACE;
+	int ib = b->flags & DRM_MODE_FLAG_INTERLACE;
+	if (ia != ib)
+		return !ia;
+	uint32_t ra = mode_refresh(a), rb = mode_refresh(b);
+	if (!refresh)
+		return ra > rb;
+	uint32_t da = ra > refresh ? ra - refresh : refresh - ra;
+	uint32_t db = rb > refresh ? rb - refresh : refresh - rb;
+	return da < db;
+}
+
+/* The resolution asked for if the connector has it, else the preferred one,
+ * else the largest; then the progressive mode with the refresh rate closest
+ * to the one asked for, or the highest. Returns the index in conn->modes. */
+static int choose_mode(const drmModeConnector *conn,
+const struct mode_request *want) {
+	int preferred = -1;
+	for (int i=0; i<conn->count_modes && preferred < 0; i++)
+		if (conn->modes[i].type & DRM_MODE_TYPE_PREFERRED)
+			preferred = i;
+	if (preferred < 0) {
+		preferred = 0;
+		for (int i=1; i<conn->count_modes; i++)
+			if ((uint64_t)conn->modes[i].hdisplay * conn->modes[i].vdisplay >
+			(uint64_t)conn->modes[preferred].hdisplay *
+			conn->modes[preferred].vdisplay)
+				preferred = i;
+	}
+	uint32_t w = conn->modes[preferred].hdisplay;
+	uint32_t h = conn->modes[preferred].vdisplay;
+	if (want->width) {
+		int found = 0;
+		for (int i=0; i<conn->count_modes && !found; i++)
+			found = conn->modes[i].hdisplay == want->width &&
+			conn->modes[i].vdisplay == want->height;
+		if (found) {
+			w = want->width;
+			h = want->height;
+		} else {
+			fprintf(stderr, "connector %u has no %ux%u mode, using %ux%u\n",
+			conn->connector_id, want->width, want->height, w, h);
+		}
+	}
+	int best = preferred;
+	for (int i=0; i<conn->count_modes; i++) {
+		const drmModeModeInfo *m = &conn->modes[i];
+		if (m->hdisplay == w && m->vdisplay == h &&
+		(conn->modes[best].hdisplay != w || conn->modes[best].vdisplay != h ||
+		better_mode(m, &conn->modes[best], want->refresh)))
+			best = i;
+	}
+	return best;
+}
+
+static int same_timings(const drmModeModeInfo *a, const drmModeModeInfo *b) {
+	return a->clock == b->clock && a->hdisplay == b->hdisplay &&
+	a->hsync_start == b->hsync_start && a->hsync_end == b->hsync_end &&
+	a->htotal == b->htotal && a->vdisplay == b->vdisplay &&
+	a->vsync_start == b->vsync_start && a->vsync_end == b->vsync_end &&
+	a->vtotal == b->vtotal && a->flags == b->flags;
+}
+
+/* Sets up kms for the connector with a CRTC and planes none of the taken
+ * heads uses, in the mode closest to want. The modeset happens with the
+ * first commit, and only if the CRTC does not already show that mode. */
+static int init_head(int fd, drmModeRes *res, drmModeConnector *conn,
+const struct mode_request *want, const struct kms *taken,
+uint32_t taken_count, struct kms *kms) {
+	memset(kms, 0, sizeof(*kms));
+	kms->connector_id = conn->connector_id;
+	uint32_t used = 0;
+	for (uint32_t i=0; i<taken_count; i++)
+		used |= 1u << taken[i].crtc_index;
+	int crtc_index = find_crtc(fd, res, conn, used);
+	if (crtc_index < 0) {
+		fprintf(stderr, "no CRTC for connector %u\n", kms->connector_id);
+		return -1;
+	}
+	kms->crtc_id = res->crtcs[crtc_index];
+	kms->crtc_index = crtc_index;
+
+	kms->mode = conn->modes[choose_mode(conn, want)];
+	drmModeCrtc *crtc = drmModeGetCrtc(fd, kms->crtc_id);
+	kms->modeset = !crtc || !crtc->mode_valid ||
+	!same_timings(&crtc->mode, &kms->mode);
+	if (crtc && crtc->mode_valid && kms->modeset) {
+		kms->saved_mode = crtc->mode;
+		if (drmModeCreatePropertyBlob(fd, &kms->saved_mode,
+		sizeof(kms->saved_mode), &kms->saved_mode_blob)) {
+			perror("drmModeCreatePropertyBlob");
+			drmModeFreeCrtc(crtc);
+			return -1;
+		}
+	}
+	drmModeFreeCrtc(crtc);
+
+	kms->plane_id = find_plane(fd, crtc_index, DRM_PLANE_TYPE_PRIMARY, 0,
+	taken, taken_count);
+	if (!kms->plane_id) {
+		fprintf(stderr, "no primary plane for CRTC %u\n", kms->crtc_id);
+		return -1;
+	}
+	drmModePlane *plane = drmModeGetPlane(fd, kms->plane_id);
+	if (plane) {
+		kms->saved_fb_id = plane->fb_id;
+		kms->saved_crtc_id = plane->crtc_id;
+		drmModeFreePlane(plane);
+	}
+	if (find_properties(fd, kms) < 0)
+		return -1;
+	kms->overlay_id = find_plane(fd, crtc_index, DRM_PLANE_TYPE_OVERLAY,
+	DRM_FORMAT_ARGB8888, taken, taken_count);
+	if (kms->overlay_id && find_plane_properties(fd, kms->overlay_id,
+	&kms->overlay_prop) < 0)
+		kms->overlay_id = 0;
+	kms->cursor_id = find_plane(fd, crtc_index, DRM_PLANE_TYPE_CURSOR,
+	DRM_FORMAT_ARGB8888, taken, taken_count);
+	if (kms->cursor_id && find_plane_properties(fd, kms->cursor_id,
+	&kms->cursor_prop) < 0)
+		kms->cursor_id = 0;
+	uint64_t cap;
+	kms->fb_modifiers = !drmGetCap(fd, DRM_CAP_ADDFB2_MODIFIERS, &cap) && cap;
+	kms->cursor_width = !drmGetCap(fd, DRM_CAP_CURSOR_WIDTH, &cap) ? cap : 64;
+	kms->cursor_height = !drmGetCap(fd, DRM_CAP_CURSOR_HEIGHT, &cap) ? cap : 64;
+	if (kms->modeset && drmModeCreatePropertyBlob(fd, &kms->mode,
+	sizeof(kms->mode), &kms->mode_blob)) {
+		perror("drmModeCreatePropertyBlob");
+		return -1;
+	}
+	printf("connector %u, CRTC %u, plane %u, %ux%u@%.3f (%d modes)%s\n",
+	kms->connector_id, kms->crtc_id, kms->plane_id, kms->mode.hdisplay,
+	kms->mode.vdisplay, mode_refresh(&kms->mode) / 1e3, conn->count_modes,
+	kms->modeset ? ", modeset" : "");
+	printf("overlay plane %u, cursor plane %u (%ux%u)\n", kms->overlay_id,
+	kms->cursor_id, kms->cursor_width, kms->cursor_height);
+	return 0;
+}
+
+/* Drives every connected connector that can still get a CRTC and a primary
+ * plane of its own. Returns how many heads were set up, or -1 if none. */
+int kms_init(int fd, const struct mode_request *want, struct kms *heads,
+uint32_t max) {
+	drmModeRes *res = drmModeGetResources(fd);
+	if (!res) {
+		perror("drmModeGetResources");
+		return -1;
+	}
+	uint32_t count = 0;
+	for (int i=0; i<res->count_connectors && count<max; i++) {
+		drmModeConnector *conn = drmModeGetConnector(fd, res->connectors[i]);
+		if (!conn)
+			continue;
+		if (conn->connection == DRM_MODE_CONNECTED && conn->count_modes &&
+		init_head(fd, res, conn, want, heads, count, &heads[count]) == 0)
+			count++;
+		drmModeFreeConnector(conn);
+	}
+	drmModeFreeResources(res);
+	if (count == 0) {
+		fprintf(stderr, "no connected connector\n");
+		return -1;
+	}
+	return count;
+}
+
+/* Fills mods with the modifiers the plane supports for format, from its
+ * IN_FORMATS blob, or just linear if it has none. Returns how many there
+ * are. */
+uint32_t get_plane_modifiers(int fd, const struct kms *kms, uint32_t format,
+uint64_t *mods, uint32_t max) {
+	uint64_t blob_id = 0;
+	if (!get_property_id(fd, kms->plane_id, DRM_MODE_OBJECT_PLANE,
+	"IN_FORMATS", &blob_id) || !blob_id) {
+		mods[0] = DRM_FORMAT_MOD_LINEAR;
+		return 1;
+	}
+	drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(fd, blob_id);
+	if (!blob)
+		return 0;
+	const struct drm_format_modifier_blob *header = blob->data;
+	const uint32_t *formats = (const uint32_t *)
+	((const char *)blob->data + header->formats_offset);
+	const struct drm_format_modifier *modifiers =
+	(const struct drm_format_modifier *)
+	((const char *)blob->data + header->modifiers_offset);
+	uint32_t n = 0;
+	for (uint32_t i=0; i<header->count_modifiers && n<max; i++)
+		for (uint32_t j=0; j<64; j++) {
+			uint32_t f = modifiers[i].offset + j;
+			if ((modifiers[i].formats & (1ull << j)) &&
+			f < header->count_formats && formats[f] == format) {
+				mods[n++] = modifiers[i].modifier;
+				break;
+			}
+		}
+	drmModeFreePropertyBlob(blob);
+	return n;
+}
+
+void kms_fini(int fd, struct kms *kms) {
+	if (kms->mode_blob)
+		drmModeDestroyPropertyBlob(fd, kms->mode_blob);
+	if (kms->saved_mode_blob)
+		drmModeDestroyPropertyBlob(fd, kms->saved_mode_blob);
+}
+
+/* Shows all of fb_id (src_w x src_h), or nothing if 0, in the w x h
+ * rectangle at x, y on the CRTC. */
+static int add_plane_rect(drmModeAtomicReq *req, uint32_t plane_id,
+const struct plane_props *p, uint32_t crtc_id, uint32_t fb_id,
+uint32_t src_w, uint32_t src_h, int32_t x, int32_t y, uint32_t w,
+uint32_t h) {
+	int err = 0;
+	if (!crtc_id)
+		x = y = w = h = 0;
+	err |= drmModeAtomicAddProperty(req, plane_id, p->fb_id, fb_id) < 0;
+	err |= drmModeAtomicAddProperty(req, plane_id, p->crtc_id, crtc_id) < 0;
+	err |= drmModeAtomicAddProperty(req, plane_id, p->src_x, 0) < 0;
+	err |= drmModeAtomicAddProperty(req, plane_id, p->src_y, 0) < 0;
+	err |= drmModeAtomicAddProperty(req, plane_id, p->src_w,
+	(uint64_t)src_w << 16) < 0;
+	err |= drmModeAtomicAddProperty(req, plane_id, p->src_h,
+	(uint64_t)src_h << 16) < 0;
+	err |= drmModeAtomicAddProperty(req, plane_id, p->crtc_x, x) < 0;
+	err |= drmModeAtomicAddProperty(req, plane_id, p->crtc_y, y) < 0;
+	err |= drmModeAtomicAddProperty(req, plane_id, p->crtc_w, w) < 0;
+	err |= drmModeAtomicAddProperty(req, plane_id, p->crtc_h, h) < 0;
+	return err ? -1 : 0;
+}
+
+/* Shows fb_id (or nothing if 0) full screen on the primary plane. src is the
+ * size of the framebuffer. */
+static int add_plane_state(drmModeAtomicReq *req, const struct kms *kms,
+uint32_t crtc_id, uint32_t fb_id, uint32_t src_w, uint32_t src_h) {
+	return add_plane_rect(req, kms->plane_id, &kms->plane_prop, crtc_id,
+	fb_id, src_w, src_h, 0, 0, kms->mode.hdisplay, kms->mode.vdisplay);
+}
+
+/* Shows mode_blob, or turns the CRTC off if 0. */
+static int add_crtc_state(drmModeAtomicReq *req, const struct kms *kms,
+uint32_t mode_blob) {
+	int active = mode_blob != 0;
+	int err = 0;
+	err |= drmModeAtomicAddProperty(req, kms->crtc_id, kms->crtc_prop.active,
+	active) < 0;
+	err |= drmModeAtomicAddProperty(req, kms->crtc_id, kms->crtc_prop.mode_id,
+	mode_blob) < 0;
+	err |= drmModeAtomicAddProperty(req, kms->connector_id,
+	kms->connector_prop.crtc_id, active ? kms->crtc_id : 0) < 0;
+	return err ? -1 : 0;
+}
+
+/* All planes live in the same buffer object. Without fb_modifiers the kernel
+ * infers the layout, which only works for linear buffers. */
+int add_framebuffer(int fd, const struct kms *kms, uint32_t width,
+uint32_t height, uint32_t format, uint32_t handle, uint32_t planes,
+const uint32_t *strides, const uint32_t *offsets, uint64_t modifier,
+uint32_t *fb_id) {
+	uint32_t handles[4] = {0};
+	uint64_t modifiers[4] = {0};
+	for (uint32_t i=0; i<planes; i++) {
+		handles[i] = handle;
+		modifiers[i] = modifier;
+	}
+
+	if (drmModeAddFB2WithModifiers(fd, width, height, format,
+		 handles, strides, offsets, modifiers, fb_id,
+		 kms->fb_modifiers ? DRM_MODE_FB_MODIFIERS : 0)) {
+		perror("drmModeAddFB2WithModifiers");
+		return -1;
+	}
+	return 0;
+}
+
+/* Bounces the layer around the screen, speed pixels per frame. */
+void move_layer(struct layer *l, uint64_t n, uint32_t speed, uint32_t width,
+uint32_t height) {
+	uint64_t w = 2 * (uint64_t)(width - l->width) + 1;
+	uint64_t h = 2 * (uint64_t)(height - l->height) + 1;
+	uint64_t x = n * speed % w, y = n * speed / 2 % h;
+	l->x = x <= width - l->width ? x : w - 1 - x;
+	l->y = y <= height - l->height ? y : h - 1 - y;
+}
+
+static int add_layer_state(drmModeAtomicReq *req, const struct kms *kms,
+const struct layer *l) {
+	return add_plane_rect(req, l->plane_id, l->prop, kms->crtc_id, l->fb_id,
+	l->width, l->height, l->x, l->y, l->width, l->height);
+}
+
+/* Asks the driver whether the background and the layers with a plane can be
+ * shown together, without changing anything. */
+static int test_layers(int fd, const struct kms *kms, uint32_t fb_id,
+const struct layer *layers, uint32_t count) {
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY;
+	int err = add_plane_state(req, kms, kms->crtc_id, fb_id,
+	kms->mode.hdisplay, kms->mode.vdisplay);
+	if (!kms->configured && kms->modeset) {
+		err |= add_crtc_state(req, kms, kms->mode_blob);
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+	for (uint32_t i=0; i<count; i++)
+		if (layers[i].plane_id)
+			err |= add_layer_state(req, kms, &layers[i]);
+	if (!err)
+		err = drmModeAtomicCommit(fd, req, flags, NULL) ? -1 : 0;
+	drmModeAtomicFree(req);
+	return err;
+}
+
+/* Each layer comes in with the plane it would like, or 0. Until the test
+ * commit passes, the last layer still on a plane is moved to the GPU.
+ * Returns how many layers stay on planes. */
+uint32_t assign_planes(int fd, const struct kms *kms, uint32_t fb_id,
+struct layer *layers, uint32_t count) {
+	uint32_t on_planes = 0;
+	for (uint32_t i=0; i<count; i++)
+		on_planes += layers[i].plane_id != 0;
+	while (on_planes && test_layers(fd, kms, fb_id, layers, count) < 0) {
+		uint32_t i = count;
+		while (!layers[--i].plane_id)
+			;
+		printf("%s rejected by plane %u, composited on the GPU\n",
+		layers[i].name, layers[i].plane_id);
+		layers[i].plane_id = 0;
+		on_planes--;
+	}
+	return on_planes;
+}
+
+/* Puts the layers back on the planes they were assigned and, until a test
+ * commit of the new geometry with fb_id passes, moves the last one still on
+ * a plane to the GPU for this frame. */
+static void retest_planes(int fd, const struct kms *kms, uint32_t fb_id,
+struct layer *layers, uint32_t count) {
+	uint32_t on_planes = 0;
+	for (uint32_t i=0; i<count; i++) {
+		layers[i].plane_id = layers[i].assigned_plane;
+		on_planes += layers[i].plane_id != 0;
+	}
+	while (on_planes && test_layers(fd, kms, fb_id, layers, count) < 0) {
+		uint32_t i = count;
+		while (!layers[--i].plane_id)
+			;
+		layers[i].plane_id = 0;
+		layers[i].fallback_frames++;
+		on_planes--;
+	}
+}
+
+/* Completes asynchronously: a page-flip event carrying user_data is sent for
+ * each head once fb_id is on screen there. Only flips: every head was lit up
+ * by modeset(). The heads show the same buffer, so they all have the timings
+ * of the first one; layers are on its planes. The flip
+ * waits for in_fence (a sync_file, or -1) in the kernel. If out_fence is not
+ * NULL it receives a sync_file that signals when the buffer currently on
+ * screen is released by every head, or -1. */
+int scanout(int fd, struct kms *heads, uint32_t head_count, uint32_t fb_id,
+int in_fence, int32_t *out_fence, const struct damage *damage,
+const struct layer *layers, uint32_t layer_count, void *user_data) {
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	int err = 0;
+	/* The blob only has to live until the commit has taken a reference. */
+	uint32_t damage_blob = 0;
+	if (damage && damage->count && drmModeCreatePropertyBlob(fd, damage->rects,
+	damage->count * sizeof(damage->rects[0]), &damage_blob))
+		damage_blob = 0;
+	/* Only useful if it covers every head. */
+	int32_t out_fences[max_heads];
+	if (out_fence)
+		*out_fence = -1;
+	for (uint32_t i=0; i<head_count && out_fence; i++)
+		if (!heads[i].crtc_prop.out_fence_ptr)
+			out_fence = NULL;
+	for (uint32_t i=0; i<head_count; i++) {
+		struct kms *kms = &heads[i];
+		if (damage_blob && kms->plane_prop.fb_damage_clips)
+			err |= drmModeAtomicAddProperty(req, kms->plane_id,
+			kms->plane_prop.fb_damage_clips, damage_blob) < 0;
+		err |= drmModeAtomicAddProperty(req, kms->plane_id,
+		kms->plane_prop.fb_id, fb_id) < 0;
+		if (in_fence >= 0)
+			err |= drmModeAtomicAddProperty(req, kms->plane_id,
+			kms->plane_prop.in_fence_fd, in_fence) < 0;
+		out_fences[i] = -1;
+		if (out_fence)
+			err |= drmModeAtomicAddProperty(req, kms->crtc_id,
+			kms->crtc_prop.out_fence_ptr,
+			(uint64_t)(uintptr_t)&out_fences[i]) < 0;
+	}
+	/* Moving a layer only changes its plane's position. */
+	for (uint32_t i=0; i<layer_count; i++)
+		if (layers[i].plane_id)
+			err |= add_layer_state(req, &heads[0], &layers[i]) < 0;
+	if (!err && drmModeAtomicCommit(fd, req, flags, user_data)) {
+		perror("drmModeAtomicCommit");
+		err = -1;
+	} else if (err) {
+		fprintf(stderr, "drmModeAtomicAddProperty failed\n");
+	}
+	drmModeAtomicFree(req);
+	if (damage_blob)
+		drmModeDestroyPropertyBlob(fd, damage_blob);
+	if (err)
+		return -1;
+	for (uint32_t i=0; i<head_count && out_fence; i++)
+		*out_fence = merge_sync_files(*out_fence, out_fences[i]);
+	return 0;
+}
+
+/* Puts back the framebuffer and mode found at startup, or turns the display
+ * off again if it was off. Layer planes that were used are turned off. */
+int restore(int fd, const struct kms *kms) {
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	uint32_t src_w = kms->mode.hdisplay, src_h = kms->mode.vdisplay;
+	drmModeFB *fb = kms->saved_fb_id ? drmModeGetFB(fd, kms->saved_fb_id) : NULL;
+	if (fb) {
+		src_w = fb->width;
+		src_h = fb->height;
+		drmModeFreeFB(fb);
+	}
+	uint32_t flags = 0;
+	const drmModeModeInfo *mode = kms->saved_mode_blob ? &kms->saved_mode :
+	&kms->mode;
+	int err = add_plane_rect(req, kms->plane_id, &kms->plane_prop,
+	kms->saved_fb_id ? kms->saved_crtc_id : 0, kms->saved_fb_id, src_w, src_h,
+	0, 0, mode->hdisplay, mode->vdisplay);
+	if (kms->overlay_used)
+		err |= add_plane_rect(req, kms->overlay_id, &kms->overlay_prop, 0, 0,
+		0, 0, 0, 0, 0, 0);
+	if (kms->cursor_used)
+		err |= add_plane_rect(req, kms->cursor_id, &kms->cursor_prop, 0, 0,
+		0, 0, 0, 0, 0, 0);
+	if (kms->modeset) {
+		err |= add_crtc_state(req, kms, kms->saved_mode_blob);
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+	if (err) {
+		fprintf(stderr, "drmModeAtomicAddProperty failed\n");
+		drmModeAtomicFree(req);
+		return -1;
+	}
+	if (drmModeAtomicCommit(fd, req, flags, 0)) {
+		perror("drmModeAtomicCommit");
+		drmModeAtomicFree(req);
+		return -1;
+	}
+	drmModeAtomicFree(req);
+	return 0;
+}
+
+void drm_fini(int fd) {
+	close(fd);
+}
+
+/* KMS discovery needs nothing from Vulkan, so it runs on a worker thread
+ * while the instance and device are created. */
+struct display_setup {
+	const char *path;
+	struct mode_request mode;
+	int fd;
+	struct kms heads[max_heads];
+	uint32_t head_count;
+	double ms; // time the worker spent, CLOCK_MONOTONIC
+};
+
+static void *display_thread(void *arg) {
+	struct display_setup *d = arg;
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	d->fd = drm_init(d->path);
+	int count = d->fd >= 0 ? kms_init(d->fd, &d->mode, d->heads, max_heads) : -1;
+	if (d->fd >= 0 && count < 0) {
+		drm_fini(d->fd);
+		d->fd = -1;
+	}
+	d->head_count = count > 0 ? count : 0;
+	for (uint32_t i=0; i<d->head_count; i++)
+		if (d->heads[i].fb_modifiers)
+			d->heads[i].plane_mod_count = get_plane_modifiers(d->fd,
+			&d->heads[i], DRM_FORMAT_XRGB8888, d->heads[i].plane_mods,
+			max_modifiers);
+	d->ms = (clock_ns(CLOCK_MONOTONIC) - start) / 1e6;
+	return NULL;
+}
+
+/* For main() failing before it took the display over: waits for the worker
+ * and releases what it set up. */
+static void abandon_display(struct display_setup *d, pthread_t *thread,
+int threaded) {
+	if (threaded)
+		pthread_join(*thread, NULL);
+	if (d->fd < 0)
+		return;
+	for (uint32_t i=0; i<d->head_count; i++)
+		kms_fini(d->fd, &d->heads[i]);
+	drm_fini(d->fd);
+}
+
+#define max_buffers 3
+
+struct client_buffer;
+
+/* Everything is created once and reused for every frame drawn into it. */
+struct buffer {
+	VkImage image;
+	struct allocation memory;
+	VkCommandBuffer cmdbuf;
+	int prime_fd;
+	uint32_t handle;
+	uint32_t fb_id;
+	/* Signaled by the GPU when rendering is done; exported to KMS. */
+	VkSemaphore render_done;
+	/* Temporarily imports release_fd for the next render. */
+	VkSemaphore release;
+	/* Sync_file from KMS that signals once the buffer left scanout, or -1. */
+	int release_fd;
+	VkFence fence;
+	VkQueryPool queries;
+	int timed;
+	/* Damage since this buffer was last rendered into, in damage mode. */
+	struct damage pending;
+	/* Pixel (0, 0) of the persistently mapped image when the CPU fills it,
+	 * else NULL. */
+	uint8_t *pixels;
+	uint32_t pitch;
+	/* When the last frame drawn into it started, and the vblank it aimed
+	 * for (0 without pacing), ns, CLOCK_MONOTONIC. */
+	uint64_t start, target;
+	/* The client buffer the frame shows, either scanned out in place of
+	 * the image (direct) or copied into it; NULL if none. */
+	struct client_buffer *client;
+	int direct;
+	/* With VK_EXT_queue_family_foreign a modifier image is released to KMS
+	 * after every render and acquired back before the next one; both
+	 * barriers are recorded once. VK_NULL_HANDLE otherwise. */
+	VkCommandBuffer acquire_cmdbuf, release_cmdbuf;
+	int released; // owned by VK_QUEUE_FAMILY_FOREIGN_EXT
+	/* For drawing with the pipeline; VK_NULL_HANDLE when only cleared. */
+	VkImageView view;
+	VkFramebuffer framebuffer;
+};
+
+/* With cpu the image must be linear (no modifiers); it is placed in host
+ * visible memory and stays mapped. On integrated GPUs and lavapipe that
+ * memory can be scanned out directly. */
+int create_buffer(struct allocator *allocator, VkDevice dev,
+VkCommandPool pool, int drm_fd, const struct kms *kms, uint32_t width,
+uint32_t height, uint32_t format, VkImageUsageFlags usage,
+const struct modifier *mods, uint32_t mod_count, int cpu, struct buffer *b) {
+	b->image = create_image(dev, width, height, usage, mods, mod_count);
+	if (b->image == VK_NULL_HANDLE)
+		return -1;
+	if (allocate_image_memory(allocator, b->image, cpu ?
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT :
+	VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mod_count == 0,
+	VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT, &b->memory) < 0)
+		return -1;
+	b->cmdbuf = allocate_command_buffer(dev, pool);
+	if (b->cmdbuf == VK_NULL_HANDLE)
+		return -1;
+	b->render_done = create_semaphore(dev, external_semaphore_fd);
+	b->release = create_semaphore(dev, 0);
+	b->fence = create_fence(dev);
+	b->queries = create_query_pool(dev, 1);
+	if (b->render_done == VK_NULL_HANDLE || b->release == VK_NULL_HANDLE ||
+	b->fence == VK_NULL_HANDLE || b->queries == VK_NULL_HANDLE)
+		return -1;
+	b->release_fd = -1;
+	b->timed = 0;
+	b->pending = (struct damage){1, {{0, 0, width, height}}};
+	b->pixels = NULL;
+	b->client = NULL;
+	b->acquire_cmdbuf = b->release_cmdbuf = VK_NULL_HANDLE;
+	b->released = 0;
+	b->view = VK_NULL_HANDLE;
+	b->framebuffer = VK_NULL_HANDLE;
+
+	VkMemoryGetFdInfoKHR getFdInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR,
+		.pNext = NULL,
+		.memory = b->memory.memory,
+		.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT
+	};
+	if (vkGetMemoryFd(dev, &getFdInfo, &b->prime_fd)) {
+		fprintf(stderr, "vkGetMemoryFdKHR failed\n");
+		return -1;
+	}
+
+	if (drmPrimeFDToHandle(drm_fd, b->prime_fd, &b->handle)) {
+		perror("drmPrimeFDToHandle");
+		return -1;
+	}
+
+	uint64_t modifier = DRM_FORMAT_MOD_LINEAR;
+	uint32_t planes = 1;
+	VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+	if (mod_count) {
+		VkImageDrmFormatModifierPropertiesEXT props = {
+			.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_PROPERTIES_EXT
+		};
+		if (vkGetImageDrmFormatModifierProperties(dev, b->image, &props)) {
+			fprintf(stderr, "vkGetImageDrmFormatModifierPropertiesEXT failed\n");
+			return -1;
+		}
+		modifier = props.drmFormatModifier;
+		for (uint32_t i=0; i<mod_count; i++)
+			if (mods[i].modifier == modifier)
+				planes = mods[i].planes;
+		aspect = VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT;
+	}
+	uint32_t strides[4] = {0}, offsets[4] = {0};
+	for (uint32_t i=0; i<planes; i++) {
+		VkImageSubresource subresource = {
+			.aspectMask = aspect << i,
+			.mipLevel = 0,
+			.arrayLayer = 0
+		};
+		VkSubresourceLayout layout;
+		vkGetImageSubresourceLayout(dev, b->image, &subresource, &layout);
+		strides[i] = layout.rowPitch;
+		offsets[i] = layout.offset;
+	}
+	if (cpu) {
+		uint8_t *data = map_memory(allocator, &b->memory);
+		if (!data) {
+			fprintf(stderr, "vkMapMemory failed\n");
+			return -1;
+		}
+		b->pixels = data + offsets[0];
+		b->pitch = strides[0];
+	}
+	printf("Exported fd %d: modifier 0x%" PRIx64 ", %u plane(s), "
+	"rowPitch %u\n", b->prime_fd, modifier, planes, strides[0]);
+	return add_framebuffer(drm_fd, kms, width, height, format, b->handle,
+	planes, strides, offsets, modifier, &b->fb_id);
+}
+
+static VkCommandBuffer record_foreign_transfer(VkDevice dev,
+VkCommandPool pool, VkImage img, uint32_t family, int acquire) {
+	VkCommandBuffer cmdbuf = allocate_command_buffer(dev, pool);
+	if (cmdbuf == VK_NULL_HANDLE)
+		return VK_NULL_HANDLE;
+	VkCommandBufferBeginInfo infoBegin = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO
+	};
+	vkBeginCommandBuffer(cmdbuf, &infoBegin);
+	transfer_ownership(cmdbuf, img, family, acquire, VK_IMAGE_LAYOUT_GENERAL);
+	vkEndCommandBuffer(cmdbuf);
+	return cmdbuf;
+}
+
+/* Only for images with a DRM format modifier: KMS reads them with a layout
+ * Vulkan knows nothing about unless they are handed over. */
+int init_foreign_transfer(VkDevice dev, VkCommandPool pool, uint32_t family,
+struct buffer *b) {
+	b->acquire_cmdbuf = record_foreign_transfer(dev, pool, b->image, family, 1);
+	b->release_cmdbuf = record_foreign_transfer(dev, pool, b->image, family, 0);
+	if (b->acquire_cmdbuf == VK_NULL_HANDLE ||
+	b->release_cmdbuf == VK_NULL_HANDLE)
+		return -1;
+	return 0;
+}
+
+int init_framebuffer(VkDevice dev, const struct pipeline *p, uint32_t width,
+uint32_t height, struct buffer *b) {
+	VkImageViewCreateInfo view_info = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+		.image = b->image,
+		.viewType = VK_IMAGE_VIEW_TYPE_2D,
+		.format = VK_FORMAT_B8G8R8A8_UNORM,
+		.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}
+	};
+	if (vkCreateImageView(dev, &view_info, NULL, &b->view)) {
+		fprintf(stderr, "ERROR: init_framebuffer() failed.\n");
+		return -1;
+	}
+	VkFramebufferCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+		.renderPass = p->render_pass,
+		.attachmentCount = 1,
+		.pAttachments = &b->view,
+		.width = width,
+		.height = height,
+		.layers = 1
+	};
+	if (vkCreateFramebuffer(dev, &info, NULL, &b->framebuffer)) {
+		fprintf(stderr, "ERROR: init_framebuffer() failed.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Clears the image once and leaves it in GENERAL: layers keep that color,
+ * and each output's first buffer is what modeset() shows. */
+int clear_layer(VkDevice dev, VkQueue queue, struct buffer *b,
+VkClearColorValue color) {
+	VkCommandBufferBeginInfo infoBegin = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+	};
+	vkBeginCommandBuffer(b->cmdbuf, &infoBegin);
+	VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = 0,
+		.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = b->image,
+		.subresourceRange = range
+	};
+	vkCmdPipelineBarrier(b->cmdbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+	vkCmdClearColorImage(b->cmdbuf, b->image,
+	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	vkCmdPipelineBarrier(b->cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+	vkEndCommandBuffer(b->cmdbuf);
+
+	VkCommandBuffer cmdbufs[2] = {b->cmdbuf, b->release_cmdbuf};
+	VkSubmitInfo submitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.commandBufferCount = b->release_cmdbuf ? 2 : 1,
+		.pCommandBuffers = cmdbufs
+	};
+	vkResetFences(dev, 1, &b->fence);
+	if (vkQueueSubmit(queue, 1, &submitInfo, b->fence) ||
+	vkWaitForFences(dev, 1, &b->fence, VK_TRUE, UINT64_MAX)) {
+		fprintf(stderr, "ERROR: clear_layer() failed.\n");
+		return -1;
+	}
+	b->released = b->release_cmdbuf != VK_NULL_HANDLE;
+	return 0;
+}
+
+void destroy_buffer(struct allocator *allocator, VkDevice dev,
+VkCommandPool pool, int drm_fd, struct buffer *b) {
+	drmModeRmFB(drm_fd, b->fb_id);
+	drmCloseBufferHandle(drm_fd, b->handle);
+	close(b->prime_fd);
+	if (b->release_fd >= 0)
+		close(b->release_fd);
+	vkDestroyQueryPool(dev, b->queries, NULL);
+	vkDestroyFence(dev, b->fence, NULL);
+	vkDestroySemaphore(dev, b->release, NULL);
+	vkDestroySemaphore(dev, b->render_done, NULL);
+	vkFreeCommandBuffers(dev, pool, 1, &b->cmdbuf);
+	if (b->acquire_cmdbuf)
+		vkFreeCommandBuffers(dev, pool, 1, &b->acquire_cmdbuf);
+	if (b->release_cmdbuf)
+		vkFreeCommandBuffers(dev, pool, 1, &b->release_cmdbuf);
+	vkDestroyFramebuffer(dev, b->framebuffer, NULL);
+	vkDestroyImageView(dev, b->view, NULL);
+	vkDestroyImage(dev, b->image, NULL);
+	free_memory(allocator, &b->memory);
+}
+
+/* A buffer is on screen (front), waiting for its flip (pending), or free to
+ * be rendered into. Only one flip can be queued at a time; with several heads
+ * it is done once every one of them flipped. */
+struct flip_queue {
+	struct buffer *front, *pending;
+	uint32_t flips_left; // heads the pending buffer is not shown on yet
+	uint64_t first_flip; // ns, CLOCK_MONOTONIC; 0 until the first flip
+	struct pacer *pacer; // NULL without pacing
+	uint32_t pace_crtc_id; // the head whose vblanks the pacer follows
+	struct samples latency; // frame start to flip, ms
+};
+
+/* The head on crtc_id showed the pending buffer at ts, CLOCK_MONOTONIC. */
+static void flip_done(struct flip_queue *q, uint32_t crtc_id,
+uint32_t sequence, uint64_t ts) {
+	if (!q->first_flip)
+		q->first_flip = ts;
+	if (q->pending && q->pacer && crtc_id == q->pace_crtc_id)
+		pacer_flip(q->pacer, sequence, ts, q->pending->target);
+	if (q->flips_left > 1) {
+		q->flips_left--;
+		return;
+	}
+	q->flips_left = 0;
+	if (q->pending)
+		add_sample(&q->latency, (ts - q->pending->start) / 1e6);
+	q->front = q->pending;
+	q->pending = NULL;
+}
+
+/* The front buffer can be rendered into once a flip replacing it is queued
+ * and KMS handed out a release fence for it: the GPU waits on that fence.
+ * One showing a client buffer waits for the flip, which gives the client
+ * buffer back. */
+struct buffer *free_buffer(struct buffer *bufs, int n, struct flip_queue *q) {
+	for (int i=0; i<n; i++)
+		if (&bufs[i] != q->front && &bufs[i] != q->pending)
+			return &bufs[i];
+	if (q->pending && q->front && q->front->release_fd >= 0 &&
+	!q->front->client)
+		return q->front;
+	return NULL;
+}
+
+/* The render loop sleeps in epoll_wait only: the DRM fd delivers page-flip
+ * events, sync_files become readable once they signal, a timerfd starts paced
+ * frames and a signalfd turns SIGINT and SIGTERM into a clean shutdown. */
+#define max_events 8
+
+struct watch;
+typedef int (*watch_fn)(struct watch *w);
+
+struct watch {
+	int fd; // -1 while not watched
+	watch_fn handler; // returns < 0 to stop the loop on an error
+	void *data;
+};
+
+struct event_loop {
+	int epoll_fd;
+	int quit;
+};
+
+int init_event_loop(struct event_loop *l) {
+	l->quit = 0;
+	l->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (l->epoll_fd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	return 0;
+}
+
+int add_watch(struct event_loop *l, struct watch *w, int fd, watch_fn handler,
+void *data) {
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = w};
+	if (epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	w->fd = fd;
+	w->handler = handler;
+	w->data = data;
+	return 0;
+}
+
+void remove_watch(struct event_loop *l, struct watch *w) {
+	if (w->fd >= 0)
+		epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+	w->fd = -1;
+}
+
+/* A watch removed by an earlier handler of the same batch is skipped. */
+int run_event_loop(struct event_loop *l) {
+	struct epoll_event events[max_events];
+	while (!l->quit) {
+		int count = epoll_wait(l->epoll_fd, events, max_events, -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+		for (int i=0; i<count && !l->quit; i++) {
+			struct watch *w = events[i].data.ptr;
+			if (w->fd >= 0 && w->handler(w) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+void fini_event_loop(struct event_loop *l) {
+	close(l->epoll_fd);
+}
+
+/* Every render loop watches the same signalfd, so the signal is left unread
+ * for all of them to see. */
+static int signal_handler(struct watch *w) {
+	struct event_loop *l = w->data;
+	l->quit = 1;
+	return 0;
+}
+
+struct flip_event {
+	uint32_t crtc_id, sequence;
+	uint64_t ts; // ns, CLOCK_MONOTONIC
+};
+
+/* Clients hand full-screen buffers over a SOCK_SEQPACKET Unix socket: each
+ * message is a client_present with one dma-buf fd per memory plane attached
+ * (SCM_RIGHTS). The buffer is shown from the next frame on, until another
+ * one replaces it. A client_release with its id comes back once it is
+ * neither on screen nor the latest one, and the client may draw into it
+ * again. The client has to be done rendering before it sends the buffer. */
+struct client_present {
+	uint32_t id; // chosen by the client
+	uint32_t width, height;
+	uint32_t format; // DRM fourcc
+	uint64_t modifier; // DRM_FORMAT_MOD_INVALID if implicit
+	uint32_t planes;
+	uint32_t strides[4], offsets[4];
+};
+
+struct client_release {
+	uint32_t id;
+};
+
+/* A dma-buf is imported the first time it is sent and kept while the client
+ * is connected, so clients cycling through a few buffers pay for it once. */
+#define max_client_buffers 4
+
+struct client_buffer {
+	ino_t ino; // identifies the dma-buf; 0 for a free slot
+	struct client_present desc; // as last sent
+	uint32_t handles[4];
+	uint32_t fb_id; // 0 if KMS does not take it
+	/* Copied into the frames that cannot scan it out; VK_NULL_HANDLE if
+	 * Vulkan cannot import it. */
+	VkImage image;
+	VkDeviceMemory memory;
+	int acquired; // a recorded frame brought image to GENERAL
+	uint32_t refs; // frames showing it
+	int gone; // its client disconnected: destroyed once no frame shows it
+};
+
+struct client {
+	const char *path;
+	int listen_fd;
+	int fd; // -1 while nobody is connected
+	int allow_direct; // 0 composites everything, for comparison
+	int can_import; // VK_EXT_queue_family_foreign is there
+	struct client_buffer buffers[max_client_buffers];
+	struct client_buffer *latest; // NULL shows our own frames
+	struct watch accept, conn;
+	struct client_stats stats;
+};
+
+/* Everything the render loop of one output needs. Each output has a thread
+ * and an event loop of its own, and drives one head, or in clone mode every
+ * head with the same mode: those scan out the same buffers, which are only
+ * rendered once. One frame is prepared at a time: it starts once a buffer is
+ * free (with pacing, once the timer fires), may wait for a sync_file, and is
+ * committed once the previous flip is done. Every step is a callback from
+ * the event loop. */
+struct output {
+	uint32_t index;
+	pthread_t thread;
+	int threaded;
+	struct event_loop loop;
+	VkPhysicalDevice physical_device;
+	VkDevice device;
+	VkQueue queue;
+	pthread_mutex_t *queue_lock; // the queue is shared by every output
+	uint32_t queue_family;
+	VkCommandPool pool; // only used on the output's thread
+	int drm_fd;
+	struct kms heads[max_heads];
+	uint32_t head_count;
+	int in_fence_fd; // every head takes IN_FENCE_FD
+	uint32_t width, height;
+	struct buffer buffers[max_buffers];
+	int buffer_count;
+	uint32_t damage_size; // 0 redraws every frame in full
+	struct tiles tiles; // GPU damage updates only
+	const struct pipeline *pipeline; // NULL clears full redraws
+	struct layer layers[max_layers];
+	struct buffer layer_buffers[max_layers];
+	uint32_t layer_count;
+	const struct fill_kernel *kernel; // NULL renders on the GPU
+	int explicit_sync; // render_done is exported as a sync_file
+	struct capture *capture; // NULL without capture
+	struct client *client; // NULL unless clients can connect
+	struct pacer pacer;
+	struct flip_queue flips;
+	/* Flip events, read from the DRM fd by any render thread, wait here
+	 * until wake_fd gets this thread to handle them. */
+	pthread_mutex_t lock;
+	struct flip_event events[max_heads];
+	uint32_t event_count;
+	int wake_fd;
+	uint64_t frame_count, n; // n frames committed so far
+	struct watch drm, wake, timer, fence, stop;
+	/* The frame being prepared, and the one waiting for the previous flip
+	 * before its commit; NULL if none. */
+	struct buffer *current, *ready;
+	int in_fence; // sync_file of the render of current or ready, or -1
+	struct damage frame_damage;
+	struct drm_mode_rect square;
+	uint64_t cpu_start;
+	struct samples cpu_ms, gpu_ms;
+	double last_gpu_ms;
+	uint64_t damaged_pixels;
+	int error; // the loop stopped on a failure rather than when done
+};
+
+/* Creates a listening socket at path, replacing a stale socket but nothing
+ * else. */
+int listen_client_socket(const char *path) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	struct stat st;
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s exists and is not a socket\n", path);
+			return -1;
+		}
+		if (unlink(path)) {
+			perror(path);
+			return -1;
+		}
+	} else if (errno != ENOENT) {
+		perror(path);
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1)) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void destroy_client_buffer(struct output *o, struct client_buffer *cb) {
+	if (cb->fb_id)
+		drmModeRmFB(o->drm_fd, cb->fb_id);
+	/* Planes in the same dma-buf share a handle. */
+	for (uint32_t i=0; i<cb->desc.planes; i++) {
+		int first = cb->handles[i] != 0;
+		for (uint32_t j=0; j<i && first; j++)
+			first = cb->handles[j] != cb->handles[i];
+		if (first)
+			drmCloseBufferHandle(o->drm_fd, cb->handles[i]);
+	}
+	if (cb->image != VK_NULL_HANDLE) {
+		vkDestroyImage(o->device, cb->image, NULL);
+		vkFreeMemory(o->device, cb->memory, NULL);
+	}
+	memset(cb, 0, sizeof(*cb));
+}
+
+static void send_release(struct client *c, uint32_t id) {
+	struct client_release msg = {id};
+	if (c->fd >= 0 && send(c->fd, &msg, sizeof(msg),
+	MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		perror("send");
+}
+
+/* No frame shows cb and a newer one replaced it. */
+static void release_client_buffer(struct output *o, struct client_buffer *cb) {
+	if (cb->gone)
+		destroy_client_buffer(o, cb);
+	else
+		send_release(o->client, cb->desc.id);
+}
+
+/* b's frame is done with its client buffer. */
+static void client_done(struct output *o, struct buffer *b) {
+	struct client_buffer *cb = b->client;
+	b->client = NULL;
+	if (--cb->refs == 0 && cb != o->client->latest)
+		release_client_buffer(o, cb);
+}
+
+/* Everything but the id. */
+static int same_layout(const struct client_present *a,
+const struct client_present *b) {
+	if (a->width != b->width || a->height != b->height ||
+	a->format != b->format || a->modifier != b->modifier ||
+	a->planes != b->planes)
+		return 0;
+	for (uint32_t i=0; i<a->planes; i++)
+		if (a->strides[i] != b->strides[i] || a->offsets[i] != b->offsets[i])
+			return 0;
+	return 1;
+}
+
+/* Scanning out the client buffer in place of the frame needs it to cover the
+ * mode exactly and no layer to be composited into the frame. Tested for every
+ * frame, with the layers where that frame puts them. */
+static int test_direct(struct output *o, const struct client_buffer *cb) {
+	if (!o->client->allow_direct || !cb->fb_id || cb->desc.width != o->width ||
+	cb->desc.height != o->height)
+		return 0;
+	for (uint32_t i=0; i<o->layer_count; i++)
+		if (!o->layers[i].plane_id)
+			return 0;
+	for (uint32_t i=0; i<o->head_count; i++)
+		if (test_layers(o->drm_fd, &o->heads[i], cb->fb_id, o->layers,
+		o->layer_count) < 0)
+			return 0;
+	return 1;
+}
+
+/* KMS gets a framebuffer if it takes the layout, and Vulkan imports the
+ * buffer if it can, so that a frame whose direct test fails can still
+ * composite it. */
+static int import_client_buffer(struct output *o, const struct client_present *p,
+const int *fds, ino_t ino, struct client_buffer *cb) {
+	struct client *c = o->client;
+	cb->ino = ino;
+	cb->desc = *p;
+	uint64_t modifiers[4] = {0};
+	int single = 1; // every plane in the first dma-buf
+	for (uint32_t i=0; i<p->planes; i++) {
+		if (drmPrimeFDToHandle(o->drm_fd, fds[i], &cb->handles[i])) {
+			perror("drmPrimeFDToHandle");
+			return -1;
+		}
+		modifiers[i] = p->modifier;
+		single &= cb->handles[i] == cb->handles[0];
+	}
+	if (drmModeAddFB2WithModifiers(o->drm_fd, p->width, p->height, p->format,
+	cb->handles, p->strides, p->offsets, modifiers, &cb->fb_id,
+	p->modifier != DRM_FORMAT_MOD_INVALID ? DRM_MODE_FB_MODIFIERS : 0)) {
+		perror("drmModeAddFB2WithModifiers");
+		cb->fb_id = 0;
+	}
+	int importable = c->can_import && single &&
+	p->modifier != DRM_FORMAT_MOD_INVALID &&
+	(p->format == DRM_FORMAT_XRGB8888 || p->format == DRM_FORMAT_ARGB8888);
+	if (importable) {
+		cb->image = import_image(o->device, fds[0], p->width, p->height,
+		p->modifier, p->planes, p->strides, p->offsets, &cb->memory);
+		if (cb->image == VK_NULL_HANDLE && !cb->fb_id)
+			return -1;
+	}
+	if (!cb->fb_id && cb->image == VK_NULL_HANDLE) {
+		fprintf(stderr, "client buffer %u: neither KMS nor Vulkan can "
+		"take it\n", p->id);
+		return -1;
+	}
+	printf("client buffer %u: %ux%u %.4s, modifier 0x%" PRIx64 ": %s\n",
+	p->id, p->width, p->height, (const char *)&p->format, p->modifier,
+	!cb->fb_id ? "GPU composition" : cb->image == VK_NULL_HANDLE ?
+	"direct scanout only" : "direct scanout or GPU composition");
+	return 0;
+}
+
+/* A slot that is free, or whose buffer no frame needs any more. */
+static struct client_buffer *client_slot(struct output *o) {
+	struct client *c = o->client;
+	for (uint32_t i=0; i<max_client_buffers; i++)
+		if (!c->buffers[i].ino)
+			return &c->buffers[i];
+	for (uint32_t i=0; i<max_client_buffers; i++) {
+		struct client_buffer *cb = &c->buffers[i];
+		if (!cb->refs && cb != c->latest) {
+			destroy_client_buffer(o, cb);
+			return cb;
+		}
+	}
+	return NULL;
+}
+
+/* The client gets the buffer straight back if it cannot be shown. */
+static void present_client_buffer(struct output *o,
+const struct client_present *p, const int *fds) {
+	struct client *c = o->client;
+	struct stat st;
+	if (fstat(fds[0], &st)) {
+		perror("fstat");
+		send_release(c, p->id);
+		return;
+	}
+	struct client_buffer *cb = NULL;
+	for (uint32_t i=0; i<max_client_buffers && !cb; i++)
+		if (c->buffers[i].ino == st.st_ino)
+			cb = &c->buffers[i];
+	if (cb && !same_layout(&cb->desc, p)) {
+		if (cb->refs || cb == c->latest) {
+			fprintf(stderr, "client buffer %u: layout changed while in use\n",
+			p->id);
+			send_release(c, p->id);
+			return;
+		}
+		destroy_client_buffer(o, cb);
+	}
+	if (!cb || !cb->ino) {
+		cb = cb ? cb : client_slot(o);
+		if (!cb) {
+			fprintf(stderr, "client buffer %u: all %d slots in use\n", p->id,
+			max_client_buffers);
+			send_release(c, p->id);
+			return;
+		}
+		if (import_client_buffer(o, p, fds, st.st_ino, cb) < 0) {
+			destroy_client_buffer(o, cb);
+			send_release(c, p->id);
+			return;
+		}
+	}
+	cb->desc.id = p->id;
+	struct client_buffer *old = c->latest;
+	c->latest = cb;
+	if (old && old != cb && !old->refs)
+		release_client_buffer(o, old);
+}
+
+/* Buffers still on screen are destroyed once their frames are done. */
+static void disconnect_client(struct output *o) {
+	struct client *c = o->client;
+	remove_watch(&o->loop, &c->conn);
+	close(c->fd);
+	c->fd = -1;
+	c->latest = NULL;
+	for (uint32_t i=0; i<max_client_buffers; i++) {
+		struct client_buffer *cb = &c->buffers[i];
+		if (cb->ino && !cb->refs)
+			destroy_client_buffer(o, cb);
+		else if (cb->ino)
+			cb->gone = 1;
+	}
+	printf("client disconnected\n");
+}
+
+/* A bad message disconnects the client; it never stops the render loop. */
+static int client_handler(struct watch *w) {
+	struct output *o = w->data;
+	struct client_present p;
+	char control[CMSG_SPACE(4 * sizeof(int))];
+	struct iovec iov = {.iov_base = &p, .iov_len = sizeof(p)};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control)
+	};
+	ssize_t n = recvmsg(w->fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	int fds[4];
+	uint32_t fd_count = 0;
+	for (struct cmsghdr *cm = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cm;
+	cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		uint32_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (uint32_t i=0; i<count; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(fd));
+			if (fd_count < 4)
+				fds[fd_count++] = fd;
+			else
+				close(fd);
+		}
+	}
+	if (n > 0 && (n != sizeof(p) || (msg.msg_flags & MSG_CTRUNC) ||
+	p.planes == 0 || p.planes > 4 || fd_count != p.planes)) {
+		fprintf(stderr, "client: bad message\n");
+		n = 0;
+	}
+	if (n > 0)
+		present_client_buffer(o, &p, fds);
+	for (uint32_t i=0; i<fd_count; i++)
+		close(fds[i]);
+	if (n <= 0)
+		disconnect_client(o);
+	return 0;
+}
+
+/* One client at a time. */
+static int accept_handler(struct watch *w) {
+	struct output *o = w->data;
+	struct client *c = o->client;
+	/* Messages are read and written with MSG_DONTWAIT. */
+	int fd = accept4(w->fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			perror("accept4");
+		return 0;
+	}
+	if (c->fd >= 0) {
+		fprintf(stderr, "client: another one is connected\n");
+		close(fd);
+		return 0;
+	}
+	if (add_watch(&o->loop, &c->conn, fd, client_handler, o) < 0) {
+		close(fd);
+		return 0;
+	}
+	c->fd = fd;
+	printf("client connected\n");
+	return 0;
+}
+
+/* Frames are done with by now. */
+void fini_client(struct output *o) {
+	struct client *c = o->client;
+	if (c->fd >= 0)
+		close(c->fd);
+	for (uint32_t i=0; i<max_client_buffers; i++)
+		if (c->buffers[i].ino)
+			destroy_client_buffer(o, &c->buffers[i]);
+	close(c->listen_fd);
+	unlink(c->path);
+}
+
+/* Runs on whichever render thread read the event: it is queued for the
+ * output that made the commit, and that output's thread is woken up. */
+static void page_flip_handler(int fd, unsigned int sequence,
+unsigned int tv_sec, unsigned int tv_usec, unsigned int crtc_id,
+void *user_data) {
+	struct output *o = user_data;
+	struct flip_event e = {crtc_id, sequence,
+	(uint64_t)tv_sec * 1000000000 + tv_usec * 1000ull};
+	pthread_mutex_lock(&o->lock);
+	if (o->event_count < max_heads)
+		o->events[o->event_count++] = e;
+	pthread_mutex_unlock(&o->lock);
+	uint64_t one = 1;
+	if (write(o->wake_fd, &one, sizeof(one)) < 0)
+		perror("write");
+}
+
+static int read_drm_events(int fd) {
+	drmEventContext ctx = {
+		.version = 3,
+		.page_flip_handler2 = page_flip_handler
+	};
+	if (drmHandleEvent(fd, &ctx) && errno != EAGAIN) {
+		fprintf(stderr, "drmHandleEvent failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void handle_flips(struct output *o) {
+	struct flip_event events[max_heads];
+	pthread_mutex_lock(&o->lock);
+	uint32_t count = o->event_count;
+	memcpy(events, o->events, count * sizeof(events[0]));
+	o->event_count = 0;
+	pthread_mutex_unlock(&o->lock);
+	struct buffer *old = o->flips.front;
+	for (uint32_t i=0; i<count; i++)
+		flip_done(&o->flips, events[i].crtc_id, events[i].sequence,
+		events[i].ts);
+	/* A composited client buffer was copied before its frame went on
+	 * screen; one scanned out directly is free once it is replaced. */
+	struct buffer *front = o->flips.front;
+	if (front != old && front && front->client && !front->direct)
+		client_done(o, front);
+	if (front != old && old && old->client && old->direct)
+		client_done(o, old);
+}
+
+/* Blocks until no output has a flip pending; only used once the render
+ * threads have stopped. */
+int wait_flips(int fd, struct output *outputs, uint32_t count) {
+	for (;;) {
+		int pending = 0;
+		for (uint32_t i=0; i<count; i++) {
+			handle_flips(&outputs[i]);
+			pending |= outputs[i].flips.pending != NULL;
+		}
+		if (!pending)
+			return 0;
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return -1;
+		}
+		if (read_drm_events(fd) < 0)
+			return -1;
+	}
+}
+
+/* Lights up every head of every output with the output's first buffer and
+ * its layers, in one blocking commit before the render threads start. A
+ * modeset may pull in state shared with other CRTCs, so it must not race
+ * with their flips; every later commit only flips. */
+int modeset(int fd, struct output *outputs, uint32_t count) {
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	uint32_t flags = 0;
+	int err = 0;
+	for (uint32_t k=0; k<count; k++) {
+		struct output *o = &outputs[k];
+		for (uint32_t i=0; i<o->head_count; i++) {
+			struct kms *kms = &o->heads[i];
+			err |= add_plane_state(req, kms, kms->crtc_id, o->buffers[0].fb_id,
+			o->width, o->height) < 0;
+			if (kms->modeset) {
+				err |= add_crtc_state(req, kms, kms->mode_blob) < 0;
+				flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+			}
+		}
+		for (uint32_t i=0; i<o->layer_count; i++)
+			if (o->layers[i].plane_id)
+				err |= add_layer_state(req, &o->heads[0], &o->layers[i]) < 0;
+	}
+	if (err) {
+		fprintf(stderr, "drmModeAtomicAddProperty failed\n");
+	} else if (drmModeAtomicCommit(fd, req, flags, NULL)) {
+		perror("drmModeAtomicCommit");
+		err = 1;
+	}
+	drmModeAtomicFree(req);
+	if (err)
+		return -1;
+	for (uint32_t k=0; k<count; k++) {
+		for (uint32_t i=0; i<outputs[k].head_count; i++)
+			outputs[k].heads[i].configured = 1;
+		outputs[k].flips.front = &outputs[k].buffers[0];
+	}
+	return 0;
+}
+
+static int start_frame(struct output *o);
+
+static int commit_frame(struct output *o) {
+	struct buffer *b = o->ready, *old = o->flips.front;
+	uint32_t fb_id = b->direct ? b->client->fb_id : b->fb_id;
+	/* The release fence is imported into Vulkan, or waited for before a
+	 * CPU fill; without sync_file support the flip event has to do. */
+	int32_t out_fence = -1;
+	int err = scanout(o->drm_fd, o->heads, o->head_count, fb_id,
+	o->in_fence, old && (o->explicit_sync || o->kernel) ? &out_fence : NULL,
+	o->damage_size && o->n > 0 ? &o->frame_damage : NULL, o->layers,
+	o->layer_count, o);
+	if (o->in_fence >= 0)
+		close(o->in_fence);
+	o->in_fence = -1;
+	o->ready = NULL;
+	if (err < 0)
+		return -1;
+	if (old && out_fence >= 0) {
+		if (old->release_fd >= 0)
+			close(old->release_fd);
+		old->release_fd = out_fence;
+	}
+	o->flips.pending = b;
+	o->flips.flips_left = o->head_count;
+	add_sample(&o->cpu_ms, (clock_ns(CLOCK_THREAD_CPUTIME_ID) - o->cpu_start) /
+	1e6);
+	o->n++;
+	return start_frame(o);
+}
+/* in_fence is handed to KMS with the commit, or -1. */
+static int frame_ready(struct output *o, int in_fence) {
+	struct buffer *b = o->current;
+	/* The GPU work runs after this, roughly as long as the last time. */
+	if (o->flips.pacer)
+		pacer_cost(o->flips.pacer, clock_ns(CLOCK_MONOTONIC) - b->start +
+		(uint64_t)(o->last_gpu_ms * 1e6));
+	o->current = NULL;
+	o->ready = b;
+	o->in_fence = in_fence;
+	if (o->flips.pending)
+		return 0; // committed from the flip event
+	return commit_frame(o);
+}
+
+static int fill_frame(struct output *o) {
+	struct buffer *b = o->current;
+	if (o->damage_size) {
+		for (uint32_t i=0; i<b->pending.count; i++)
+			fill_rect(o->kernel, b->pixels, b->pitch, b->pending.rects[i],
+			0xffe5e5f9);
+		fill_rect(o->kernel, b->pixels, b->pitch, o->square,
+		0xffe5e500 | (o->n % 256));
+		b->pending.count = 0;
+	} else {
+		fill_rect(o->kernel, b->pixels, b->pitch,
+		(struct drm_mode_rect){0, 0, o->width, o->height},
+		0xffe5e500 | (o->n % 256));
+	}
+	return frame_ready(o, -1);
+}
+
+/* Nothing reads the buffer any more once it left scanout. */
+static int release_handler(struct watch *w) {
+	struct output *o = w->data;
+	remove_watch(&o->loop, w);
+	close(o->current->release_fd);
+	o->current->release_fd = -1;
+	return fill_frame(o);
+}
+
+/* Without IN_FENCE_FD the commit waits for the render here rather than in
+ * the kernel. */
+static int render_handler(struct watch *w) {
+	struct output *o = w->data;
+	remove_watch(&o->loop, w);
+	close(o->in_fence);
+	o->in_fence = -1;
+	return frame_ready(o, -1);
+}
+
+static int render_frame(struct output *o) {
+	struct buffer *b = o->current;
+	/* The buffer went through a flip since its last render, which waited
+	 * for that render, so this does not block. */
+	vkWaitForFences(o->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
+	vkResetFences(o->device, 1, &b->fence);
+	if (b->timed) {
+		double ms = get_pass_time(o->physical_device, o->device,
+		o->queue_family, b->queries, 0);
+		if (ms >= 0) {
+			add_sample(&o->gpu_ms, ms);
+			o->last_gpu_ms = ms;
+		}
+	}
+
+	VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT |
+	VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	int wait = 0;
+	if (b->release_fd >= 0) {
+		wait = !import_sync_file(o->device, b->release, b->release_fd);
+		b->release_fd = -1;
+	}
+	if (o->damage_size) {
+		uint32_t tile = 1 + (b - o->buffers);
+		fill_tile(&o->tiles, tile, 0xffe5e500 | (o->n % 256));
+		record_command_update(b->cmdbuf, b->image, b->queries, &o->tiles,
+		tile, &b->pending, o->square, o->width, o->height);
+		b->pending.count = 0;
+	} else {
+		/* The client buffer goes under the layers. */
+		struct layer layers[1 + max_layers];
+		uint32_t count = 0;
+		if (b->client) {
+			const struct client_present *p = &b->client->desc;
+			layers[count++] = (struct layer){
+				.name = "client",
+				.image = b->client->image,
+				.width = p->width < o->width ? p->width : o->width,
+				.height = p->height < o->height ? p->height : o->height,
+				.foreign = 1,
+				.family = o->queue_family,
+				.fresh = !b->client->acquired
+			};
+			b->client->acquired = 1;
+		}
+		memcpy(&layers[count], o->layers, o->layer_count * sizeof(layers[0]));
+		record_command_clear(b->cmdbuf, b->image, b->queries, o->pipeline,
+		b->framebuffer, o->width, o->height, layers, count + o->layer_count,
+		o->n);
+	}
+	/* The capture copy is in the batch that signals render_done, which the
+	 * flip waits for; so is the release to KMS, after everything else. */
+	struct capture_slot *slot = o->capture ?
+	begin_capture(o->capture, b->image, o->n) : NULL;
+	VkCommandBuffer cmdbufs[4];
+	uint32_t cmdbuf_count = 0;
+	if (b->released)
+		cmdbufs[cmdbuf_count++] = b->acquire_cmdbuf;
+	cmdbufs[cmdbuf_count++] = b->cmdbuf;
+	if (slot)
+		cmdbufs[cmdbuf_count++] = slot->cmdbuf;
+	if (b->release_cmdbuf)
+		cmdbufs[cmdbuf_count++] = b->release_cmdbuf;
+	VkSubmitInfo submitInfo = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.waitSemaphoreCount = wait,
+		.pWaitSemaphores = &b->release,
+		.pWaitDstStageMask = &waitStage,
+		.commandBufferCount = cmdbuf_count,
+		.pCommandBuffers = cmdbufs,
+		.signalSemaphoreCount = o->explicit_sync,
+		.pSignalSemaphores = &b->render_done
+	};
+	pthread_mutex_lock(o->queue_lock);
+	int err = vkQueueSubmit(o->queue, 1, &submitInfo, b->fence) != VK_SUCCESS;
+	if (err)
+		fprintf(stderr, "vkQueueSubmit failed\n");
+	else if (slot)
+		err = queue_capture(o->capture, slot, o->queue) < 0;
+	pthread_mutex_unlock(o->queue_lock);
+	if (err)
+		return -1;
+	b->timed = 1;
+	b->released = b->release_cmdbuf != VK_NULL_HANDLE;
+
+	if (!o->explicit_sync) {
+		/* Nothing to poll without sync_file export. */
+		vkWaitForFences(o->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
+		return frame_ready(o, -1);
+	}
+	int in_fence = export_sync_file(o->device, b->render_done);
+	if (in_fence < 0)
+		return -1;
+	if (o->in_fence_fd)
+		return frame_ready(o, in_fence);
+	o->in_fence = in_fence;
+	return add_watch(&o->loop, &o->fence, in_fence, render_handler, o);
+}
+
+static int prepare_frame(struct output *o) {
+	struct buffer *b = o->current;
+	for (uint32_t i=0; i<o->layer_count; i++)
+		move_layer(&o->layers[i], o->n, 2 + 4 * i, o->width, o->height);
+	/* The frame's damage is everything that differs from the previous
+	 * frame; every buffer has to catch up on it before it is shown. */
+	uint64_t pixels = (uint64_t)o->width * o->height;
+	o->frame_damage.count = 0;
+	if (o->damage_size) {
+		o->square = square_rect(o->n, o->damage_size, o->width, o->height);
+		if (o->n > 0)
+			add_damage(&o->frame_damage, square_rect(o->n - 1, o->damage_size,
+			o->width, o->height));
+		add_damage(&o->frame_damage, o->square);
+		for (int i=0; i<o->buffer_count; i++)
+			merge_damage(&o->buffers[i].pending, &o->frame_damage);
+		o->damaged_pixels += damage_area(&b->pending, o->width, o->height);
+	} else {
+		o->damaged_pixels += pixels;
+	}
+
+	/* The layers moved, so the planes are tested again: first with the
+	 * client buffer in place of the frame, else with the frame. A client
+	 * buffer that only KMS takes is left out of frames it cannot be
+	 * scanned out in. */
+	struct client *c = o->client;
+	struct client_buffer *cb = c ? c->latest : NULL;
+	for (uint32_t i=0; i<o->layer_count; i++)
+		o->layers[i].plane_id = o->layers[i].assigned_plane;
+	b->direct = cb && test_direct(o, cb);
+	if (!b->direct)
+		retest_planes(o->drm_fd, &o->heads[0], b->fb_id, o->layers,
+		o->layer_count);
+	if (cb && (b->direct || cb->image != VK_NULL_HANDLE)) {
+		b->client = cb;
+		cb->refs++;
+		if (b->direct) {
+			c->stats.direct_frames++;
+			return frame_ready(o, -1);
+		}
+		c->stats.composited_frames++;
+	}
+	if (!o->kernel)
+		return render_frame(o);
+	if (b->release_fd >= 0)
+		return add_watch(&o->loop, &o->fence, b->release_fd, release_handler, o);
+	return fill_frame(o);
+}
+
+/* The latest start that still makes the next vblank the previous frame does
+ * not already have. */
+static int timer_handler(struct watch *w) {
+	struct output *o = w->data;
+	uint64_t expirations;
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		perror("read");
+		return -1;
+	}
+	o->current->start = clock_ns(CLOCK_MONOTONIC);
+	return prepare_frame(o);
+}
+
+/* Stops the loop once the last flip is done. */
+static int start_frame(struct output *o) {
+	if (o->current || o->ready)
+		return 0;
+	if (o->n == o->frame_count) {
+		if (!o->flips.pending)
+			o->loop.quit = 1;
+		return 0;
+	}
+	struct buffer *b = free_buffer(o->buffers, o->buffer_count, &o->flips);
+	if (!b)
+		return 0; // the next flip event frees one
+	o->cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	o->current = b;
+	b->start = clock_ns(CLOCK_MONOTONIC);
+	b->target = 0;
+	if (o->flips.pacer) {
+		uint64_t start;
+		b->target = pace_frame(o->flips.pacer, b->start, &start);
+		if (start > b->start) {
+			struct itimerspec its = {
+				.it_value = {start / 1000000000, start % 1000000000}
+			};
+			if (timerfd_settime(o->timer.fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+				perror("timerfd_settime");
+				return -1;
+			}
+			return 0;
+		}
+	}
+	return prepare_frame(o);
+}
+
+static int drm_handler(struct watch *w) {
+	return read_drm_events(w->fd);
+}
+
+static int wake_handler(struct watch *w) {
+	struct output *o = w->data;
+	uint64_t count;
+	if (read(w->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		perror("read");
+		return -1;
+	}
+	handle_flips(o);
+	if (o->ready && !o->flips.pending)
+		return commit_frame(o);
+	return start_frame(o);
+}
+
+static void *render_thread(void *arg) {
+	struct output *o = arg;
+	o->error = start_frame(o) < 0 || run_event_loop(&o->loop) < 0;
+	/* Stopped early, by a signal or an error: a frame may still be waiting
+	 * for its sync_file. */
+	remove_watch(&o->loop, &o->fence);
+	if (o->in_fence >= 0)
+		close(o->in_fence);
+	o->in_fence = -1;
+	return NULL;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-d DRM device] [-b buffers (2-%d)] "
+	"[-n frame count] [-D square size (damage mode)] "
+	"[-c (fill on the CPU)] [-m (CPU fill vs GPU clear microbenchmark)] "
+	"[-C capture every n-th frame] [-o capture file (.y4m or raw BGRA)] "
+	"[-l (overlay and cursor layers on planes)] [-t (draw a triangle)] "
+	"[-G (composite the layers and client buffers on the GPU)] "
+	"[-P margin in us (pace frames to finish just before vblank)] "
+	"[-M (heads with the same mode mirror one set of buffers)] "
+	"[-R WIDTHxHEIGHT[@HZ] (mode; default: preferred, highest refresh)] "
+	"[-S socket (show dma-bufs from a client on the first output)] "
+	"[-F (fast start: no validation)] [-j JSON results file]\n", argv0,
+	max_buffers);
+}
+
+int main(int argc, char *argv[]) {
+	const char *json_path = NULL;
+	const char *drm_path = "/dev/dri/card0";
+	int buffer_count = max_buffers;
+	uint64_t frame_count = 300;
+	int fast_start = 0;
+	uint32_t damage_size = 0; // 0 redraws every frame in full
+	int cpu_fill = 0;
+	int fill_bench = 0;
+	uint32_t capture_every = 0; // 0 captures nothing
+	const char *capture_path = "capture.y4m";
+	int show_layers = 0;
+	int gpu_composition = 0;
+	int draw = 0;
+	int64_t pace_margin = -1; // us, -1 renders as soon as a buffer is free
+	int clone = 0;
+	struct mode_request mode = {0};
+	const char *client_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:b:n:D:cmC:o:ltGP:MR:S:Fj:")) != -1) {
+		switch (opt) {
+		case 'd':
+			drm_path = optarg;
+			break;
+		case 'b':
+			buffer_count = atoi(optarg);
+			if (buffer_count < 2 || buffer_count > max_buffers) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			frame_count = strtoull(optarg, NULL, 10);
+			break;
+		case 'D':
+			damage_size = atoi(optarg);
+			if (damage_size == 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			cpu_fill = 1;
+			break;
+		case 'm':
+			fill_bench = 1;
+			break;
+		case 'C':
+			capture_every = atoi(optarg);
+			if (capture_every == 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			capture_path = optarg;
+			break;
+		case 'l':
+			show_layers = 1;
+			break;
+		case 't':
+			draw = 1;
+			break;
+		case 'G':
+			gpu_composition = 1;
+			break;
+		case 'P':
+			pace_margin = atoi(optarg);
+			if (pace_margin < 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'M':
+			clone = 1;
+			break;
+		case 'R':
+			if (parse_mode_request(optarg, &mode) < 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			client_path = optarg;
+			break;
+		case 'F':
+			fast_start = 1;
+			break;
+		case 'j':
+			json_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	struct startup startup = {.last = clock_ns(CLOCK_MONOTONIC)};
+	struct display_setup display = {.path = drm_path, .mode = mode, .fd = -1};
+	pthread_t display_worker;
+	int threaded = 0;
+	/* Blocked before any thread starts, so they are only ever delivered
+	 * through the signalfd of the event loop. */
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	if (!fill_bench) {
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+		threaded = !pthread_create(&display_worker, NULL, display_thread,
+		&display);
+		if (!threaded)
+			display_thread(&display);
+	}
+
+	VkInstance instance = create_instance(fast_start);
+	if (instance == VK_NULL_HANDLE) {
+		abandon_display(&display, &display_worker, threaded);
+		return EXIT_FAILURE;
+	}
+	startup_phase(&startup, "instance", clock_ns(CLOCK_MONOTONIC));
+
+	VkPhysicalDevice physical_device = get_physical_device(instance);
+	if (physical_device == VK_NULL_HANDLE) {
+		abandon_display(&display, &display_worker, threaded);
+		return EXIT_FAILURE;
+	}
+	int modifiers = has_device_extension(physical_device,
+	VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME);
+	uint32_t queue_family = find_queue_family(physical_device,
+	VK_QUEUE_GRAPHICS_BIT);
+	if (queue_family == UINT32_MAX) {
+		abandon_display(&display, &display_worker, threaded);
+		return EXIT_FAILURE;
+	}
+	startup_phase(&startup, "physical device", clock_ns(CLOCK_MONOTONIC));
+
+	int foreign = modifiers && has_device_extension(physical_device,
+	VK_EXT_QUEUE_FAMILY_FOREIGN_EXTENSION_NAME);
+	VkDevice device = create_device(instance, physical_device, queue_family,
+	modifiers, foreign);
+	if (device == VK_NULL_HANDLE) {
+		abandon_display(&display, &display_worker, threaded);
+		return EXIT_FAILURE;
+	}
+	startup_phase(&startup, "device", clock_ns(CLOCK_MONOTONIC));
+
+	VkQueue queue;
+	vkGetDeviceQueue(device, queue_family, 0, &queue);
+
+	VkCommandPool command_pool = create_command_pool(device, queue_family);
+	if (command_pool == VK_NULL_HANDLE) {
+		abandon_display(&display, &display_worker, threaded);
+		return EXIT_FAILURE;
+	}
+
+	/* Without sync_file export the CPU has to wait for rendering before the
+	 * atomic commit. */
+	struct fill_kernel kernel = pick_fill_kernel();
+	/* Needs no display, so it also runs on machines without KMS access. */
+	if (fill_bench) {
+		struct fill_result results[] = {{16}, {64}, {256}, {1024}};
+		uint32_t count = sizeof(results) / sizeof(results[0]);
+		struct allocator allocator;
+		init_allocator(&allocator, physical_device, device);
+		int err = bench_fill(&allocator, device, queue, command_pool, &kernel,
+		1920, 1080, results, count);
+		if (!err) {
+			print_fill_results(kernel.name, results, count);
+			if (json_path && write_fill_json(json_path, kernel.name, results,
+			count))
+				fprintf(stderr, "could not write %s\n", json_path);
+		}
+		for (uint32_t i=0; i<count; i++) {
+			free(results[i].cpu.v);
+			free(results[i].gpu.v);
+		}
+		fini_allocator(&allocator);
+		vkDestroyCommandPool(device, command_pool, NULL);
+		vkDestroyDevice(device, NULL);
+		vkDestroyInstance(instance, NULL);
+		return err ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	/* Without sync_file export the CPU has to wait for rendering before the
+	 * atomic commit. The CPU fill needs neither: it is done before the
+	 * commit. */
+	int explicit_sync = !cpu_fill && sync_fd_supported(physical_device);
+	if (!explicit_sync && !cpu_fill)
+		fprintf(stderr, "sync_file semaphores not supported, "
+		"waiting on the CPU before each flip\n");
+
+/* drm code */
+	if (threaded)
+		pthread_join(display_worker, NULL);
+	int drm_fd = display.fd;
+	if (drm_fd < 0)
+		return EXIT_FAILURE;
+	/* Only the time spent waiting for the worker is on the critical path. */
+	startup_phase(&startup, "display", clock_ns(CLOCK_MONOTONIC));
+	printf("display setup took %.3f ms%s\n", display.ms,
+	threaded ? " on a worker thread" : "");
+
+	/* Every head gets an output of its own; in clone mode a head with the
+	 * same timings as an earlier one joins its output instead: they share
+	 * a flip queue and the pacer, so a 59.94 Hz and a 60 Hz head must not
+	 * be grouped. */
+	struct output outputs[max_heads];
+	memset(outputs, 0, sizeof(outputs));
+	uint32_t output_count = 0;
+	for (uint32_t i=0; i<display.head_count; i++) {
+		struct output *o = NULL;
+		for (uint32_t j=0; j<output_count && clone && !o; j++)
+			if (same_timings(&outputs[j].heads[0].mode,
+			&display.heads[i].mode))
+				o = &outputs[j];
+		if (!o) {
+			o = &outputs[output_count];
+			o->index = output_count++;
+		}
+		o->heads[o->head_count++] = display.heads[i];
+	}
+	for (uint32_t i=0; i<output_count; i++) {
+		printf("output %u: connector", i);
+		for (uint32_t j=0; j<outputs[i].head_count; j++)
+			printf(" %u", outputs[i].heads[j].connector_id);
+		printf("\n");
+	}
+
+	/* Capture copies out of the image on the GPU, which the CPU fill does
+	 * not use. */
+	if (capture_every && cpu_fill) {
+		printf("capture is not available with -c\n");
+		capture_every = 0;
+	}
+	/* The layers are composited into full redraws only. */
+	if (show_layers && (cpu_fill || damage_size)) {
+		printf("layers are not available with -c or -D\n");
+		show_layers = 0;
+	}
+	/* Client buffers replace whole frames, or are copied in by the GPU. */
+	if (client_path && (cpu_fill || damage_size)) {
+		printf("client buffers are not available with -c or -D\n");
+		client_path = NULL;
+	}
+	/* Like the layers, the triangle is only part of full redraws. */
+	if (draw && (cpu_fill || damage_size)) {
+		printf("drawing is not available with -c or -D\n");
+		draw = 0;
+	}
+	VkImageUsageFlags image_usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	if (capture_every)
+		image_usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	if (draw)
+		image_usage |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	if (cpu_fill)
+		printf("filling host-mapped linear images on the CPU (%s)\n",
+		kernel.name);
+
+	struct allocator allocator;
+	init_allocator(&allocator, physical_device, device);
+	/* The cache turns pipeline compilation into a lookup after the first
+	 * run. */
+	struct pipeline pipeline;
+	if (draw) {
+		char cache_path[64];
+		pipeline_cache_path(physical_device, cache_path, sizeof(cache_path));
+		int hit;
+		VkPipelineCache cache = load_pipeline_cache(physical_device, device,
+		cache_path, &hit);
+		if (cache == VK_NULL_HANDLE)
+			return EXIT_FAILURE;
+		uint64_t t = clock_ns(CLOCK_MONOTONIC);
+		if (create_pipeline(device, cache, VK_FORMAT_B8G8R8A8_UNORM,
+		&pipeline) < 0)
+			return EXIT_FAILURE;
+		printf("pipeline created in %.3f ms (cache %s)\n",
+		(clock_ns(CLOCK_MONOTONIC) - t) / 1e6, hit ? "hit" : "miss");
+		if (save_pipeline_cache(device, cache, cache_path) < 0)
+			fprintf(stderr, "could not write %s\n", cache_path);
+		vkDestroyPipelineCache(device, cache, NULL);
+		startup_phase(&startup, "pipeline", clock_ns(CLOCK_MONOTONIC));
+	}
+	pthread_mutex_t queue_lock;
+	pthread_mutex_init(&queue_lock, NULL);
+	int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		perror("signalfd");
+		return EXIT_FAILURE;
+	}
+	/* Only the first output is captured, and shows client buffers; frames
+	 * scanned out from a client buffer are not captured. */
+	struct capture capture;
+	struct client client = {
+		.path = client_path,
+		.fd = -1,
+		.allow_direct = !gpu_composition,
+		.can_import = foreign,
+		.accept = {.fd = -1},
+		.conn = {.fd = -1}
+	};
+	for (uint32_t k=0; k<output_count; k++) {
+		struct output *o = &outputs[k];
+		struct kms *kms = &o->heads[0];
+		uint32_t width = kms->mode.hdisplay, height = kms->mode.vdisplay;
+		o->physical_device = physical_device;
+		o->device = device;
+		o->queue = queue;
+		o->queue_lock = &queue_lock;
+		o->queue_family = queue_family;
+		o->drm_fd = drm_fd;
+		o->width = width;
+		o->height = height;
+		o->buffer_count = buffer_count;
+		o->kernel = cpu_fill ? &kernel : NULL;
+		o->pipeline = draw ? &pipeline : NULL;
+		o->explicit_sync = explicit_sync;
+		o->frame_count = frame_count;
+		o->in_fence = -1;
+		o->drm.fd = o->wake.fd = o->timer.fd = o->fence.fd = o->stop.fd = -1;
+		o->in_fence_fd = 1;
+		for (uint32_t i=0; i<o->head_count; i++)
+			o->in_fence_fd &= o->heads[i].plane_prop.in_fence_fd != 0;
+		if (explicit_sync && !o->in_fence_fd)
+			printf("output %u: no IN_FENCE_FD, committing once the render "
+			"sync_file signals\n", k);
+		o->pool = create_command_pool(device, queue_family);
+		if (o->pool == VK_NULL_HANDLE)
+			return EXIT_FAILURE;
+
+		/* Tiled and compressed layouts need every head and Vulkan to agree
+		 * on a modifier; an empty list means a plain linear image. */
+		struct modifier mods[max_modifiers];
+		uint32_t mod_count = 0;
+		if (modifiers && kms->fb_modifiers && !cpu_fill) {
+			mod_count = get_vulkan_modifiers(physical_device,
+			VK_FORMAT_B8G8R8A8_UNORM, width, height, image_usage, mods,
+			max_modifiers);
+			for (uint32_t i=0; i<o->head_count; i++)
+				mod_count = intersect_modifiers(mods, mod_count,
+				o->heads[i].plane_mods, o->heads[i].plane_mod_count);
+		}
+		if (!cpu_fill && mod_count == 0)
+			printf("output %u: no common DRM format modifier, using linear "
+			"images\n", k);
+		VkImageUsageFlags usage = image_usage;
+		VkFormatProperties format_props;
+		vkGetPhysicalDeviceFormatProperties(physical_device,
+		VK_FORMAT_B8G8R8A8_UNORM, &format_props);
+		if (draw && mod_count == 0 && !(format_props.linearTilingFeatures &
+		VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT)) {
+			printf("output %u: linear images cannot be drawn to, clearing "
+			"instead\n", k);
+			usage &= ~VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+			o->pipeline = NULL;
+		}
+
+		for (int i=0; i<buffer_count; i++)
+			if (create_buffer(&allocator, device, o->pool, drm_fd, kms,
+			width, height, DRM_FORMAT_XRGB8888, usage, mods, mod_count,
+			cpu_fill, &o->buffers[i]) < 0 || (foreign && mod_count &&
+			init_foreign_transfer(device, o->pool, queue_family,
+			&o->buffers[i]) < 0) || (o->pipeline && init_framebuffer(device,
+			&pipeline, width, height, &o->buffers[i]) < 0))
+				return EXIT_FAILURE;
+		/* The first buffer is shown by the modeset, before any frame. */
+		if (cpu_fill)
+			fill_rect(&kernel, o->buffers[0].pixels, o->buffers[0].pitch,
+			(struct drm_mode_rect){0, 0, width, height}, 0xff000000);
+		else if (clear_layer(device, queue, &o->buffers[0],
+		(VkClearColorValue){{0.0f, 0.0f, 0.0f, 1.0f}}) < 0)
+			return EXIT_FAILURE;
+		if (damage_size) {
+			o->damage_size = damage_size;
+			if (o->damage_size > width)
+				o->damage_size = width;
+			if (o->damage_size > height)
+				o->damage_size = height;
+			/* The CPU fills the damage straight into the buffers. */
+			if (!cpu_fill) {
+				if (create_tiles(&allocator, device, o->damage_size,
+				1 + buffer_count, &o->tiles) < 0)
+					return EXIT_FAILURE;
+				fill_tile(&o->tiles, 0, 0xffe5e5f9);
+			}
+			printf("output %u: damage mode: %ux%u square, FB_DAMAGE_CLIPS "
+			"%s\n", k, o->damage_size, o->damage_size,
+			kms->plane_prop.fb_damage_clips ? "supported" : "not supported");
+		}
+
+		/* Whatever no plane takes is copied into the background by the GPU,
+		 * as is everything in clone mode, where the planes of the first head
+		 * would only show on it. */
+		if (show_layers) {
+			const VkClearColorValue layer_colors[max_layers] = {
+				{{0.2f, 0.5f, 0.9f, 1.0f}}, {{1.0f, 1.0f, 1.0f, 1.0f}}
+			};
+			struct layer *l = o->layers;
+			l[0] = (struct layer){
+				.name = "overlay",
+				.width = width < 256 ? width : 256,
+				.height = height < 256 ? height : 256,
+				.plane_id = kms->overlay_id,
+				.prop = &kms->overlay_prop
+			};
+			l[1] = (struct layer){
+				.name = "cursor",
+				.width = width < kms->cursor_width ? width : kms->cursor_width,
+				.height = height < kms->cursor_height ? height :
+				kms->cursor_height,
+				.plane_id = kms->cursor_id,
+				.prop = &kms->cursor_prop
+			};
+			for (uint32_t i=0; i<max_layers; i++) {
+				struct buffer *lb = &o->layer_buffers[i];
+				if (create_buffer(&allocator, device, o->pool, drm_fd, kms,
+				l[i].width, l[i].height, DRM_FORMAT_ARGB8888,
+				VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+				VK_IMAGE_USAGE_TRANSFER_DST_BIT, NULL, 0, 0, lb) < 0 ||
+				clear_layer(device, queue, lb, layer_colors[i]) < 0)
+					return EXIT_FAILURE;
+				l[i].image = lb->image;
+				l[i].fb_id = lb->fb_id;
+				if (gpu_composition || o->head_count > 1)
+					l[i].plane_id = 0;
+			}
+			o->layer_count = max_layers;
+			assign_planes(drm_fd, kms, o->buffers[0].fb_id, l, o->layer_count);
+			for (uint32_t i=0; i<o->layer_count; i++) {
+				l[i].assigned_plane = l[i].plane_id;
+				if (l[i].plane_id)
+					printf("output %u: %s: plane %u\n", k, l[i].name,
+					l[i].plane_id);
+				else
+					printf("output %u: %s: GPU composition\n", k, l[i].name);
+				kms->overlay_used |= l[i].plane_id &&
+				l[i].plane_id == kms->overlay_id;
+				kms->cursor_used |= l[i].plane_id &&
+				l[i].plane_id == kms->cursor_id;
+			}
+		}
+
+		if (capture_every && k == 0) {
+			if (init_capture(&allocator, physical_device, device, o->pool,
+			width, height, capture_every, kms->mode.vrefresh, capture_path,
+			&capture) < 0)
+				return EXIT_FAILURE;
+			o->capture = &capture;
+			printf("capturing every %u frame(s) of output 0 to %s\n",
+			capture_every, capture_path);
+		}
+
+		/* Each output paces itself to the refresh of its first head. */
+		if (init_event_loop(&o->loop) < 0)
+			return EXIT_FAILURE;
+		int timer_fd = -1;
+		if (pace_margin >= 0) {
+			init_pacer(&o->pacer, &kms->mode, pace_margin * 1000);
+			o->flips.pacer = &o->pacer;
+			o->flips.pace_crtc_id = kms->crtc_id;
+			timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+			if (timer_fd < 0) {
+				perror("timerfd_create");
+				return EXIT_FAILURE;
+			}
+		}
+		pthread_mutex_init(&o->lock, NULL);
+		o->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (o->wake_fd < 0) {
+			perror("eventfd");
+			return EXIT_FAILURE;
+		}
+		if (add_watch(&o->loop, &o->drm, drm_fd, drm_handler, o) < 0 ||
+		add_watch(&o->loop, &o->wake, o->wake_fd, wake_handler, o) < 0 ||
+		(timer_fd >= 0 && add_watch(&o->loop, &o->timer, timer_fd,
+		timer_handler, o) < 0) ||
+		add_watch(&o->loop, &o->stop, signal_fd, signal_handler,
+		&o->loop) < 0)
+			return EXIT_FAILURE;
+
+		if (client_path && k == 0) {
+			client.listen_fd = listen_client_socket(client_path);
+			if (client.listen_fd < 0 || add_watch(&o->loop, &client.accept,
+			client.listen_fd, accept_handler, o) < 0)
+				return EXIT_FAILURE;
+			o->client = &client;
+			printf("output 0: waiting for clients on %s%s\n", client_path,
+			foreign ? "" : " (direct scanout only)");
+		}
+	}
+	if (pace_margin >= 0)
+		printf("pacing frames to finish %" PRId64 " us before vblank\n",
+		pace_margin);
+	print_allocator(&allocator);
+	startup_phase(&startup, "buffers", clock_ns(CLOCK_MONOTONIC));
+	if (modeset(drm_fd, outputs, output_count) < 0)
+		return EXIT_FAILURE;
+	startup_phase(&startup, "modeset", clock_ns(CLOCK_MONOTONIC));
+
+	/* Render into a free buffer while the previous one waits for its flip;
+	 * the flip event decides which buffer becomes free next. Rendering and
+	 * scanout are ordered by sync_files in the kernel, so the CPU only waits
+	 * for events. */
+	uint64_t wall_start = clock_ns(CLOCK_MONOTONIC);
+	for (uint32_t k=0; k<output_count; k++)
+		outputs[k].threaded = !pthread_create(&outputs[k].thread, NULL,
+		render_thread, &outputs[k]);
+	for (uint32_t k=0; k<output_count; k++) {
+		if (outputs[k].threaded)
+			pthread_join(outputs[k].thread, NULL);
+		else
+			render_thread(&outputs[k]);
+	}
+	double seconds = (clock_ns(CLOCK_MONOTONIC) - wall_start) / 1e9;
+	wait_flips(drm_fd, outputs, output_count);
+	vkDeviceWaitIdle(device);
+	if (outputs[0].flips.first_flip)
+		startup_phase(&startup, "first flip", outputs[0].flips.first_flip);
+	print_startup(&startup);
+	for (uint32_t k=0; k<output_count; k++) {
+		struct output *o = &outputs[k];
+		for (int i=0; i<buffer_count; i++) {
+			if (!o->buffers[i].timed)
+				continue;
+			double ms = get_pass_time(physical_device, device, queue_family,
+			o->buffers[i].queries, 0);
+			if (ms >= 0)
+				add_sample(&o->gpu_ms, ms);
+		}
+		if (output_count > 1)
+			printf("output %u, %u head(s):\n", k, o->head_count);
+		printf("%" PRIu64 " frames in %.3f s: %.1f frames/s\n", o->n, seconds,
+		o->n / seconds);
+		print_samples("CPU frame", &o->cpu_ms);
+		print_samples("GPU render", &o->gpu_ms);
+		if (o->damage_size)
+			printf("%.2f%% of the pixels redrawn per frame\n", o->n ? 100.0 *
+			o->damaged_pixels / o->n / o->width / o->height : 0);
+		if (o->flips.pacer)
+			printf("paced to a %.3f ms period, frame cost %.3f ms: %" PRIu64
+			" missed deadlines\n", o->pacer.period / 1e6, o->pacer.cost / 1e6,
+			o->pacer.missed);
+		if (o->client)
+			printf("client frames: %" PRIu64 " scanned out directly, %" PRIu64
+			" composited\n", client.stats.direct_frames,
+			client.stats.composited_frames);
+		for (uint32_t i=0; i<o->layer_count; i++)
+			if (o->layers[i].fallback_frames)
+				printf("%s: plane %u refused it in %" PRIu64 " frames, "
+				"composited\n", o->layers[i].name, o->layers[i].assigned_plane,
+				o->layers[i].fallback_frames);
+		if (o->flips.latency.count) {
+			qsort(o->flips.latency.v, o->flips.latency.count, sizeof(double),
+			compare_double);
+			printf("frame start to flip: %.3f ms median\n",
+			o->flips.latency.v[(o->flips.latency.count - 1) / 2]);
+		}
+	}
+	if (capture_every) {
+		if (fini_capture(&allocator, device, outputs[0].pool, &capture) < 0)
+			fprintf(stderr, "could not write %s\n", capture_path);
+		print_capture(&capture);
+	}
+	/* The results file describes the first output. */
+	struct output *first = &outputs[0];
+	double damage_fraction = first->n ? (double)first->damaged_pixels /
+	first->n / first->width / first->height : 0;
+	if (json_path && write_json(json_path, first->width, first->height,
+	buffer_count, seconds, damage_fraction, capture_every ? &capture : NULL,
+	first->flips.pacer, first->client ? &first->client->stats : NULL,
+	&startup, &first->cpu_ms, &first->gpu_ms, &first->flips.latency))
+		fprintf(stderr, "could not write %s\n", json_path);
+	if (capture_every)
+		free(capture.write_ms.v);
+
+	int err = 0;
+	for (uint32_t k=0; k<output_count; k++) {
+		struct output *o = &outputs[k];
+		free(o->cpu_ms.v);
+		free(o->gpu_ms.v);
+		free(o->flips.latency.v);
+		for (uint32_t i=0; i<o->head_count; i++)
+			err |= restore(drm_fd, &o->heads[i]) < 0;
+		if (o->client)
+			fini_client(o);
+		for (int i=0; i<buffer_count; i++)
+			destroy_buffer(&allocator, device, o->pool, drm_fd, &o->buffers[i]);
+		for (uint32_t i=0; i<o->layer_count; i++)
+			destroy_buffer(&allocator, device, o->pool, drm_fd,
+			&o->layer_buffers[i]);
+		if (o->damage_size && !cpu_fill)
+			destroy_tiles(&allocator, device, &o->tiles);
+		if (o->timer.fd >= 0)
+			close(o->timer.fd);
+		close(o->wake_fd);
+		fini_event_loop(&o->loop);
+		pthread_mutex_destroy(&o->lock);
+		vkDestroyCommandPool(device, o->pool, NULL);
+		for (uint32_t i=0; i<o->head_count; i++)
+			kms_fini(drm_fd, &o->heads[i]);
+	}
+	if (err)
+		return EXIT_FAILURE;
+	for (uint32_t k=0; k<output_count; k++)
+		err |= outputs[k].error;
+	close(signal_fd);
+	pthread_mutex_destroy(&queue_lock);
+	if (draw)
+		destroy_pipeline(device, &pipeline);
+	fini_allocator(&allocator);
+	drm_fini(drm_fd);
 
-	vkFreeMemory(device, memory, NULL);
-	vkDestroyImage(device, image, NULL);
 	vkDestroyCommandPool(device, command_pool, NULL);
 	vkDestroyDevice(device, NULL);
 	vkDestroyInstance(instance, NULL);
 
-	return EXIT_SUCCESS;
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
 }
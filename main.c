@@ -1,9 +1,30 @@
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <vulkan/vulkan.h>
 
+static PFN_vkWaitForPresentKHR vkWaitForPresent = 0;
+static PFN_vkGetImageMemoryRequirements2KHR vkGetImageRequirements2 = 0;
+static PFN_vkGetBufferMemoryRequirements2KHR vkGetBufferRequirements2 = 0;
+static PFN_vkWaitSemaphoresKHR vkWaitTimeline = 0;
+static PFN_vkQueueSubmit2KHR vkSubmit2 = 0;
+static PFN_vkGetPhysicalDeviceFeatures2KHR vkGetFeatures2 = 0;
+
+static uint64_t clock_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t now_ns() {
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
 #define maxPhysicalDeviceCount 4
 VkPhysicalDevice get_gpu(VkInstance instance) {
 	VkPhysicalDevice physicalDevices[maxPhysicalDeviceCount];
@@ -27,8 +48,8 @@ VkPhysicalDevice get_gpu(VkInstance instance) {
 #undef maxPhysicalDeviceCount
 
 #define maxDisplayCount 4
-VkDisplayPropertiesKHR get_display(VkPhysicalDevice physicalDevice) {
-	VkDisplayPropertiesKHR displayProperties[maxDisplayCount];
+uint32_t get_displays(VkPhysicalDevice physicalDevice,
+VkDisplayPropertiesKHR *displayProperties) {
 	uint32_t displayCount = maxDisplayCount;
 
 	vkGetPhysicalDeviceDisplayPropertiesKHR(physicalDevice, &displayCount, displayProperties);
@@ -41,81 +62,469 @@ VkDisplayPropertiesKHR get_display(VkPhysicalDevice physicalDevice) {
 		displayProperties[i].physicalResolution.height);
 	}
 
-	printf("Using the first display in the list\n");
-	return displayProperties[0];
+	printf("Using all %u displays in the list\n", displayCount);
+	return displayCount;
+}
+
+/* A mode asked for with -R. 0 means any: the native resolution, at its
+ * highest refresh rate. */
+struct mode_request {
+	uint32_t width, height;
+	uint32_t refresh; // mHz, like VkDisplayModeParametersKHR
+};
+
+int parse_mode_request(const char *s, struct mode_request *r) {
+	double hz = 0;
+	if (sscanf(s, "%ux%u@%lf", &r->width, &r->height, &hz) < 2 || hz < 0)
+		return -1;
+	r->refresh = hz * 1000 + 0.5;
+	return 0;
+}
+
+static int has_mode_size(const VkDisplayModePropertiesKHR *modes,
+uint32_t count, VkExtent2D size) {
+	for (uint32_t i=0; i<count; i++)
+		if (modes[i].parameters.visibleRegion.width == size.width &&
+		modes[i].parameters.visibleRegion.height == size.height)
+			return 1;
+	return 0;
+}
+
+/* The requested resolution if the display has it, else the native one, else
+ * the largest listed; then the refresh rate closest to the requested one, or
+ * the highest. VK_KHR_display does not tell interlaced modes apart. */
+uint32_t choose_display_mode(const VkDisplayModePropertiesKHR *modes,
+uint32_t count, VkExtent2D native, const struct mode_request *want) {
+	VkExtent2D size = native;
+	if (!has_mode_size(modes, count, size)) {
+		size = modes[0].parameters.visibleRegion;
+		for (uint32_t i=1; i<count; i++) {
+			VkExtent2D e = modes[i].parameters.visibleRegion;
+			if ((uint64_t)e.width * e.height > (uint64_t)size.width * size.height)
+				size = e;
+		}
+	}
+	if (want->width) {
+		VkExtent2D wanted = {want->width, want->height};
+		if (has_mode_size(modes, count, wanted))
+			size = wanted;
+		else
+			printf("No %ux%u mode, using %ux%u\n", want->width, want->height,
+			size.width, size.height);
+	}
+
+	uint32_t best = count;
+	for (uint32_t i=0; i<count; i++) {
+		VkExtent2D e = modes[i].parameters.visibleRegion;
+		if (e.width != size.width || e.height != size.height)
+			continue;
+		uint32_t r = modes[i].parameters.refreshRate;
+		if (best == count) {
+			best = i;
+			continue;
+		}
+		uint32_t b = modes[best].parameters.refreshRate;
+		if (want->refresh ? abs((int)(r - want->refresh)) <
+		abs((int)(b - want->refresh)) : r > b)
+			best = i;
+	}
+	return best;
+}
+
+/* Each display scans out from a plane of its own: the first one not in used
+ * that can show disp. Returns maxDisplayPlanes if none is left. */
+#define maxDisplayPlanes 16
+static uint32_t find_display_plane(VkPhysicalDevice pdev, VkDisplayKHR disp,
+uint32_t used, uint32_t *stackIndex) {
+	VkDisplayPlanePropertiesKHR planes[maxDisplayPlanes];
+	uint32_t planeCount = maxDisplayPlanes;
+	vkGetPhysicalDeviceDisplayPlanePropertiesKHR(pdev, &planeCount, planes);
+	for (uint32_t i=0; i<planeCount; i++) {
+		if (used & (1u << i))
+			continue;
+		VkDisplayKHR displays[maxDisplayCount];
+		uint32_t count = maxDisplayCount;
+		vkGetDisplayPlaneSupportedDisplaysKHR(pdev, i, &count, displays);
+		for (uint32_t j=0; j<count; j++) {
+			if (displays[j] == disp) {
+				*stackIndex = planes[i].currentStackIndex;
+				return i;
+			}
+		}
+	}
+	return maxDisplayPlanes;
 }
-#undef maxDisplayCount
 
+/* Marks the plane it takes in usedPlanes. */
+#define maxDisplayModes 64
 VkSurfaceKHR create_surface(VkInstance inst, VkPhysicalDevice pdev,
-VkDisplayKHR disp) {
-	uint32_t count = 1;
-	VkDisplayModePropertiesKHR props;
-	vkGetDisplayModePropertiesKHR(pdev, disp, &count, &props);
+const VkDisplayPropertiesKHR *disp, const struct mode_request *want,
+uint32_t *usedPlanes) {
+	VkDisplayModePropertiesKHR modes[maxDisplayModes];
+	uint32_t count = maxDisplayModes;
+	vkGetDisplayModePropertiesKHR(pdev, disp->display, &count, modes);
+	if (!count)
+		return VK_NULL_HANDLE;
+	uint32_t stackIndex;
+	uint32_t plane = find_display_plane(pdev, disp->display, *usedPlanes,
+	&stackIndex);
+	if (plane == maxDisplayPlanes) {
+		printf("No plane left for %s\n", disp->displayName);
+		return VK_NULL_HANDLE;
+	}
+
+	uint32_t mode = choose_display_mode(modes, count, disp->physicalResolution,
+	want);
+	printf("Using mode %ux%u@%.3f (%u modes) on plane %u\n",
+	modes[mode].parameters.visibleRegion.width,
+	modes[mode].parameters.visibleRegion.height,
+	modes[mode].parameters.refreshRate / 1e3, count, plane);
 
 	VkDisplaySurfaceCreateInfoKHR info = {
 		.sType = VK_STRUCTURE_TYPE_DISPLAY_SURFACE_CREATE_INFO_KHR,
-		.displayMode = props.displayMode,
+		.displayMode = modes[mode].displayMode,
+		.planeIndex = plane,
+		.planeStackIndex = stackIndex,
 		.transform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
 		.alphaMode = VK_DISPLAY_PLANE_ALPHA_OPAQUE_BIT_KHR,
-		.imageExtent = props.parameters.visibleRegion
+		.imageExtent = modes[mode].parameters.visibleRegion
 	};
 
 	VkSurfaceKHR surf;
 	if(vkCreateDisplayPlaneSurfaceKHR(inst, &info, NULL, &surf))
 		return VK_NULL_HANDLE;
+	*usedPlanes |= 1u << plane;
+	return surf;
+}
+#undef maxDisplayModes
+#undef maxDisplayPlanes
+
+int has_instance_extension(const char *name) {
+	uint32_t count = 0;
+	vkEnumerateInstanceExtensionProperties(NULL, &count, NULL);
+	VkExtensionProperties *props = malloc(count * sizeof(*props));
+	vkEnumerateInstanceExtensionProperties(NULL, &count, props);
+	int found = 0;
+	for (uint32_t i=0; i<count && !found; i++)
+		found = !strcmp(props[i].extensionName, name);
+	free(props);
+	return found;
+}
+
+int has_device_extension(VkPhysicalDevice pdev, const char *name) {
+	uint32_t count = 0;
+	vkEnumerateDeviceExtensionProperties(pdev, NULL, &count, NULL);
+	VkExtensionProperties *props = malloc(count * sizeof(*props));
+	vkEnumerateDeviceExtensionProperties(pdev, NULL, &count, props);
+	int found = 0;
+	for (uint32_t i=0; i<count && !found; i++)
+		found = !strcmp(props[i].extensionName, name);
+	free(props);
+	return found;
+}
+
+VkSurfaceKHR create_headless_surface(VkInstance inst) {
+	PFN_vkCreateHeadlessSurfaceEXT vkCreateHeadlessSurface =
+	(PFN_vkCreateHeadlessSurfaceEXT) vkGetInstanceProcAddr(inst,
+	"vkCreateHeadlessSurfaceEXT");
+	VkHeadlessSurfaceCreateInfoEXT info = {
+		.sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT
+	};
+	VkSurfaceKHR surf;
+	if (!vkCreateHeadlessSurface ||
+	vkCreateHeadlessSurface(inst, &info, NULL, &surf)) {
+		fprintf(stderr, "ERROR: create_headless_surface() failed.\n");
+		return VK_NULL_HANDLE;
+	}
 	return surf;
 }
 
-VkDevice create_logical_device(VkPhysicalDevice pdev) {
+/* Display enumeration and surface creation do not need the VkDevice, so they
+ * run on a worker thread while the device is created. Every display gets a
+ * surface; a headless run has a single one. */
+struct surface_setup {
+	VkInstance instance;
+	VkPhysicalDevice gpu;
+	int headless;
+	struct mode_request mode;
+	VkSurfaceKHR surfs[maxDisplayCount];
+	uint32_t surfCount;
+	double ms; // time the worker spent
+};
+
+static void *surface_thread(void *arg) {
+	struct surface_setup *s = arg;
+	uint64_t start = now_ns();
+	s->surfCount = 0;
+	if (s->headless) {
+		s->surfs[0] = create_headless_surface(s->instance);
+		s->surfCount = s->surfs[0] != VK_NULL_HANDLE;
+	} else {
+		VkDisplayPropertiesKHR displays[maxDisplayCount];
+		uint32_t displayCount = get_displays(s->gpu, displays);
+		uint32_t usedPlanes = 0;
+		for (uint32_t i=0; i<displayCount; i++) {
+			VkSurfaceKHR surf = create_surface(s->instance, s->gpu, &displays[i],
+			&s->mode, &usedPlanes);
+			if (surf == VK_NULL_HANDLE)
+				printf("Skipping display %u: no surface\n", i);
+			else
+				s->surfs[s->surfCount++] = surf;
+		}
+	}
+	s->ms = (now_ns() - start) / 1e6;
+	return NULL;
+}
+
+/* Copies go to a transfer-only family (a DMA engine) when there is one,
+ * else to an async compute family, else to the graphics queue itself. */
+#define maxQueueFamilies 16
+
+/* A timeline semaphore counts the submissions on one queue: submission v
+ * signals v, so whatever it used is free once the counter reaches v. The
+ * last value seen is cached to skip the wait when it is already known to
+ * have passed. */
+struct timeline {
+	VkSemaphore sem;
+	uint64_t value; // last value submitted
+	uint64_t completed; // last value known to have been reached
+};
+
+/* Each display's render thread has its own copy with its own timelines; the
+ * VkQueues are shared, so every submit and present holds lock. */
+struct queues {
+	uint32_t graphicsFamily, transferFamily;
+	VkQueue graphics, transfer; // the same queue if the families match
+	pthread_mutex_t *lock;
+	struct timeline graphicsTimeline, transferTimeline;
+};
+
+int find_queue_families(VkPhysicalDevice pdev, struct queues *q) {
+	VkQueueFamilyProperties props[maxQueueFamilies];
+	uint32_t count = maxQueueFamilies;
+	vkGetPhysicalDeviceQueueFamilyProperties(pdev, &count, props);
+
+	uint32_t compute = UINT32_MAX;
+	q->graphicsFamily = q->transferFamily = UINT32_MAX;
+	for (uint32_t i=0; i<count; i++) {
+		VkQueueFlags flags = props[i].queueFlags;
+		if (props[i].queueCount == 0)
+			continue;
+		if (flags & VK_QUEUE_GRAPHICS_BIT) {
+			if (q->graphicsFamily == UINT32_MAX)
+				q->graphicsFamily = i;
+		} else if (flags & VK_QUEUE_COMPUTE_BIT) {
+			if (compute == UINT32_MAX)
+				compute = i;
+		} else if (flags & VK_QUEUE_TRANSFER_BIT) {
+			if (q->transferFamily == UINT32_MAX)
+				q->transferFamily = i;
+		}
+	}
+	if (q->graphicsFamily == UINT32_MAX) {
+		fprintf(stderr, "ERROR: find_queue_families() failed.\n");
+		return -1;
+	}
+	if (q->transferFamily == UINT32_MAX)
+		q->transferFamily = compute != UINT32_MAX ? compute : q->graphicsFamily;
+	return 0;
+}
+
+/* presentWait also enables VK_KHR_present_id, which it depends on. Timeline
+ * semaphores and synchronization2 are always required: the extensions can be
+ * listed without the features, so both are checked. */
+VkDevice create_logical_device(VkPhysicalDevice pdev, const struct queues *q,
+int swapchain, int presentWait, int incrementalPresent) {
+	if (!has_device_extension(pdev, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) ||
+	!has_device_extension(pdev, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME)) {
+		fprintf(stderr, "ERROR: VK_KHR_timeline_semaphore and "
+		"VK_KHR_synchronization2 are required.\n");
+		return VK_NULL_HANDLE;
+	}
+	VkPhysicalDeviceSynchronization2Features sync2Supported = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES
+	};
+	VkPhysicalDeviceTimelineSemaphoreFeatures timelineSupported = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+		.pNext = &sync2Supported
+	};
+	VkPhysicalDeviceFeatures2 supported = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+		.pNext = &timelineSupported
+	};
+	if (vkGetFeatures2)
+		vkGetFeatures2(pdev, &supported);
+	if (!timelineSupported.timelineSemaphore ||
+	!sync2Supported.synchronization2) {
+		fprintf(stderr, "ERROR: the timelineSemaphore and synchronization2 "
+		"features are required.\n");
+		return VK_NULL_HANDLE;
+	}
+
 	VkDevice dev;
 	VkDeviceCreateInfo info = {0};
 	info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
 
-	VkDeviceQueueCreateInfo info_ = {0};
-	info_.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-	info_.queueFamilyIndex = 0; // ASSUMPTION: has GRAPHICS flag
-	info_.queueCount = 1;
 	float priority = 1.0f;
-	info_.pQueuePriorities = &priority;
+	VkDeviceQueueCreateInfo queueInfos[2] = {0};
+	for (int i=0; i<2; i++) {
+		queueInfos[i].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+		queueInfos[i].queueCount = 1;
+		queueInfos[i].pQueuePriorities = &priority;
+	}
+	queueInfos[0].queueFamilyIndex = q->graphicsFamily;
+	queueInfos[1].queueFamilyIndex = q->transferFamily;
 
-	info.queueCreateInfoCount = 1;
-	info.pQueueCreateInfos = &info_;
-	const char *extensions[] = {
-		VK_KHR_SWAPCHAIN_EXTENSION_NAME
-	};
-	info.enabledExtensionCount = sizeof(extensions)/sizeof(char*);
+	info.queueCreateInfoCount = q->transferFamily != q->graphicsFamily ? 2 : 1;
+	info.pQueueCreateInfos = queueInfos;
+	const char *extensions[10];
+	uint32_t extensionCount = 0;
+	extensions[extensionCount++] = VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME;
+	extensions[extensionCount++] = VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME;
+	if (swapchain)
+		extensions[extensionCount++] = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+	int dedicated = has_device_extension(pdev,
+	VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME) &&
+	has_device_extension(pdev, VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME);
+	if (dedicated) {
+		extensions[extensionCount++] =
+		VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME;
+		extensions[extensionCount++] =
+		VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME;
+	}
+	if (presentWait) {
+		extensions[extensionCount++] = VK_KHR_PRESENT_ID_EXTENSION_NAME;
+		extensions[extensionCount++] = VK_KHR_PRESENT_WAIT_EXTENSION_NAME;
+	}
+	if (incrementalPresent)
+		extensions[extensionCount++] =
+		VK_KHR_INCREMENTAL_PRESENT_EXTENSION_NAME;
+	info.enabledExtensionCount = extensionCount;
 	info.ppEnabledExtensionNames = extensions;
 
+	VkPhysicalDevicePresentWaitFeaturesKHR waitFeatures = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+		.presentWait = VK_TRUE
+	};
+	VkPhysicalDevicePresentIdFeaturesKHR idFeatures = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+		.pNext = &waitFeatures,
+		.presentId = VK_TRUE
+	};
+	VkPhysicalDeviceSynchronization2Features sync2Features = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES,
+		.pNext = presentWait ? &idFeatures : NULL,
+		.synchronization2 = VK_TRUE
+	};
+	VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+		.pNext = &sync2Features,
+		.timelineSemaphore = VK_TRUE
+	};
+	info.pNext = &timelineFeatures;
+
 	if (vkCreateDevice(pdev, &info, NULL, &dev) != VK_SUCCESS)
 		return VK_NULL_HANDLE;
+
+	if (presentWait)
+		vkWaitForPresent = (PFN_vkWaitForPresentKHR) vkGetDeviceProcAddr(dev,
+		"vkWaitForPresentKHR");
+	if (dedicated) {
+		vkGetImageRequirements2 = (PFN_vkGetImageMemoryRequirements2KHR)
+		vkGetDeviceProcAddr(dev, "vkGetImageMemoryRequirements2KHR");
+		vkGetBufferRequirements2 = (PFN_vkGetBufferMemoryRequirements2KHR)
+		vkGetDeviceProcAddr(dev, "vkGetBufferMemoryRequirements2KHR");
+	}
+	vkWaitTimeline = (PFN_vkWaitSemaphoresKHR) vkGetDeviceProcAddr(dev,
+	"vkWaitSemaphoresKHR");
+	vkSubmit2 = (PFN_vkQueueSubmit2KHR) vkGetDeviceProcAddr(dev,
+	"vkQueueSubmit2KHR");
 	return dev;
 }
 
-VkSwapchainKHR create_swapchain(VkPhysicalDevice pdev, VkDevice dev, VkSurfaceKHR surf) {
-	VkSurfaceCapabilitiesKHR caps;
-	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(pdev, surf, &caps);
+static const struct {
+	const char *name;
+	VkPresentModeKHR mode;
+} presentModes[] = {
+	{"immediate", VK_PRESENT_MODE_IMMEDIATE_KHR},
+	{"mailbox", VK_PRESENT_MODE_MAILBOX_KHR},
+	{"fifo", VK_PRESENT_MODE_FIFO_KHR},
+	{"fifo_relaxed", VK_PRESENT_MODE_FIFO_RELAXED_KHR}
+};
+#define presentModeCount (sizeof(presentModes)/sizeof(presentModes[0]))
+
+const char *present_mode_name(VkPresentModeKHR mode) {
+	for (int i=0; i<presentModeCount; i++)
+		if (presentModes[i].mode == mode)
+			return presentModes[i].name;
+	return "unknown";
+}
+
+int parse_present_mode(const char *name, VkPresentModeKHR *mode) {
+	for (int i=0; i<presentModeCount; i++) {
+		if (!strcmp(presentModes[i].name, name)) {
+			*mode = presentModes[i].mode;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* FIFO is the only mode every implementation has to support. */
+VkPresentModeKHR choose_present_mode(VkPhysicalDevice pdev, VkSurfaceKHR surf,
+VkPresentModeKHR wanted) {
 	uint32_t count = 64;
-	VkPresentModeKHR props[64];
-	vkGetPhysicalDeviceSurfacePresentModesKHR(pdev, surf, &count, props);
+	VkPresentModeKHR modes[64];
+	vkGetPhysicalDeviceSurfacePresentModesKHR(pdev, surf, &count, modes);
+
+	printf("Supported present modes:\n");
+	int found = 0;
 	for (int i=0; i<count; i++) {
-		printf("%d %d\n", caps.currentExtent.width,
-		caps.currentExtent.height);
+		printf("  %s\n", present_mode_name(modes[i]));
+		found |= modes[i] == wanted;
+	}
+	if (!found) {
+		printf("Present mode %s not supported, falling back to fifo\n",
+		present_mode_name(wanted));
+		return VK_PRESENT_MODE_FIFO_KHR;
+	}
+	return wanted;
+}
+
+#define maxSwapchainImages 8
+
+/* extent is only used when the surface leaves the size to the swapchain, as
+ * headless surfaces do. The driver may create more images than asked for;
+ * init_swapchain_images() checks that they fit. */
+VkSwapchainKHR create_swapchain(VkPhysicalDevice pdev, VkDevice dev,
+VkSurfaceKHR surf, VkPresentModeKHR presentMode, VkExtent2D *extent) {
+	VkSurfaceCapabilitiesKHR caps;
+	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(pdev, surf, &caps);
+	if (caps.currentExtent.width != UINT32_MAX)
+		*extent = caps.currentExtent;
+	uint32_t minImageCount = caps.minImageCount > 3 ? caps.minImageCount : 3;
+	if (caps.maxImageCount && minImageCount > caps.maxImageCount)
+		minImageCount = caps.maxImageCount;
+	if (minImageCount > maxSwapchainImages) {
+		fprintf(stderr, "ERROR: the surface needs %u swapchain images, at most "
+		"%u are supported.\n", minImageCount, maxSwapchainImages);
+		return VK_NULL_HANDLE;
 	}
 
 	VkSwapchainCreateInfoKHR info = {
 		.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
 		.surface = surf,
-		.minImageCount = 3,
+		.minImageCount = minImageCount,
 		.imageFormat = VK_FORMAT_B8G8R8A8_UNORM,
 		.imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR,
-		.imageExtent = caps.currentExtent,
+		.imageExtent = *extent,
 		.imageArrayLayers = 1,
 		.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
 		VK_IMAGE_USAGE_TRANSFER_DST_BIT,
 		.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
 		.preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
 		.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-		.presentMode = VK_PRESENT_MODE_FIFO_KHR,
+		.presentMode = presentMode,
 		.clipped = VK_TRUE,
 		.oldSwapchain = VK_NULL_HANDLE,
 	};
@@ -125,6 +534,2119 @@ VkSwapchainKHR create_swapchain(VkPhysicalDevice pdev, VkDevice dev, VkSurfaceKH
 	return swp;
 }
 
+#define maxFramesInFlight 3
+
+/* Per frame in flight: reused once the graphics timeline has reached the
+ * value of the frame that last used the slot. */
+struct frame {
+	uint32_t slot; // index in the frames array
+	VkCommandPool pool; // reset as a whole once the value has been reached
+	VkCommandBuffer cmdbuf;
+	VkSemaphore acquired;
+	uint64_t value; // on the graphics timeline, 0 if never submitted
+	VkQueryPool queries; // VK_NULL_HANDLE if timestamps are unsupported
+	int queriesPending;
+};
+
+enum measure {
+	MEASURE_NONE,
+	MEASURE_PRESENT_WAIT, // submit to present, via VK_KHR_present_wait
+	MEASURE_TIMELINE // submit to GPU completion, when present_wait is missing
+};
+
+/* One value per frame, in ms. */
+struct samples {
+	double *v;
+	uint64_t count, capacity;
+};
+
+struct summary {
+	double min, mean, p50, p90, p99, max;
+};
+
+/* GPU passes bracketed by timestamps: queries 2*pass and 2*pass+1. */
+enum pass {
+	PASS_RENDER,
+	passCount
+};
+static const char *passNames[passCount] = {"render"};
+
+struct gpu_timing {
+	double period; // ns per tick
+	uint64_t mask; // of the valid timestamp bits, 0 if unsupported
+	struct samples passes[passCount];
+};
+
+/* Returns UINT32_MAX if no allowed memory type has all the properties. */
+uint32_t findMemoryType(const VkPhysicalDeviceMemoryProperties *memProperties,
+uint32_t typeFilter, VkMemoryPropertyFlags properties) {
+	for (uint32_t i = 0; i < memProperties->memoryTypeCount; i++)
+		if ((typeFilter & (1 << i)) && (memProperties->memoryTypes[i].propertyFlags & properties) == properties)
+			return i;
+
+	return UINT32_MAX;
+}
+
+/* Images and buffers are placed in large blocks of one memory type, so the
+ * number of vkAllocateMemory calls stays far below maxMemoryAllocationCount.
+ * Resources that need their own VkDeviceMemory get a dedicated allocation;
+ * that is only known with VK_KHR_dedicated_allocation. Each directory builds
+ * on its own, so 01-drm/main.c has a copy of this allocator, extended with
+ * dma-buf export: fixes here belong there too. */
+#define blockSize (64ull << 20)
+
+struct mem_range {
+	VkDeviceSize offset, size;
+	int linear;
+};
+
+struct mem_block {
+	VkDeviceMemory memory;
+	uint32_t type;
+	VkDeviceSize size;
+	/* Sorted by offset. */
+	struct mem_range *ranges;
+	uint32_t count, capacity;
+	void *mapped; // the whole block, NULL until map_memory() needs it
+};
+
+struct allocator {
+	VkDevice dev;
+	VkPhysicalDeviceMemoryProperties props;
+	/* Linear and non-linear resources must not share a page this big. */
+	VkDeviceSize granularity;
+	struct mem_block *blocks;
+	uint32_t blockCount;
+	uint32_t dedicatedCount;
+	VkDeviceSize used, dedicatedBytes;
+};
+
+struct allocation {
+	VkDeviceMemory memory;
+	VkDeviceSize offset, size;
+	int dedicated;
+};
+
+void init_allocator(struct allocator *a, VkPhysicalDevice pdev, VkDevice dev) {
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(pdev, &props);
+	*a = (struct allocator){
+		.dev = dev,
+		.granularity = props.limits.bufferImageGranularity
+	};
+	vkGetPhysicalDeviceMemoryProperties(pdev, &a->props);
+}
+
+static VkDeviceSize align_up(VkDeviceSize v, VkDeviceSize alignment) {
+	return alignment > 1 ? (v + alignment - 1) / alignment * alignment : v;
+}
+
+/* First fit. Returns the index of the range to insert before, or -1. */
+static int64_t find_space(const struct allocator *a, const struct mem_block *b,
+const VkMemoryRequirements *req, int linear, VkDeviceSize *offset) {
+	for (uint32_t i=0; i<=b->count; i++) {
+		const struct mem_range *prev = i > 0 ? &b->ranges[i-1] : NULL;
+		const struct mem_range *next = i < b->count ? &b->ranges[i] : NULL;
+		VkDeviceSize start = prev ? prev->offset + prev->size : 0;
+		if (prev && prev->linear != linear)
+			start = align_up(start, a->granularity);
+		start = align_up(start, req->alignment);
+		VkDeviceSize end = start + req->size;
+		if (next && next->linear != linear)
+			end = align_up(end, a->granularity);
+		if (end <= (next ? next->offset : b->size)) {
+			*offset = start;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int insert_range(struct mem_block *b, uint32_t i, struct mem_range r) {
+	if (b->count == b->capacity) {
+		uint32_t capacity = b->capacity ? 2 * b->capacity : 16;
+		struct mem_range *ranges = realloc(b->ranges,
+		capacity * sizeof(*ranges));
+		if (!ranges)
+			return -1;
+		b->ranges = ranges;
+		b->capacity = capacity;
+	}
+	memmove(&b->ranges[i+1], &b->ranges[i], (b->count - i) * sizeof(r));
+	b->ranges[i] = r;
+	b->count++;
+	return 0;
+}
+
+static int allocate_dedicated(struct allocator *a, const VkMemoryRequirements *req,
+uint32_t type, VkImage img, VkBuffer buf, struct allocation *out) {
+	VkMemoryDedicatedAllocateInfo dedicatedInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+		.image = img,
+		.buffer = buf
+	};
+	VkMemoryAllocateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.pNext = vkGetImageRequirements2 ? &dedicatedInfo : NULL,
+		.allocationSize = req->size,
+		.memoryTypeIndex = type
+	};
+	if (vkAllocateMemory(a->dev, &info, NULL, &out->memory)) {
+		fprintf(stderr, "ERROR: allocate_dedicated() failed.\n");
+		return -1;
+	}
+	out->offset = 0;
+	out->size = req->size;
+	out->dedicated = 1;
+	a->dedicatedCount++;
+	a->dedicatedBytes += req->size;
+	return 0;
+}
+
+static int allocate_range(struct allocator *a, const VkMemoryRequirements *req,
+uint32_t type, int linear, struct allocation *out) {
+	struct mem_block *b = NULL;
+	VkDeviceSize offset = 0;
+	int64_t i = -1;
+	for (uint32_t j=0; j<a->blockCount && i<0; j++) {
+		if (a->blocks[j].type != type)
+			continue;
+		b = &a->blocks[j];
+		i = find_space(a, b, req, linear, &offset);
+	}
+	if (i < 0) {
+		struct mem_block *blocks = realloc(a->blocks,
+		(a->blockCount + 1) * sizeof(*blocks));
+		if (!blocks)
+			return -1;
+		a->blocks = blocks;
+		b = &a->blocks[a->blockCount];
+		*b = (struct mem_block){.type = type, .size = blockSize};
+		VkMemoryAllocateInfo info = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			.allocationSize = b->size,
+			.memoryTypeIndex = type
+		};
+		if (vkAllocateMemory(a->dev, &info, NULL, &b->memory)) {
+			fprintf(stderr, "ERROR: allocate_range() failed.\n");
+			return -1;
+		}
+		a->blockCount++;
+		i = 0;
+	}
+	struct mem_range r = {offset, req->size, linear};
+	if (insert_range(b, i, r) < 0)
+		return -1;
+	out->memory = b->memory;
+	out->offset = offset;
+	out->size = req->size;
+	out->dedicated = 0;
+	a->used += req->size;
+	return 0;
+}
+
+/* Dedicated allocations are used when the driver requires one or when the
+ * resource would not fit in a block. */
+static int allocate(struct allocator *a, const VkMemoryRequirements *req,
+int requiresDedicated, VkMemoryPropertyFlags flags, int linear, VkImage img,
+VkBuffer buf, struct allocation *out) {
+	uint32_t type = findMemoryType(&a->props, req->memoryTypeBits, flags);
+	if (type == UINT32_MAX) {
+		fprintf(stderr, "no memory type with properties 0x%x in 0x%x\n",
+		flags, req->memoryTypeBits);
+		return -1;
+	}
+	if (requiresDedicated || req->size > blockSize)
+		return allocate_dedicated(a, req, type, img, buf, out);
+	return allocate_range(a, req, type, linear, out);
+}
+
+/* Allocates and binds memory for the image. linear is false for optimally
+ * tiled images. */
+int allocate_image_memory(struct allocator *a, VkImage img,
+VkMemoryPropertyFlags flags, int linear, struct allocation *out) {
+	VkImageMemoryRequirementsInfo2 info = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2,
+		.image = img
+	};
+	VkMemoryDedicatedRequirements dedicated = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS
+	};
+	VkMemoryRequirements2 req = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+		.pNext = &dedicated
+	};
+	if (vkGetImageRequirements2)
+		vkGetImageRequirements2(a->dev, &info, &req);
+	else
+		vkGetImageMemoryRequirements(a->dev, img, &req.memoryRequirements);
+	if (allocate(a, &req.memoryRequirements,
+	dedicated.requiresDedicatedAllocation, flags, linear, img, VK_NULL_HANDLE,
+	out) < 0)
+		return -1;
+	if (vkBindImageMemory(a->dev, img, out->memory, out->offset)) {
+		fprintf(stderr, "vkBindImageMemory failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+int allocate_buffer_memory(struct allocator *a, VkBuffer buf,
+VkMemoryPropertyFlags flags, struct allocation *out) {
+	VkBufferMemoryRequirementsInfo2 info = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2,
+		.buffer = buf
+	};
+	VkMemoryDedicatedRequirements dedicated = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS
+	};
+	VkMemoryRequirements2 req = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+		.pNext = &dedicated
+	};
+	if (vkGetBufferRequirements2)
+		vkGetBufferRequirements2(a->dev, &info, &req);
+	else
+		vkGetBufferMemoryRequirements(a->dev, buf, &req.memoryRequirements);
+	if (allocate(a, &req.memoryRequirements,
+	dedicated.requiresDedicatedAllocation, flags, 1, VK_NULL_HANDLE, buf,
+	out) < 0)
+		return -1;
+	if (vkBindBufferMemory(a->dev, buf, out->memory, out->offset)) {
+		fprintf(stderr, "vkBindBufferMemory failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* A VkDeviceMemory can only be mapped once, so host-visible allocations
+ * share their block's mapping. Freeing the memory also unmaps it. */
+void *map_memory(struct allocator *a, const struct allocation *m) {
+	void *data = NULL;
+	if (m->dedicated) {
+		if (vkMapMemory(a->dev, m->memory, 0, m->size, 0, &data))
+			return NULL;
+		return data;
+	}
+	for (uint32_t j=0; j<a->blockCount; j++) {
+		struct mem_block *b = &a->blocks[j];
+		if (b->memory != m->memory)
+			continue;
+		if (!b->mapped && vkMapMemory(a->dev, b->memory, 0, VK_WHOLE_SIZE, 0,
+		&b->mapped))
+			return NULL;
+		return (char *)b->mapped + m->offset;
+	}
+	return NULL;
+}
+
+/* Empty blocks are given back to the driver. */
+void free_memory(struct allocator *a, struct allocation *m) {
+	if (m->dedicated) {
+		vkFreeMemory(a->dev, m->memory, NULL);
+		a->dedicatedCount--;
+		a->dedicatedBytes -= m->size;
+		return;
+	}
+	for (uint32_t j=0; j<a->blockCount; j++) {
+		struct mem_block *b = &a->blocks[j];
+		if (b->memory != m->memory)
+			continue;
+		for (uint32_t i=0; i<b->count; i++) {
+			if (b->ranges[i].offset != m->offset)
+				continue;
+			memmove(&b->ranges[i], &b->ranges[i+1],
+			(b->count - i - 1) * sizeof(b->ranges[i]));
+			b->count--;
+			a->used -= m->size;
+			break;
+		}
+		if (b->count == 0) {
+			vkFreeMemory(a->dev, b->memory, NULL);
+			free(b->ranges);
+			a->blocks[j] = a->blocks[--a->blockCount];
+		}
+		return;
+	}
+}
+
+void print_allocator(const struct allocator *a) {
+	printf("memory: %u block(s) of %llu MiB, %" PRIu64 " KiB used; "
+	"%u dedicated, %" PRIu64 " KiB\n", a->blockCount, blockSize >> 20,
+	(uint64_t)a->used >> 10, a->dedicatedCount,
+	(uint64_t)a->dedicatedBytes >> 10);
+}
+
+/* All allocations must have been freed. */
+void fini_allocator(struct allocator *a) {
+	for (uint32_t j=0; j<a->blockCount; j++) {
+		vkFreeMemory(a->dev, a->blocks[j].memory, NULL);
+		free(a->blocks[j].ranges);
+	}
+	free(a->blocks);
+}
+
+/* Damage: what changed since an image was last rendered into, or since the
+ * previous present. */
+#define maxDamageRects 8
+
+struct damage {
+	uint32_t count;
+	VkRect2D rects[maxDamageRects];
+};
+
+static VkRect2D rect_union(VkRect2D a, VkRect2D b) {
+	int32_t x1 = a.offset.x < b.offset.x ? a.offset.x : b.offset.x;
+	int32_t y1 = a.offset.y < b.offset.y ? a.offset.y : b.offset.y;
+	int32_t ax2 = a.offset.x + a.extent.width, bx2 = b.offset.x + b.extent.width;
+	int32_t ay2 = a.offset.y + a.extent.height, by2 = b.offset.y + b.extent.height;
+	int32_t x2 = ax2 > bx2 ? ax2 : bx2, y2 = ay2 > by2 ? ay2 : by2;
+	return (VkRect2D){{x1, y1}, {x2 - x1, y2 - y1}};
+}
+
+/* Once full, the rectangles are merged into their bounding box. */
+void add_damage(struct damage *d, VkRect2D r) {
+	if (r.extent.width == 0 || r.extent.height == 0)
+		return;
+	if (d->count == maxDamageRects) {
+		for (uint32_t i=1; i<d->count; i++)
+			d->rects[0] = rect_union(d->rects[0], d->rects[i]);
+		d->count = 1;
+	}
+	d->rects[d->count++] = r;
+}
+
+void merge_damage(struct damage *dst, const struct damage *src) {
+	for (uint32_t i=0; i<src->count; i++)
+		add_damage(dst, src->rects[i]);
+}
+
+/* Overlapping rectangles are counted twice, so clamp to the image. */
+uint64_t damage_area(const struct damage *d, VkExtent2D extent) {
+	uint64_t area = 0;
+	for (uint32_t i=0; i<d->count; i++)
+		area += (uint64_t)d->rects[i].extent.width * d->rects[i].extent.height;
+	uint64_t pixels = (uint64_t)extent.width * extent.height;
+	return area < pixels ? area : pixels;
+}
+
+int damage_is_full(const struct damage *d, VkExtent2D extent) {
+	for (uint32_t i=0; i<d->count; i++)
+		if (d->rects[i].offset.x <= 0 && d->rects[i].offset.y <= 0 &&
+		d->rects[i].offset.x + d->rects[i].extent.width >= extent.width &&
+		d->rects[i].offset.y + d->rects[i].extent.height >= extent.height)
+			return 1;
+	return 0;
+}
+
+/* Damage mode draws a square crossing a static background. */
+VkRect2D square_rect(uint64_t n, uint32_t size, VkExtent2D extent) {
+	int32_t x = (n * 4) % (extent.width - size + 1);
+	int32_t y = (extent.height - size) / 2;
+	return (VkRect2D){{x, y}, {size, size}};
+}
+
+/* Outside a render pass clears cannot be limited to a rectangle, so the
+ * background of a partial update is copied from a solid tile. The square of
+ * each frame in flight has its own tile, written by the CPU. */
+struct tiles {
+	VkBuffer buffer;
+	struct allocation memory;
+	uint32_t *data;
+	uint32_t size; // pixels per side
+};
+
+int create_tiles(struct allocator *allocator, VkDevice dev, uint32_t size,
+uint32_t count, struct tiles *t) {
+	t->size = size;
+	VkBufferCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = (VkDeviceSize)size * size * 4 * count,
+		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE
+	};
+	if (vkCreateBuffer(dev, &info, NULL, &t->buffer)) {
+		fprintf(stderr, "ERROR: create_tiles() failed.\n");
+		return -1;
+	}
+	if (allocate_buffer_memory(allocator, t->buffer,
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	&t->memory) < 0 || !(t->data = map_memory(allocator, &t->memory))) {
+		fprintf(stderr, "ERROR: create_tiles() failed.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* pixel is B8G8R8A8 read as a little-endian uint32_t. */
+void fill_tile(struct tiles *t, uint32_t tile, uint32_t pixel) {
+	uint32_t *p = t->data + (size_t)tile * t->size * t->size;
+	for (uint32_t i=0; i<t->size * t->size; i++)
+		p[i] = pixel;
+}
+
+void destroy_tiles(struct allocator *allocator, VkDevice dev, struct tiles *t) {
+	vkDestroyBuffer(dev, t->buffer, NULL);
+	free_memory(allocator, &t->memory);
+}
+
+/* Copies covering r with the tile. Returns UINT32_MAX if more than max are
+ * needed. */
+static uint32_t tile_regions(const struct tiles *t, uint32_t tile, VkRect2D r,
+VkBufferImageCopy *regions, uint32_t max) {
+	uint32_t count = 0;
+	for (uint32_t y=0; y<r.extent.height; y+=t->size) {
+		for (uint32_t x=0; x<r.extent.width; x+=t->size) {
+			if (count == max)
+				return UINT32_MAX;
+			uint32_t w = r.extent.width - x < t->size ? r.extent.width - x : t->size;
+			uint32_t h = r.extent.height - y < t->size ? r.extent.height - y : t->size;
+			regions[count++] = (VkBufferImageCopy){
+				.bufferOffset = (VkDeviceSize)tile * t->size * t->size * 4,
+				.bufferRowLength = t->size,
+				.bufferImageHeight = t->size,
+				.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
+				.imageOffset = {r.offset.x + x, r.offset.y + y, 0},
+				.imageExtent = {w, h, 1}
+			};
+		}
+	}
+	return count;
+}
+
+/* Per swapchain image. The render-done semaphore is per image rather than per
+ * frame because the presentation engine may still hold it after the frame's
+ * timeline value has been reached. It stays binary since WSI cannot wait on
+ * timelines. Without a swapchain (swp == VK_NULL_HANDLE) the images
+ * are an offscreen ring owned by us and nothing is acquired or presented. */
+struct swapchain {
+	VkSwapchainKHR swp;
+	uint32_t imageCount;
+	VkImage imgs[maxSwapchainImages];
+	struct allocation mems[maxSwapchainImages]; // offscreen only
+	VkSemaphore rendered[maxSwapchainImages];
+	uint64_t imageValues[maxSwapchainImages]; // of the frame last rendered to it
+	VkExtent2D extent;
+	const struct pipeline *pipeline; // NULL to only clear
+	struct recorder *recorder; // NULL to record the draw on the calling thread
+	VkImageView views[maxSwapchainImages]; // only with a pipeline
+	VkFramebuffer framebuffers[maxSwapchainImages];
+	/* Offscreen readback, VK_NULL_HANDLE without -r. One slice per image. */
+	VkBuffer readback;
+	struct allocation readbackMem;
+	const uint8_t *readbackData;
+	VkDeviceSize readbackSlice;
+	VkCommandBuffer copyCmdbufs[maxSwapchainImages]; // on the transfer queue
+	uint64_t copyValues[maxSwapchainImages]; // on the transfer timeline
+	uint64_t readbackFrames[maxSwapchainImages]; // frame + 1, 0 if none
+	uint64_t readbackCount, readbackErrors;
+	/* Damage mode (damageSize != 0) only redraws what each image missed. */
+	uint32_t damageSize;
+	struct tiles tiles;
+	struct damage pending[maxSwapchainImages];
+	int incrementalPresent; // VkPresentRegionsKHR is chained to presents
+	uint64_t damagedPixels;
+	enum measure measure;
+	struct latency_waiter *waiter; // NULL with MEASURE_NONE
+	pthread_mutex_t lock; // swp, shared by the render thread and the waiter
+	struct samples latency; // written by the waiter until it is stopped
+	struct gpu_timing timing;
+};
+
+void add_sample(struct samples *s, double v) {
+	if (s->count == s->capacity) {
+		s->capacity = s->capacity ? 2 * s->capacity : 256;
+		s->v = realloc(s->v, s->capacity * sizeof(double));
+	}
+	s->v[s->count++] = v;
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Sorts the samples in place. */
+struct summary summarize(struct samples *s) {
+	struct summary sum = {0};
+	if (s->count == 0)
+		return sum;
+	qsort(s->v, s->count, sizeof(double), compare_double);
+	for (uint64_t i=0; i<s->count; i++)
+		sum.mean += s->v[i];
+	sum.mean /= s->count;
+	sum.min = s->v[0];
+	sum.p50 = s->v[(s->count - 1) * 50 / 100];
+	sum.p90 = s->v[(s->count - 1) * 90 / 100];
+	sum.p99 = s->v[(s->count - 1) * 99 / 100];
+	sum.max = s->v[s->count - 1];
+	return sum;
+}
+
+void free_samples(struct samples *s) {
+	free(s->v);
+	*s = (struct samples){0};
+}
+
+void init_gpu_timing(VkPhysicalDevice pdev, uint32_t family,
+struct gpu_timing *t) {
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(pdev, &props);
+	uint32_t count = maxQueueFamilies;
+	VkQueueFamilyProperties families[maxQueueFamilies];
+	vkGetPhysicalDeviceQueueFamilyProperties(pdev, &count, families);
+
+	*t = (struct gpu_timing){.period = props.limits.timestampPeriod};
+	uint32_t bits = family < count ? families[family].timestampValidBits : 0;
+	if (bits == 0 || t->period == 0) {
+		printf("Timestamps not supported on queue family %u\n", family);
+		return;
+	}
+	t->mask = bits >= 64 ? UINT64_MAX : (1ull << bits) - 1;
+}
+
+VkQueryPool create_query_pool(VkDevice dev) {
+	VkQueryPoolCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+		.queryType = VK_QUERY_TYPE_TIMESTAMP,
+		.queryCount = 2 * passCount
+	};
+	VkQueryPool pool;
+	if (vkCreateQueryPool(dev, &info, NULL, &pool)) {
+		fprintf(stderr, "ERROR: create_query_pool() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return pool;
+}
+
+/* Must only be called once the frame that wrote the queries has completed. */
+void collect_timestamps(VkDevice dev, struct gpu_timing *t, struct frame *f) {
+	uint64_t ts[2 * passCount];
+	f->queriesPending = 0;
+	if (vkGetQueryPoolResults(dev, f->queries, 0, 2 * passCount, sizeof(ts),
+	ts, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+		return;
+
+	for (int i=0; i<passCount; i++) {
+		uint64_t ticks = (ts[2*i+1] - ts[2*i]) & t->mask;
+		add_sample(&t->passes[i], ticks * t->period / 1e6);
+	}
+}
+
+void print_gpu_timing(struct gpu_timing *t) {
+	for (int i=0; i<passCount; i++) {
+		struct samples *p = &t->passes[i];
+		if (p->count == 0)
+			continue;
+		struct summary sum = summarize(p);
+		printf("GPU %s over %" PRIu64 " frames: min %.3f ms, mean %.3f ms, p99 %.3f ms\n",
+		passNames[i], p->count, sum.min, sum.mean, sum.p99);
+	}
+}
+
+/* Bring-up phases, each timed from the end of the previous one. */
+#define maxStartupPhases 8
+
+struct startup {
+	uint64_t last;
+	uint32_t count;
+	const char *names[maxStartupPhases];
+	double ms[maxStartupPhases];
+};
+
+void startup_phase(struct startup *s, const char *name) {
+	uint64_t t = now_ns();
+	if (s->count < maxStartupPhases) {
+		s->names[s->count] = name;
+		s->ms[s->count++] = (t - s->last) / 1e6;
+	}
+	s->last = t;
+}
+
+void print_startup(const struct startup *s) {
+	double total = 0;
+	printf("startup:");
+	for (uint32_t i=0; i<s->count; i++) {
+		printf(" %s %.3f ms,", s->names[i], s->ms[i]);
+		total += s->ms[i];
+	}
+	printf(" total %.3f ms\n", total);
+}
+
+/* What a benchmark run measured on the CPU side. */
+struct run {
+	const char *scenario;
+	VkExtent2D extent;
+	const char *presentMode; // NULL without presentation
+	uint32_t framesInFlight;
+	uint32_t recordThreads; // 0 when recording on the main thread
+	uint32_t damageSize; // 0 when every frame is redrawn in full
+	double damageFraction; // share of the pixels redrawn per frame
+	uint64_t frames;
+	double seconds;
+	/* CPU time spent building and submitting a frame, by all threads (every
+	 * display's included) when recording is spread over workers. */
+	struct samples cpu;
+	struct samples interval; // wall time between frame starts
+	struct startup startup;
+};
+
+static void write_json_samples(FILE *f, const char *name, struct samples *s,
+const char *sep) {
+	if (s->count == 0) {
+		fprintf(f, "\t\"%s\": null%s\n", name, sep);
+		return;
+	}
+	struct summary sum = summarize(s);
+	fprintf(f, "\t\"%s\": {\"count\": %" PRIu64 ", \"min\": %.6f, "
+	"\"mean\": %.6f, \"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, "
+	"\"max\": %.6f}%s\n", name, s->count, sum.min, sum.mean, sum.p50,
+	sum.p90, sum.p99, sum.max, sep);
+}
+
+/* All times in the output are in ms. */
+int write_json(const char *path, struct run *r, struct swapchain *sc) {
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror("fopen");
+		return -1;
+	}
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"scenario\": \"%s\",\n", r->scenario);
+	fprintf(f, "\t\"width\": %u,\n\t\"height\": %u,\n", r->extent.width,
+	r->extent.height);
+	if (r->presentMode)
+		fprintf(f, "\t\"present_mode\": \"%s\",\n", r->presentMode);
+	else
+		fprintf(f, "\t\"present_mode\": null,\n");
+	fprintf(f, "\t\"frames_in_flight\": %u,\n", r->framesInFlight);
+	fprintf(f, "\t\"record_threads\": %u,\n", r->recordThreads);
+	if (r->damageSize)
+		fprintf(f, "\t\"damage_fraction\": %.6f,\n", r->damageFraction);
+	else
+		fprintf(f, "\t\"damage_fraction\": null,\n");
+	fprintf(f, "\t\"frames\": %" PRIu64 ",\n", r->frames);
+	fprintf(f, "\t\"seconds\": %.6f,\n", r->seconds);
+	fprintf(f, "\t\"fps\": %.3f,\n", r->frames / r->seconds);
+	fprintf(f, "\t\"startup_ms\": {");
+	for (uint32_t i=0; i<r->startup.count; i++)
+		fprintf(f, "%s\"%s\": %.3f", i ? ", " : "", r->startup.names[i],
+		r->startup.ms[i]);
+	fprintf(f, "},\n");
+	write_json_samples(f, "cpu_ms", &r->cpu, ",");
+	write_json_samples(f, "frame_interval_ms", &r->interval, ",");
+	write_json_samples(f, "gpu_ms", &sc->timing.passes[PASS_RENDER], ",");
+	write_json_samples(f, "latency_ms", &sc->latency, "");
+	fprintf(f, "}\n");
+	return fclose(f);
+}
+
+void fini_gpu_timing(struct gpu_timing *t) {
+	for (int i=0; i<passCount; i++)
+		free_samples(&t->passes[i]);
+}
+
+VkCommandPool create_command_pool(VkDevice dev, uint32_t family,
+VkCommandPoolCreateFlags flags) {
+	VkCommandPoolCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.flags = flags,
+		.queueFamilyIndex = family
+	};
+	VkCommandPool pool;
+	if (vkCreateCommandPool(dev, &info, NULL, &pool)) {
+		fprintf(stderr, "ERROR: create_command_pool() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return pool;
+}
+
+VkSemaphore create_semaphore(VkDevice dev) {
+	VkSemaphoreCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
+	};
+	VkSemaphore sem;
+	if (vkCreateSemaphore(dev, &info, NULL, &sem)) {
+		fprintf(stderr, "ERROR: create_semaphore() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return sem;
+}
+
+int create_timeline(VkDevice dev, struct timeline *t) {
+	VkSemaphoreTypeCreateInfo typeInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+		.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+		.initialValue = 0
+	};
+	VkSemaphoreCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		.pNext = &typeInfo
+	};
+	t->value = t->completed = 0;
+	if (vkCreateSemaphore(dev, &info, NULL, &t->sem)) {
+		fprintf(stderr, "ERROR: create_timeline() failed.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns without a call into the driver when value is already known to
+ * have been reached, which is the common case for anything but the oldest
+ * frame in flight. */
+int wait_timeline(VkDevice dev, struct timeline *t, uint64_t value) {
+	if (value <= t->completed)
+		return 0;
+	VkSemaphoreWaitInfo info = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 1,
+		.pSemaphores = &t->sem,
+		.pValues = &value
+	};
+	if (vkWaitTimeline(dev, &info, UINT64_MAX)) {
+		fprintf(stderr, "ERROR: wait_timeline() failed.\n");
+		return -1;
+	}
+	t->completed = value;
+	return 0;
+}
+
+/* Command buffers are only ever reset through their frame's pool. */
+int create_frames(VkDevice dev, uint32_t family, struct frame *frames,
+uint32_t n, int timestamps) {
+	for (uint32_t i=0; i<n; i++) {
+		frames[i].slot = i;
+		frames[i].pool = create_command_pool(dev, family,
+		VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+		if (frames[i].pool == VK_NULL_HANDLE)
+			return -1;
+		VkCommandBufferAllocateInfo allocInfo = {
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+			.commandPool = frames[i].pool,
+			.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			.commandBufferCount = 1
+		};
+		if (vkAllocateCommandBuffers(dev, &allocInfo, &frames[i].cmdbuf)) {
+			fprintf(stderr, "ERROR: create_frames() failed.\n");
+			return -1;
+		}
+		frames[i].value = 0;
+		frames[i].queriesPending = 0;
+		frames[i].queries = VK_NULL_HANDLE;
+		if (timestamps) {
+			frames[i].queries = create_query_pool(dev);
+			if (frames[i].queries == VK_NULL_HANDLE)
+				return -1;
+		}
+		frames[i].acquired = create_semaphore(dev);
+		if (frames[i].acquired == VK_NULL_HANDLE)
+			return -1;
+	}
+	return 0;
+}
+
+void destroy_frames(VkDevice dev, struct frame *frames, uint32_t n) {
+	for (uint32_t i=0; i<n; i++) {
+		vkDestroyCommandPool(dev, frames[i].pool, NULL);
+		vkDestroyQueryPool(dev, frames[i].queries, NULL);
+		vkDestroySemaphore(dev, frames[i].acquired, NULL);
+	}
+}
+
+/* Fullscreen triangle, assembled by hand since the build has no shader
+ * compiler. Equivalent GLSL:
+ *
+ *	void main() {
+ *		vec2 uv = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+ *		gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);
+ *	}
+ */
+static const uint32_t fullscreenVert[] = {
+	0x07230203, 0x00010000, 0x00000000, 0x0000001c, 0x00000000, 0x00020011,
+	0x00000001, 0x0003000e, 0x00000000, 0x00000001, 0x0007000f, 0x00000000,
+	0x00000001, 0x6e69616d, 0x00000000, 0x00000002, 0x00000003, 0x00040047,
+	0x00000002, 0x0000000b, 0x0000002a, 0x00040047, 0x00000003, 0x0000000b,
+	0x00000000, 0x00020013, 0x00000004, 0x00030021, 0x00000005, 0x00000004,
+	0x00040015, 0x00000006, 0x00000020, 0x00000001, 0x00030016, 0x00000007,
+	0x00000020, 0x00040017, 0x00000008, 0x00000007, 0x00000004, 0x00040020,
+	0x00000009, 0x00000001, 0x00000006, 0x00040020, 0x0000000a, 0x00000003,
+	0x00000008, 0x0004003b, 0x00000009, 0x00000002, 0x00000001, 0x0004003b,
+	0x0000000a, 0x00000003, 0x00000003, 0x0004002b, 0x00000006, 0x0000000b,
+	0x00000001, 0x0004002b, 0x00000006, 0x0000000c, 0x00000002, 0x0004002b,
+	0x00000007, 0x0000000d, 0x00000000, 0x0004002b, 0x00000007, 0x0000000e,
+	0x3f800000, 0x0004002b, 0x00000007, 0x0000000f, 0x40000000, 0x00050036,
+	0x00000004, 0x00000001, 0x00000000, 0x00000005, 0x000200f8, 0x00000010,
+	0x0004003d, 0x00000006, 0x00000011, 0x00000002, 0x000500c4, 0x00000006,
+	0x00000012, 0x00000011, 0x0000000b, 0x000500c7, 0x00000006, 0x00000013,
+	0x00000012, 0x0000000c, 0x000500c7, 0x00000006, 0x00000014, 0x00000011,
+	0x0000000c, 0x0004006f, 0x00000007, 0x00000015, 0x00000013, 0x0004006f,
+	0x00000007, 0x00000016, 0x00000014, 0x00050085, 0x00000007, 0x00000017,
+	0x00000015, 0x0000000f, 0x00050085, 0x00000007, 0x00000018, 0x00000016,
+	0x0000000f, 0x00050083, 0x00000007, 0x00000019, 0x00000017, 0x0000000e,
+	0x00050083, 0x00000007, 0x0000001a, 0x00000018, 0x0000000e, 0x00070050,
+	0x00000008, 0x0000001b, 0x00000019, 0x0000001a, 0x0000000d, 0x0000000e,
+	0x0003003e, 0x00000003, 0x0000001b, 0x000100fd, 0x00010038
+};
+
+/*	layout(push_constant) uniform Push { vec4 color; } pc;
+ *	layout(location = 0) out vec4 outColor;
+ *	void main() { outColor = pc.color; }
+ */
+static const uint32_t fullscreenFrag[] = {
+	0x07230203, 0x00010000, 0x00000000, 0x00000011, 0x00000000, 0x00020011,
+	0x00000001, 0x0003000e, 0x00000000, 0x00000001, 0x0006000f, 0x00000004,
+	0x00000001, 0x6e69616d, 0x00000000, 0x00000002, 0x00030010, 0x00000001,
+	0x00000007, 0x00040047, 0x00000002, 0x0000001e, 0x00000000, 0x00050048,
+	0x00000008, 0x00000000, 0x00000023, 0x00000000, 0x00030047, 0x00000008,
+	0x00000002, 0x00020013, 0x00000003, 0x00030021, 0x00000004, 0x00000003,
+	0x00030016, 0x00000005, 0x00000020, 0x00040017, 0x00000006, 0x00000005,
+	0x00000004, 0x00040015, 0x00000007, 0x00000020, 0x00000001, 0x0003001e,
+	0x00000008, 0x00000006, 0x00040020, 0x00000009, 0x00000009, 0x00000008,
+	0x0004003b, 0x00000009, 0x0000000a, 0x00000009, 0x00040020, 0x0000000b,
+	0x00000009, 0x00000006, 0x00040020, 0x0000000c, 0x00000003, 0x00000006,
+	0x0004003b, 0x0000000c, 0x00000002, 0x00000003, 0x0004002b, 0x00000007,
+	0x0000000d, 0x00000000, 0x00050036, 0x00000003, 0x00000001, 0x00000000,
+	0x00000004, 0x000200f8, 0x0000000e, 0x00050041, 0x0000000b, 0x0000000f,
+	0x0000000a, 0x0000000d, 0x0004003d, 0x00000006, 0x00000010, 0x0000000f,
+	0x0003003e, 0x00000002, 0x00000010, 0x000100fd, 0x00010038
+};
+
+struct pipeline {
+	VkRenderPass renderPass;
+	/* Compatible with renderPass, but keeps the contents that transfer
+	 * commands left in TRANSFER_DST_OPTIMAL: used for partial updates. */
+	VkRenderPass loadPass;
+	VkPipelineLayout layout;
+	VkPipeline pipeline;
+};
+
+/* The pass clears the image, so its previous contents never matter, unless
+ * load is set: then it keeps what the transfer commands before it wrote. */
+VkRenderPass create_render_pass(VkDevice dev, VkFormat format,
+VkImageLayout finalLayout, int load) {
+	VkAttachmentDescription attachment = {
+		.format = format,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.loadOp = load ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_CLEAR,
+		.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+		.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+		.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+		.initialLayout = load ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL :
+		VK_IMAGE_LAYOUT_UNDEFINED,
+		.finalLayout = finalLayout
+	};
+	VkAttachmentReference ref = {0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+	VkSubpassDescription subpass = {
+		.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+		.colorAttachmentCount = 1,
+		.pColorAttachments = &ref
+	};
+	// Waits for the acquire semaphore (or the copies) before the transition
+	VkSubpassDependency dependency = {
+		.srcSubpass = VK_SUBPASS_EXTERNAL,
+		.dstSubpass = 0,
+		.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		.srcAccessMask = 0,
+		.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+	};
+	if (load) {
+		dependency.srcStageMask |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+		dependency.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		dependency.dstAccessMask |= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
+	}
+	VkRenderPassCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+		.attachmentCount = 1,
+		.pAttachments = &attachment,
+		.subpassCount = 1,
+		.pSubpasses = &subpass,
+		.dependencyCount = 1,
+		.pDependencies = &dependency
+	};
+	VkRenderPass renderPass;
+	if (vkCreateRenderPass(dev, &info, NULL, &renderPass)) {
+		fprintf(stderr, "ERROR: create_render_pass() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return renderPass;
+}
+
+VkShaderModule create_shader_module(VkDevice dev, const uint32_t *code,
+size_t size) {
+	VkShaderModuleCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = size,
+		.pCode = code
+	};
+	VkShaderModule module;
+	if (vkCreateShaderModule(dev, &info, NULL, &module)) {
+		fprintf(stderr, "ERROR: create_shader_module() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return module;
+}
+
+/* The pipeline cache file is named after pipelineCacheUUID, so a driver
+ * update that invalidates the binaries starts a new file. */
+void pipeline_cache_path(VkPhysicalDevice pdev, char *path, size_t size) {
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(pdev, &props);
+	int n = snprintf(path, size, "pipeline-cache-");
+	for (int i=0; i<VK_UUID_SIZE && n < (int)size; i++)
+		n += snprintf(path + n, size - n, "%02x", props.pipelineCacheUUID[i]);
+	if (n < (int)size)
+		snprintf(path + n, size - n, ".bin");
+}
+
+/* Only data written by this exact device and driver is handed to Vulkan;
+ * anything else starts an empty cache. */
+static int valid_cache_header(VkPhysicalDevice pdev, const uint8_t *data,
+size_t size) {
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(pdev, &props);
+	uint32_t header[4];
+	if (size < sizeof(header) + VK_UUID_SIZE)
+		return 0;
+	memcpy(header, data, sizeof(header));
+	return header[0] >= sizeof(header) + VK_UUID_SIZE &&
+	header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+	header[2] == props.vendorID && header[3] == props.deviceID &&
+	!memcmp(data + sizeof(header), props.pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+VkPipelineCache load_pipeline_cache(VkPhysicalDevice pdev, VkDevice dev,
+const char *path, int *hit) {
+	void *data = NULL;
+	size_t size = 0;
+	FILE *f = fopen(path, "rb");
+	if (f) {
+		if (!fseek(f, 0, SEEK_END) && (long)(size = ftell(f)) > 0 &&
+		!fseek(f, 0, SEEK_SET) && (data = malloc(size)) &&
+		fread(data, 1, size, f) != size) {
+			free(data);
+			data = NULL;
+		}
+		fclose(f);
+	}
+	*hit = data && valid_cache_header(pdev, data, size);
+	VkPipelineCacheCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+		.initialDataSize = *hit ? size : 0,
+		.pInitialData = *hit ? data : NULL
+	};
+	VkPipelineCache cache;
+	VkResult res = vkCreatePipelineCache(dev, &info, NULL, &cache);
+	free(data);
+	if (res) {
+		fprintf(stderr, "ERROR: load_pipeline_cache() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return cache;
+}
+
+/* Writes a temporary file first so a crash never leaves a truncated cache. */
+int save_pipeline_cache(VkDevice dev, VkPipelineCache cache, const char *path) {
+	size_t size = 0;
+	if (vkGetPipelineCacheData(dev, cache, &size, NULL))
+		return -1;
+	void *data = malloc(size);
+	if (!data || vkGetPipelineCacheData(dev, cache, &size, data)) {
+		free(data);
+		return -1;
+	}
+	char tmp[256];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(tmp, "wb");
+	int ok = f && fwrite(data, 1, size, f) == size;
+	if (f)
+		ok &= !fclose(f);
+	free(data);
+	if (!ok || rename(tmp, path)) {
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Viewport and scissor are dynamic so the pipeline does not depend on the
+ * image size. */
+int create_pipeline(VkDevice dev, VkPipelineCache cache, VkFormat format,
+VkImageLayout finalLayout, struct pipeline *p) {
+	p->renderPass = create_render_pass(dev, format, finalLayout, 0);
+	p->loadPass = create_render_pass(dev, format, finalLayout, 1);
+	if (p->renderPass == VK_NULL_HANDLE || p->loadPass == VK_NULL_HANDLE)
+		return -1;
+
+	VkPushConstantRange range = {VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+	4 * sizeof(float)};
+	VkPipelineLayoutCreateInfo layoutInfo = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+		.pushConstantRangeCount = 1,
+		.pPushConstantRanges = &range
+	};
+	if (vkCreatePipelineLayout(dev, &layoutInfo, NULL, &p->layout)) {
+		fprintf(stderr, "ERROR: create_pipeline() failed.\n");
+		return -1;
+	}
+
+	VkShaderModule vert = create_shader_module(dev, fullscreenVert,
+	sizeof(fullscreenVert));
+	VkShaderModule frag = create_shader_module(dev, fullscreenFrag,
+	sizeof(fullscreenFrag));
+	if (vert == VK_NULL_HANDLE || frag == VK_NULL_HANDLE)
+		return -1;
+	VkPipelineShaderStageCreateInfo stages[] = {
+		{
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_VERTEX_BIT,
+			.module = vert,
+			.pName = "main"
+		}, {
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+			.module = frag,
+			.pName = "main"
+		}
+	};
+	VkPipelineVertexInputStateCreateInfo vertexInput = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO
+	};
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+		.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST
+	};
+	VkPipelineViewportStateCreateInfo viewport = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+		.viewportCount = 1,
+		.scissorCount = 1
+	};
+	VkPipelineRasterizationStateCreateInfo rasterization = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+		.polygonMode = VK_POLYGON_MODE_FILL,
+		.cullMode = VK_CULL_MODE_NONE,
+		.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
+		.lineWidth = 1.0f
+	};
+	VkPipelineMultisampleStateCreateInfo multisample = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+		.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT
+	};
+	VkPipelineColorBlendAttachmentState blendAttachment = {
+		.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+		VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT
+	};
+	VkPipelineColorBlendStateCreateInfo blend = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+		.attachmentCount = 1,
+		.pAttachments = &blendAttachment
+	};
+	VkDynamicState dynamicStates[] = {
+		VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR
+	};
+	VkPipelineDynamicStateCreateInfo dynamic = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+		.dynamicStateCount = 2,
+		.pDynamicStates = dynamicStates
+	};
+	VkGraphicsPipelineCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+		.stageCount = 2,
+		.pStages = stages,
+		.pVertexInputState = &vertexInput,
+		.pInputAssemblyState = &inputAssembly,
+		.pViewportState = &viewport,
+		.pRasterizationState = &rasterization,
+		.pMultisampleState = &multisample,
+		.pColorBlendState = &blend,
+		.pDynamicState = &dynamic,
+		.layout = p->layout,
+		.renderPass = p->renderPass,
+		.subpass = 0
+	};
+	VkResult res = vkCreateGraphicsPipelines(dev, cache, 1, &info, NULL,
+	&p->pipeline);
+	vkDestroyShaderModule(dev, vert, NULL);
+	vkDestroyShaderModule(dev, frag, NULL);
+	if (res) {
+		fprintf(stderr, "ERROR: create_pipeline() failed.\n");
+		return -1;
+	}
+	return 0;
+}
+
+void destroy_pipeline(VkDevice dev, struct pipeline *p) {
+	vkDestroyPipeline(dev, p->pipeline, NULL);
+	vkDestroyPipelineLayout(dev, p->layout, NULL);
+	vkDestroyRenderPass(dev, p->loadPass, NULL);
+	vkDestroyRenderPass(dev, p->renderPass, NULL);
+}
+
+static int init_image_resources(VkDevice dev, struct swapchain *sc) {
+	for (uint32_t i=0; i<sc->imageCount; i++) {
+		sc->rendered[i] = create_semaphore(dev);
+		if (sc->rendered[i] == VK_NULL_HANDLE)
+			return -1;
+		sc->imageValues[i] = 0;
+	}
+	return 0;
+}
+
+int init_swapchain_images(VkDevice dev, struct swapchain *sc) {
+	if (vkGetSwapchainImagesKHR(dev, sc->swp, &sc->imageCount, NULL)) {
+		fprintf(stderr, "ERROR: init_swapchain_images() failed.\n");
+		return -1;
+	}
+	if (sc->imageCount > maxSwapchainImages) {
+		fprintf(stderr, "ERROR: the swapchain has %u images, at most %u are "
+		"supported.\n", sc->imageCount, maxSwapchainImages);
+		return -1;
+	}
+	if (vkGetSwapchainImagesKHR(dev, sc->swp, &sc->imageCount, sc->imgs)) {
+		fprintf(stderr, "ERROR: init_swapchain_images() failed.\n");
+		return -1;
+	}
+	return init_image_resources(dev, sc);
+}
+
+VkImage create_image(VkDevice dev, VkExtent2D extent) {
+	VkImageCreateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.imageType = VK_IMAGE_TYPE_2D,
+		.format = VK_FORMAT_B8G8R8A8_UNORM,
+		.extent = {extent.width, extent.height, 1},
+		.mipLevels = 1,
+		.arrayLayers = 1,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.tiling = VK_IMAGE_TILING_OPTIMAL,
+		.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+	};
+	VkImage img;
+	if (vkCreateImage(dev, &info, NULL, &img)) {
+		fprintf(stderr, "ERROR: create_image() failed.\n");
+		return VK_NULL_HANDLE;
+	}
+	return img;
+}
+
+/* Stand-in for a swapchain when there is no surface to present to. */
+int init_offscreen_images(struct allocator *allocator, VkDevice dev,
+struct swapchain *sc, VkExtent2D extent, uint32_t count) {
+	sc->swp = VK_NULL_HANDLE;
+	sc->imageCount = count;
+	for (uint32_t i=0; i<count; i++) {
+		sc->imgs[i] = create_image(dev, extent);
+		if (sc->imgs[i] == VK_NULL_HANDLE)
+			return -1;
+		if (allocate_image_memory(allocator, sc->imgs[i],
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, &sc->mems[i]) < 0) {
+			fprintf(stderr, "ERROR: init_offscreen_images() failed.\n");
+			return -1;
+		}
+	}
+	return init_image_resources(dev, sc);
+}
+
+/* Queue family ownership transfer of an image that keeps its layout. The
+ * same barrier is recorded twice: as the release on the source queue and as
+ * the acquire on the destination queue. */
+static void record_ownership(VkCommandBuffer cmdbuf, VkImage img,
+VkImageLayout layout, uint32_t srcFamily, uint32_t dstFamily,
+VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = srcAccess,
+		.dstAccessMask = dstAccess,
+		.oldLayout = layout,
+		.newLayout = layout,
+		.srcQueueFamilyIndex = srcFamily,
+		.dstQueueFamilyIndex = dstFamily,
+		.image = img,
+		.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}
+	};
+	vkCmdPipelineBarrier(cmdbuf, srcStage, dstStage, 0, 0, NULL, 0, NULL, 1,
+	&barrier);
+}
+
+/* Offscreen images are copied into one host-visible buffer by the transfer
+ * queue, which acquires each image from the graphics queue. Nothing is
+ * released back: the next frame discards the contents anyway. The copies
+ * never change, so they are recorded once. */
+int init_readback(struct allocator *allocator, VkDevice dev, VkCommandPool pool,
+const struct queues *q, struct swapchain *sc) {
+	sc->readbackSlice = (VkDeviceSize)sc->extent.width * sc->extent.height * 4;
+	VkBufferCreateInfo bufferInfo = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = sc->readbackSlice * sc->imageCount,
+		.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE
+	};
+	if (vkCreateBuffer(dev, &bufferInfo, NULL, &sc->readback)) {
+		fprintf(stderr, "ERROR: init_readback() failed.\n");
+		return -1;
+	}
+	if (allocate_buffer_memory(allocator, sc->readback,
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	&sc->readbackMem) < 0 ||
+	!(sc->readbackData = map_memory(allocator, &sc->readbackMem))) {
+		fprintf(stderr, "ERROR: init_readback() failed.\n");
+		return -1;
+	}
+
+	VkCommandBufferAllocateInfo info = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		.commandPool = pool,
+		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+		.commandBufferCount = sc->imageCount
+	};
+	if (vkAllocateCommandBuffers(dev, &info, sc->copyCmdbufs)) {
+		fprintf(stderr, "ERROR: init_readback() failed.\n");
+		return -1;
+	}
+	for (uint32_t i=0; i<sc->imageCount; i++) {
+		sc->readbackFrames[i] = 0;
+		sc->copyValues[i] = 0;
+		VkCommandBuffer cmdbuf = sc->copyCmdbufs[i];
+		VkCommandBufferBeginInfo beginInfo = {
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO
+		};
+		vkBeginCommandBuffer(cmdbuf, &beginInfo);
+		if (q->transferFamily != q->graphicsFamily)
+			record_ownership(cmdbuf, sc->imgs[i],
+			VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, q->graphicsFamily,
+			q->transferFamily, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+		VkBufferImageCopy region = {
+			.bufferOffset = i * sc->readbackSlice,
+			.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1},
+			.imageExtent = {sc->extent.width, sc->extent.height, 1}
+		};
+		vkCmdCopyImageToBuffer(cmdbuf, sc->imgs[i],
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, sc->readback, 1, &region);
+		VkBufferMemoryBarrier barrier = {
+			.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.buffer = sc->readback,
+			.offset = region.bufferOffset,
+			.size = sc->readbackSlice
+		};
+		vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 1, &barrier, 0, NULL);
+		if (vkEndCommandBuffer(cmdbuf)) {
+			fprintf(stderr, "ERROR: init_readback() failed.\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Called once the transfer timeline has reached the image's copy value.
+ * Frame n is cleared to blue n % 256 in B8G8R8A8, so the first byte tells
+ * whether the copy saw the finished frame. */
+void check_readback(struct swapchain *sc, uint32_t index) {
+	uint64_t frame = sc->readbackFrames[index];
+	if (frame == 0)
+		return;
+	int expected = (frame - 1) % 256;
+	int blue = sc->readbackData[index * sc->readbackSlice];
+	// In damage mode the first pixel is background, not the frame colour
+	if (!sc->damageSize && (blue - expected > 1 || expected - blue > 1))
+		sc->readbackErrors++;
+	sc->readbackCount++;
+	sc->readbackFrames[index] = 0;
+}
+
+void fini_readback(struct allocator *allocator, VkDevice dev,
+VkCommandPool pool, struct swapchain *sc) {
+	vkFreeCommandBuffers(dev, pool, sc->imageCount, sc->copyCmdbufs);
+	vkDestroyBuffer(dev, sc->readback, NULL);
+	free_memory(allocator, &sc->readbackMem);
+}
+
+/* Views and framebuffers for drawing with sc->pipeline. */
+int init_framebuffers(VkDevice dev, struct swapchain *sc) {
+	for (uint32_t i=0; i<sc->imageCount; i++) {
+		VkImageViewCreateInfo viewInfo = {
+			.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+			.image = sc->imgs[i],
+			.viewType = VK_IMAGE_VIEW_TYPE_2D,
+			.format = VK_FORMAT_B8G8R8A8_UNORM,
+			.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}
+		};
+		if (vkCreateImageView(dev, &viewInfo, NULL, &sc->views[i])) {
+			fprintf(stderr, "ERROR: init_framebuffers() failed.\n");
+			return -1;
+		}
+		VkFramebufferCreateInfo info = {
+			.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+			.renderPass = sc->pipeline->renderPass,
+			.attachmentCount = 1,
+			.pAttachments = &sc->views[i],
+			.width = sc->extent.width,
+			.height = sc->extent.height,
+			.layers = 1
+		};
+		if (vkCreateFramebuffer(dev, &info, NULL, &sc->framebuffers[i])) {
+			fprintf(stderr, "ERROR: init_framebuffers() failed.\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void fini_swapchain_images(struct allocator *allocator, VkDevice dev,
+struct swapchain *sc) {
+	for (uint32_t i=0; i<sc->imageCount; i++) {
+		vkDestroySemaphore(dev, sc->rendered[i], NULL);
+		if (sc->pipeline) {
+			vkDestroyFramebuffer(dev, sc->framebuffers[i], NULL);
+			vkDestroyImageView(dev, sc->views[i], NULL);
+		}
+		if (sc->swp == VK_NULL_HANDLE) {
+			vkDestroyImage(dev, sc->imgs[i], NULL);
+			free_memory(allocator, &sc->mems[i]);
+		}
+	}
+}
+
+/* The fullscreen triangle, limited to the scissor rectangle. */
+static void record_triangle(VkCommandBuffer cmdbuf, const struct pipeline *p,
+VkExtent2D extent, VkRect2D scissor, uint64_t n) {
+	vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, p->pipeline);
+	VkViewport viewport = {0, 0, extent.width, extent.height, 0, 1};
+	vkCmdSetViewport(cmdbuf, 0, 1, &viewport);
+	vkCmdSetScissor(cmdbuf, 0, 1, &scissor);
+	float color[4] = {0.8984375f, 0.8984375f, (n % 256) / 255.0f, 1.0f};
+	vkCmdPushConstants(cmdbuf, p->layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+	sizeof(color), color);
+	vkCmdDraw(cmdbuf, 3, 1, 0, 0);
+}
+
+/* Worker threads that record the draw as secondary command buffers, one
+ * horizontal band of the image each, for the primary buffer to execute.
+ * Every thread owns one command pool per frame in flight and resets it as a
+ * whole; the frame's timeline value has been reached by the time the slot
+ * is reused. */
+#define maxRecordThreads 8
+
+struct record_job {
+	const struct pipeline *p;
+	VkFramebuffer fb;
+	VkExtent2D extent;
+	uint32_t slot;
+	uint64_t n;
+};
+
+struct record_thread {
+	struct recorder *r;
+	uint32_t index;
+	pthread_t thread;
+	VkCommandPool pools[maxFramesInFlight];
+};
+
+struct recorder {
+	VkDevice dev;
+	uint32_t threadCount, slotCount;
+	struct record_thread threads[maxRecordThreads];
+	/* Contiguous per slot, for vkCmdExecuteCommands. */
+	VkCommandBuffer cmdbufs[maxFramesInFlight][maxRecordThreads];
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	struct record_job job;
+	uint64_t generation; // bumped for every job
+	uint32_t pending; // threads still recording the job
+	int quit;
+};
+
+static void record_band(struct record_thread *t, const struct record_job *job) {
+	struct recorder *r = t->r;
+	VkCommandBuffer cmdbuf = r->cmdbufs[job->slot][t->index];
+	vkResetCommandPool(r->dev, t->pools[job->slot], 0);
+
+	VkCommandBufferInheritanceInfo inheritance = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+		.renderPass = job->p->renderPass,
+		.subpass = 0,
+		.framebuffer = job->fb
+	};
+	VkCommandBufferBeginInfo beginInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+		VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+		.pInheritanceInfo = &inheritance
+	};
+	vkBeginCommandBuffer(cmdbuf, &beginInfo);
+	uint32_t band = (job->extent.height + r->threadCount - 1) / r->threadCount;
+	uint32_t y = t->index * band;
+	if (y > job->extent.height)
+		y = job->extent.height;
+	if (band > job->extent.height - y)
+		band = job->extent.height - y;
+	VkRect2D scissor = {{0, y}, {job->extent.width, band}};
+	record_triangle(cmdbuf, job->p, job->extent, scissor, job->n);
+	vkEndCommandBuffer(cmdbuf);
+}
+
+static void *record_thread(void *arg) {
+	struct record_thread *t = arg;
+	struct recorder *r = t->r;
+	uint64_t seen = 0;
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (r->generation == seen && !r->quit)
+			pthread_cond_wait(&r->start, &r->lock);
+		if (r->quit)
+			break;
+		seen = r->generation;
+		struct record_job job = r->job;
+		pthread_mutex_unlock(&r->lock);
+		record_band(t, &job);
+		pthread_mutex_lock(&r->lock);
+		if (--r->pending == 0)
+			pthread_cond_signal(&r->done);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+int init_recorder(struct recorder *r, VkDevice dev, uint32_t family,
+uint32_t slotCount, uint32_t threadCount) {
+	*r = (struct recorder){
+		.dev = dev,
+		.slotCount = slotCount
+	};
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->start, NULL);
+	pthread_cond_init(&r->done, NULL);
+	for (uint32_t i=0; i<threadCount; i++) {
+		struct record_thread *t = &r->threads[i];
+		t->r = r;
+		t->index = i;
+		for (uint32_t j=0; j<slotCount; j++) {
+			t->pools[j] = create_command_pool(dev, family,
+			VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+			if (t->pools[j] == VK_NULL_HANDLE)
+				return -1;
+			VkCommandBufferAllocateInfo info = {
+				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+				.commandPool = t->pools[j],
+				.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+				.commandBufferCount = 1
+			};
+			if (vkAllocateCommandBuffers(dev, &info, &r->cmdbufs[j][i])) {
+				fprintf(stderr, "ERROR: init_recorder() failed.\n");
+				return -1;
+			}
+		}
+		if (pthread_create(&t->thread, NULL, record_thread, t)) {
+			fprintf(stderr, "ERROR: init_recorder() failed.\n");
+			return -1;
+		}
+		r->threadCount++;
+	}
+	return 0;
+}
+
+/* Returns once every thread has recorded its band of the job. */
+void record_bands(struct recorder *r, const struct record_job *job) {
+	pthread_mutex_lock(&r->lock);
+	r->job = *job;
+	r->pending = r->threadCount;
+	r->generation++;
+	pthread_cond_broadcast(&r->start);
+	while (r->pending)
+		pthread_cond_wait(&r->done, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+}
+
+void fini_recorder(struct recorder *r) {
+	pthread_mutex_lock(&r->lock);
+	r->quit = 1;
+	pthread_cond_broadcast(&r->start);
+	pthread_mutex_unlock(&r->lock);
+	for (uint32_t i=0; i<r->threadCount; i++) {
+		pthread_join(r->threads[i].thread, NULL);
+		for (uint32_t j=0; j<r->slotCount; j++)
+			vkDestroyCommandPool(r->dev, r->threads[i].pools[j], NULL);
+	}
+	pthread_cond_destroy(&r->done);
+	pthread_cond_destroy(&r->start);
+	pthread_mutex_destroy(&r->lock);
+}
+
+/* Draws the fullscreen triangle inside the render pass, or executes the
+ * secondary command buffers that draw it. */
+static void record_draw(VkCommandBuffer cmdbuf, const struct pipeline *p,
+VkFramebuffer fb, VkExtent2D extent, const VkCommandBuffer *secondaries,
+uint32_t secondaryCount, uint64_t n) {
+	VkClearValue clear = {.color = {{0.8984375f, 0.8984375f, 0.9765625f, 1.0f}}};
+	VkRenderPassBeginInfo info = {
+		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+		.renderPass = p->renderPass,
+		.framebuffer = fb,
+		.renderArea = {{0, 0}, extent},
+		.clearValueCount = 1,
+		.pClearValues = &clear
+	};
+	if (secondaryCount) {
+		vkCmdBeginRenderPass(cmdbuf, &info,
+		VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		vkCmdExecuteCommands(cmdbuf, secondaryCount, secondaries);
+	} else {
+		vkCmdBeginRenderPass(cmdbuf, &info, VK_SUBPASS_CONTENTS_INLINE);
+		VkRect2D scissor = {{0, 0}, extent};
+		record_triangle(cmdbuf, p, extent, scissor, n);
+	}
+	vkCmdEndRenderPass(cmdbuf);
+}
+
+static void record_clear(VkCommandBuffer cmdbuf, VkImage img,
+VkImageLayout finalLayout, uint64_t n) {
+	VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+	VkClearColorValue color = {0.8984375f, 0.8984375f, 0.9765625f, 1.0f};
+	color.float32[2] = (n % 256) / 255.0f; // show that frames are being drawn
+
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = 0,
+		.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = img,
+		.subresourceRange = range
+	};
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+	vkCmdClearColorImage(cmdbuf, img,
+	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = 0;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = finalLayout;
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+}
+
+/* A damage-mode frame: the image's damage gets the background again, then
+ * the square is drawn on top. */
+struct update {
+	const struct damage *damage;
+	const struct tiles *tiles;
+	uint32_t tile; // of the square's colour
+	VkRect2D square;
+};
+
+#define maxTileRegions 256
+
+/* Only rewrites the damaged part of the image; the rest keeps what it held
+ * when it was last presented. Full damage (the image's first frame) discards
+ * the old contents and clears. The background is copied, the square is
+ * copied too or, with a pipeline, drawn with the scissor set to it. */
+static void record_update(VkCommandBuffer cmdbuf, VkImage img,
+VkImageLayout finalLayout, const struct pipeline *p, VkFramebuffer fb,
+VkExtent2D extent, const struct update *u, uint64_t n) {
+	VkBufferImageCopy regions[maxTileRegions];
+	uint32_t count = 0;
+	int full = damage_is_full(u->damage, extent);
+	for (uint32_t i=0; i<u->damage->count && !full; i++) {
+		uint32_t c = tile_regions(u->tiles, 0, u->damage->rects[i],
+		regions + count, maxTileRegions - count);
+		if (c == UINT32_MAX)
+			full = 1;
+		else
+			count += c;
+	}
+
+	VkImageSubresourceRange range = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = 0,
+		.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.oldLayout = full ? VK_IMAGE_LAYOUT_UNDEFINED : finalLayout,
+		.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = img,
+		.subresourceRange = range
+	};
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+	if (full) {
+		VkClearColorValue color = {0.8984375f, 0.8984375f, 0.9765625f, 1.0f};
+		vkCmdClearColorImage(cmdbuf, img,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
+	} else if (count) {
+		vkCmdCopyBufferToImage(cmdbuf, u->tiles->buffer, img,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, count, regions);
+	}
+
+	if (p) {
+		VkRenderPassBeginInfo info = {
+			.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+			.renderPass = p->loadPass,
+			.framebuffer = fb,
+			.renderArea = u->square
+		};
+		vkCmdBeginRenderPass(cmdbuf, &info, VK_SUBPASS_CONTENTS_INLINE);
+		record_triangle(cmdbuf, p, extent, u->square, n);
+		vkCmdEndRenderPass(cmdbuf);
+		return;
+	}
+	/* The square overwrites part of the background. */
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+	count = tile_regions(u->tiles, u->tile, u->square, regions, maxTileRegions);
+	vkCmdCopyBufferToImage(cmdbuf, u->tiles->buffer, img,
+	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, count, regions);
+	barrier.dstAccessMask = 0;
+	barrier.newLayout = finalLayout;
+	vkCmdPipelineBarrier(cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT,
+	VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+}
+
+/* Without a pipeline the image is only cleared. The render pass leaves the
+ * image in the final layout it was created with. When dstFamily differs from
+ * the recording queue's srcFamily the image is released to it. With an
+ * update only the damage is redrawn. */
+void record_frame(VkCommandBuffer cmdbuf, VkImage img, VkImageLayout finalLayout,
+const struct pipeline *p, VkFramebuffer fb, VkExtent2D extent,
+const VkCommandBuffer *secondaries, uint32_t secondaryCount,
+const struct update *update, VkQueryPool queries, uint32_t srcFamily,
+uint32_t dstFamily, uint64_t n) {
+	VkCommandBufferBeginInfo beginInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+	};
+	vkBeginCommandBuffer(cmdbuf, &beginInfo);
+	if (queries != VK_NULL_HANDLE) {
+		vkCmdResetQueryPool(cmdbuf, queries, 0, 2 * passCount);
+		vkCmdWriteTimestamp(cmdbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		queries, 2 * PASS_RENDER);
+	}
+	if (update)
+		record_update(cmdbuf, img, finalLayout, p, fb, extent, update, n);
+	else if (p)
+		record_draw(cmdbuf, p, fb, extent, secondaries, secondaryCount, n);
+	else
+		record_clear(cmdbuf, img, finalLayout, n);
+	if (queries != VK_NULL_HANDLE)
+		vkCmdWriteTimestamp(cmdbuf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+		queries, 2 * PASS_RENDER + 1);
+	if (dstFamily != srcFamily)
+		record_ownership(cmdbuf, img, finalLayout, srcFamily, dstFamily,
+		VK_PIPELINE_STAGE_TRANSFER_BIT |
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+
+	vkEndCommandBuffer(cmdbuf);
+}
+
+/* Frames submitted but not yet seen completing, oldest first. */
+#define maxLatencyPending 16
+
+struct latency_entry {
+	uint64_t presentId, value; // value on the graphics timeline
+	uint64_t submitted; // ns, CLOCK_MONOTONIC
+};
+
+/* A thread of its own waits for each frame as soon as it is queued and
+ * stamps the moment the wait returns, so the sample is submit to completion
+ * and the render loop never blocks on it. */
+struct latency_waiter {
+	VkDevice dev;
+	struct swapchain *sc;
+	VkSemaphore timeline;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // an entry was queued, or one was taken
+	struct latency_entry pending[maxLatencyPending];
+	uint32_t first, count;
+	int done; // nothing more will be queued
+	int error;
+};
+
+/* Between polls of vkWaitForPresentKHR(), in ns. */
+#define latencyPollInterval 50000
+
+/* Presents that do not complete within a second count as failed. The swapchain
+ * is externally synchronized, and the render thread acquires and presents on
+ * it meanwhile, so present waits are polled under sc->lock instead of blocking
+ * in the driver. A sample is late by up to one poll interval, or by as long as
+ * an acquire blocks while holding the lock. */
+static VkResult wait_latency_entry(struct latency_waiter *w,
+const struct latency_entry *e) {
+	uint64_t timeout = 1000000000;
+	if (w->sc->measure == MEASURE_PRESENT_WAIT) {
+		uint64_t deadline = now_ns() + timeout;
+		for (;;) {
+			pthread_mutex_lock(&w->sc->lock);
+			VkResult res = vkWaitForPresent(w->dev, w->sc->swp, e->presentId, 0);
+			pthread_mutex_unlock(&w->sc->lock);
+			if (res != VK_TIMEOUT || now_ns() >= deadline)
+				return res;
+			struct timespec ts = {0, latencyPollInterval};
+			nanosleep(&ts, NULL);
+		}
+	}
+	VkSemaphoreWaitInfo info = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 1,
+		.pSemaphores = &w->timeline,
+		.pValues = &e->value
+	};
+	return vkWaitTimeline(w->dev, &info, timeout);
+}
+
+static void *latency_thread(void *arg) {
+	struct latency_waiter *w = arg;
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->count && !w->done)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (!w->count)
+			break;
+		struct latency_entry e = w->pending[w->first];
+		pthread_mutex_unlock(&w->lock);
+		VkResult res = w->error ? VK_SUCCESS : wait_latency_entry(w, &e);
+		uint64_t completed = now_ns();
+		pthread_mutex_lock(&w->lock);
+		w->first = (w->first + 1) % maxLatencyPending;
+		w->count--;
+		pthread_cond_broadcast(&w->cond);
+		if (w->error)
+			continue;
+		if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
+			fprintf(stderr, "ERROR: %s failed for frame %" PRIu64 " (%d).\n",
+			w->sc->measure == MEASURE_PRESENT_WAIT ? "vkWaitForPresentKHR()" :
+			"vkWaitSemaphoresKHR()", e.presentId - 1, res);
+			w->error = 1;
+			continue;
+		}
+		add_sample(&w->sc->latency, (completed - e.submitted) / 1e6);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+int start_latency_waiter(struct latency_waiter *w, VkDevice dev,
+struct swapchain *sc, VkSemaphore timeline) {
+	*w = (struct latency_waiter){.dev = dev, .sc = sc, .timeline = timeline};
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, latency_thread, w)) {
+		fprintf(stderr, "ERROR: start_latency_waiter() failed.\n");
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		return -1;
+	}
+	sc->waiter = w;
+	return 0;
+}
+
+/* Only blocks if the waiter fell maxLatencyPending frames behind. */
+void queue_latency(struct latency_waiter *w, struct latency_entry e) {
+	pthread_mutex_lock(&w->lock);
+	while (w->count == maxLatencyPending)
+		pthread_cond_wait(&w->cond, &w->lock);
+	w->pending[(w->first + w->count++) % maxLatencyPending] = e;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Waits for the queued frames. Returns -1 if any wait failed. */
+int stop_latency_waiter(struct latency_waiter *w) {
+	pthread_mutex_lock(&w->lock);
+	w->done = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	w->sc->waiter = NULL;
+	return w->error ? -1 : 0;
+}
+
+void print_latency(struct swapchain *sc) {
+	struct samples *l = &sc->latency;
+	if (l->count == 0)
+		return;
+	struct summary sum = summarize(l);
+	printf("%s latency over %" PRIu64 " frames: min %.3f ms, mean %.3f ms, max %.3f ms\n",
+	sc->measure == MEASURE_PRESENT_WAIT ? "submit to present" : "submit to GPU idle",
+	l->count, sum.min, sum.mean, sum.max);
+}
+
+/* Only waits for the GPU when the frame slot (or the acquired image) is still
+ * in use, so frame n+1 is recorded while frame n executes. With readback the
+ * copy of frame n runs on the transfer queue while frame n+1 renders. */
+int draw_frame(VkDevice dev, struct queues *q, struct swapchain *sc,
+struct frame *f, uint64_t n) {
+	if (wait_timeline(dev, &q->graphicsTimeline, f->value) < 0)
+		return -1;
+	if (f->queriesPending)
+		collect_timestamps(dev, &sc->timing, f);
+
+	int offscreen = sc->swp == VK_NULL_HANDLE;
+	uint32_t index = n % sc->imageCount;
+	if (!offscreen) {
+		pthread_mutex_lock(&sc->lock);
+		VkResult res = vkAcquireNextImageKHR(dev, sc->swp, UINT64_MAX,
+		f->acquired, VK_NULL_HANDLE, &index);
+		pthread_mutex_unlock(&sc->lock);
+		if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
+			fprintf(stderr, "ERROR: vkAcquireNextImageKHR() failed.\n");
+			return -1;
+		}
+	}
+	if (wait_timeline(dev, &q->graphicsTimeline, sc->imageValues[index]) < 0)
+		return -1;
+	int readback = sc->readback != VK_NULL_HANDLE;
+	if (readback) {
+		if (wait_timeline(dev, &q->transferTimeline, sc->copyValues[index]) < 0)
+			return -1;
+		check_readback(sc, index);
+	}
+
+	/* The frame's damage is everything that differs from the previous
+	 * frame; every image has to catch up on it before it is shown. */
+	struct damage frameDamage = {0};
+	struct update update;
+	if (sc->damageSize) {
+		update.square = square_rect(n, sc->damageSize, sc->extent);
+		if (n > 0)
+			add_damage(&frameDamage, square_rect(n - 1, sc->damageSize,
+			sc->extent));
+		add_damage(&frameDamage, update.square);
+		for (uint32_t i=0; i<sc->imageCount; i++)
+			merge_damage(&sc->pending[i], &frameDamage);
+		update.damage = &sc->pending[index];
+		update.tiles = &sc->tiles;
+		update.tile = 1 + f->slot;
+		fill_tile(&sc->tiles, update.tile, 0xffe5e500 | (n % 256));
+		sc->damagedPixels += damage_area(update.damage, sc->extent);
+	} else {
+		sc->damagedPixels += (uint64_t)sc->extent.width * sc->extent.height;
+	}
+
+	VkFramebuffer fb = sc->pipeline ? sc->framebuffers[index] : VK_NULL_HANDLE;
+	uint32_t secondaryCount = 0;
+	if (sc->pipeline && sc->recorder) {
+		struct record_job job = {sc->pipeline, fb, sc->extent, f->slot, n};
+		record_bands(sc->recorder, &job);
+		secondaryCount = sc->recorder->threadCount;
+	}
+	vkResetCommandPool(dev, f->pool, 0);
+	record_frame(f->cmdbuf, sc->imgs[index], offscreen ?
+	VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+	sc->pipeline, fb, sc->extent, sc->recorder ?
+	sc->recorder->cmdbufs[f->slot] : NULL, secondaryCount,
+	sc->damageSize ? &update : NULL, f->queries, q->graphicsFamily,
+	readback ? q->transferFamily : q->graphicsFamily, n);
+	/* The transfer queue keeps the image, so its contents are lost to the
+	 * graphics queue. */
+	sc->pending[index].count = 0;
+	if (readback && q->transferFamily != q->graphicsFamily)
+		add_damage(&sc->pending[index], (VkRect2D){{0, 0}, sc->extent});
+
+	/* The render signals the graphics timeline, which the readback copy waits
+	 * on; rendered[] is only signaled for the presentation engine. */
+	struct timeline *gt = &q->graphicsTimeline, *tt = &q->transferTimeline;
+	VkSemaphoreSubmitInfo acquiredInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+		.semaphore = f->acquired,
+		.stageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT |
+		VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT
+	};
+	VkSemaphoreSubmitInfo signalInfos[2] = {
+		{
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+			.semaphore = gt->sem,
+			.value = gt->value + 1,
+			.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT
+		}, {
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+			.semaphore = sc->rendered[index],
+			.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT
+		}
+	};
+	VkCommandBufferSubmitInfo cmdbufInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+		.commandBuffer = f->cmdbuf
+	};
+	VkSemaphoreSubmitInfo renderedInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+		.semaphore = gt->sem,
+		.value = gt->value + 1,
+		.stageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT
+	};
+	VkSemaphoreSubmitInfo copiedInfo = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+		.semaphore = tt->sem,
+		.value = tt->value + 1,
+		.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT
+	};
+	VkCommandBufferSubmitInfo copyCmdbufInfo = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+		.commandBuffer = readback ? sc->copyCmdbufs[index] : VK_NULL_HANDLE
+	};
+	VkSubmitInfo2 submitInfos[2] = {
+		{
+			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+			.waitSemaphoreInfoCount = offscreen ? 0 : 1,
+			.pWaitSemaphoreInfos = &acquiredInfo,
+			.commandBufferInfoCount = 1,
+			.pCommandBufferInfos = &cmdbufInfo,
+			.signalSemaphoreInfoCount = offscreen ? 1 : 2,
+			.pSignalSemaphoreInfos = signalInfos
+		}, {
+			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+			.waitSemaphoreInfoCount = 1,
+			.pWaitSemaphoreInfos = &renderedInfo,
+			.commandBufferInfoCount = 1,
+			.pCommandBufferInfos = &copyCmdbufInfo,
+			.signalSemaphoreInfoCount = 1,
+			.pSignalSemaphoreInfos = &copiedInfo
+		}
+	};
+	/* Everything for the frame goes into one call when it all targets the
+	 * same queue; a dedicated transfer queue needs a call of its own. */
+	int batched = readback && q->transfer == q->graphics;
+	uint64_t submitted = now_ns();
+	pthread_mutex_lock(q->lock);
+	VkResult res = vkSubmit2(q->graphics, batched ? 2 : 1, submitInfos,
+	VK_NULL_HANDLE);
+	if (!res && readback && !batched)
+		res = vkSubmit2(q->transfer, 1, &submitInfos[1], VK_NULL_HANDLE);
+	pthread_mutex_unlock(q->lock);
+	if (res) {
+		fprintf(stderr, "ERROR: vkQueueSubmit2() failed.\n");
+		return -1;
+	}
+	f->value = sc->imageValues[index] = ++gt->value;
+	f->queriesPending = f->queries != VK_NULL_HANDLE;
+	if (readback) {
+		sc->copyValues[index] = ++tt->value;
+		sc->readbackFrames[index] = n + 1;
+	}
+
+	uint64_t presentId = n + 1; // ids must be non-zero and increasing
+	if (!offscreen) {
+		VkRectLayerKHR rects[maxDamageRects];
+		for (uint32_t i=0; i<frameDamage.count; i++)
+			rects[i] = (VkRectLayerKHR){frameDamage.rects[i].offset,
+			frameDamage.rects[i].extent, 0};
+		VkPresentRegionKHR region = {frameDamage.count, rects};
+		VkPresentRegionsKHR regionsInfo = {
+			.sType = VK_STRUCTURE_TYPE_PRESENT_REGIONS_KHR,
+			.swapchainCount = 1,
+			.pRegions = &region
+		};
+		// The first present has no previous image to be incremental to
+		int regions = sc->incrementalPresent && n > 0;
+		VkPresentIdKHR presentIdInfo = {
+			.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR,
+			.pNext = regions ? &regionsInfo : NULL,
+			.swapchainCount = 1,
+			.pPresentIds = &presentId
+		};
+		VkPresentInfoKHR presentInfo = {
+			.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+			.pNext = sc->measure == MEASURE_PRESENT_WAIT ? (void *)&presentIdInfo :
+			regions ? (void *)&regionsInfo : NULL,
+			.waitSemaphoreCount = 1,
+			.pWaitSemaphores = &sc->rendered[index],
+			.swapchainCount = 1,
+			.pSwapchains = &sc->swp,
+			.pImageIndices = &index
+		};
+		pthread_mutex_lock(&sc->lock);
+		pthread_mutex_lock(q->lock);
+		res = vkQueuePresentKHR(q->graphics, &presentInfo);
+		pthread_mutex_unlock(q->lock);
+		pthread_mutex_unlock(&sc->lock);
+		if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
+			fprintf(stderr, "ERROR: vkQueuePresentKHR() failed.\n");
+			return -1;
+		}
+	}
+	if (sc->waiter)
+		queue_latency(sc->waiter, (struct latency_entry){presentId, f->value,
+		submitted});
+	return 0;
+}
+
+/* One display, rendered by a thread of its own. A swapchain image can only be
+ * presented to its own surface, so displays never share images; offscreen and
+ * headless runs have a single head. */
+struct head {
+	VkDevice dev;
+	VkSurfaceKHR surf;
+	struct queues queues;
+	struct swapchain sc;
+	struct frame frames[maxFramesInFlight];
+	uint32_t framesInFlight;
+	uint64_t frameCount;
+	struct recorder recorder;
+	struct latency_waiter waiter;
+	struct run run;
+	struct startup *startup; // head 0 only, which stamps the first present
+	pthread_t thread;
+	int error;
+};
+
+static void *render_thread(void *arg) {
+	struct head *h = arg;
+	struct swapchain *sc = &h->sc;
+	int measuring = sc->measure != MEASURE_NONE &&
+	start_latency_waiter(&h->waiter, h->dev, sc,
+	h->queues.graphicsTimeline.sem) == 0;
+	uint64_t start = now_ns(), last = start;
+	clockid_t cpuClock = h->run.recordThreads ? CLOCK_PROCESS_CPUTIME_ID :
+	CLOCK_THREAD_CPUTIME_ID;
+	uint64_t n;
+	for (n = 0; n < h->frameCount; n++) {
+		uint64_t cpu = clock_ns(cpuClock);
+		uint64_t wall = now_ns();
+		if (n > 0)
+			add_sample(&h->run.interval, (wall - last) / 1e6);
+		last = wall;
+		if (draw_frame(h->dev, &h->queues, sc,
+		&h->frames[n % h->framesInFlight], n) < 0) {
+			h->error = 1;
+			break;
+		}
+		if (n == 0 && h->startup) {
+			startup_phase(h->startup, sc->swp == VK_NULL_HANDLE ?
+			"first frame" : "first present queued");
+			h->run.startup = *h->startup;
+		}
+		add_sample(&h->run.cpu, (clock_ns(cpuClock) - cpu) / 1e6);
+	}
+	if (measuring && stop_latency_waiter(&h->waiter) < 0)
+		h->error = 1;
+	/* The run lasts until the GPU is done with the last frame. */
+	struct timeline *gt = &h->queues.graphicsTimeline;
+	struct timeline *tt = &h->queues.transferTimeline;
+	if (wait_timeline(h->dev, gt, gt->value) < 0 ||
+	wait_timeline(h->dev, tt, tt->value) < 0)
+		h->error = 1;
+	h->run.frames = n;
+	h->run.seconds = (now_ns() - start) / 1e9;
+	return NULL;
+}
+
 static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
 VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
 VkDebugUtilsMessageTypeFlagsEXT messageType, const
@@ -133,18 +2655,123 @@ VkDebugUtilsMessengerCallbackDataEXT* pCallbackData, void* pUserData) {
 	return VK_FALSE;
 }
 
-int main() {
-	uint32_t apiVersion;
-	vkEnumerateInstanceVersion(&apiVersion);
-	printf("Vulkan %i.%i.%i\n", VK_VERSION_MAJOR(apiVersion),
-	VK_VERSION_MINOR(apiVersion), VK_VERSION_PATCH(apiVersion));
-// I should check the availability of extensions here
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-f frames in flight (1-%d)] [-n frame count]\n"
+	"  [-p immediate|mailbox|fifo|fifo_relaxed] [-l (measure present latency)]\n"
+	"  [-H (headless)] [-o (offscreen, implies -H)]\n"
+	"  [-s WIDTHxHEIGHT (headless only)] [-d (draw a triangle)]\n"
+	"  [-R WIDTHxHEIGHT[@HZ] (display mode; default: native, highest refresh)]\n"
+	"  [-r (read frames back on the transfer queue, offscreen only)]\n"
+	"  [-t threads recording the draw (1-%d)]\n"
+	"  [-D square size (damage mode: only redraw what changed)]\n"
+	"  [-F (fast start: no validation, debug utils or layer listing)]\n"
+	"  [-j JSON results file]\n",
+	argv0, maxFramesInFlight, maxRecordThreads);
+}
+
+int main(int argc, char *argv[]) {
+	uint32_t framesInFlight = 2;
+	uint64_t frameCount = 180;
+	VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+	int measure = 0;
+	int headless = 0, forceOffscreen = 0, draw = 0, fastStart = 0;
+	int readback = 0;
+	uint32_t recordThreads = 0; // 0 records on the main thread
+	uint32_t damageSize = 0; // 0 redraws every frame in full
+	VkExtent2D extent = {1280, 720};
+	const char *jsonPath = NULL;
+	struct mode_request displayMode = {0};
+	int opt;
+	while ((opt = getopt(argc, argv, "f:n:p:lHos:R:drt:D:Fj:")) != -1) {
+		switch (opt) {
+		case 'f':
+			framesInFlight = atoi(optarg);
+			if (framesInFlight < 1 || framesInFlight > maxFramesInFlight) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			frameCount = strtoull(optarg, NULL, 10);
+			break;
+		case 'p':
+			if (parse_present_mode(optarg, &presentMode) < 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'l':
+			measure = 1;
+			break;
+		case 'H':
+			headless = 1;
+			break;
+		case 'o':
+			headless = forceOffscreen = 1;
+			break;
+		case 'd':
+			draw = 1;
+			break;
+		case 'r':
+			readback = 1;
+			break;
+		case 'D':
+			damageSize = atoi(optarg);
+			if (damageSize == 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			recordThreads = atoi(optarg);
+			if (recordThreads < 1 || recordThreads > maxRecordThreads) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'F':
+			fastStart = 1;
+			break;
+		case 'j':
+			jsonPath = optarg;
+			break;
+		case 's':
+			if (sscanf(optarg, "%ux%u", &extent.width, &extent.height) != 2) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'R':
+			if (parse_mode_request(optarg, &displayMode) < 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	struct startup startup = {.last = now_ns()};
+	if (!fastStart) {
+		uint32_t apiVersion;
+		vkEnumerateInstanceVersion(&apiVersion);
+		printf("Vulkan %i.%i.%i\n", VK_VERSION_MAJOR(apiVersion),
+		VK_VERSION_MINOR(apiVersion), VK_VERSION_PATCH(apiVersion));
+	}
 
-	uint32_t propertyCount = 64;
-	VkLayerProperties props[64];
-	vkEnumerateInstanceLayerProperties(&propertyCount, props);
-	for (int i=0; i<propertyCount; i++)
-		printf("%s\n", props[i].layerName);
+	const char *layers[] = {"VK_LAYER_LUNARG_standard_validation"};
+	int validation = 0;
+	if (!fastStart) {
+		uint32_t propertyCount = 64;
+		VkLayerProperties props[64];
+		vkEnumerateInstanceLayerProperties(&propertyCount, props);
+		for (int i=0; i<propertyCount; i++) {
+			printf("%s\n", props[i].layerName);
+			validation |= !strcmp(props[i].layerName, layers[0]);
+		}
+	}
 
 	VkDebugUtilsMessengerCreateInfoEXT createInfo2 = {0};
 	createInfo2.sType =
@@ -159,21 +2786,39 @@ int main() {
 	VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
 	createInfo2.pfnUserCallback = debugCallback;
 
-	const char *extensions[] = {
-		VK_KHR_SURFACE_EXTENSION_NAME,
-		VK_KHR_DISPLAY_EXTENSION_NAME,
-		VK_EXT_DEBUG_UTILS_EXTENSION_NAME
-	};
-	const char *layers[] = {"VK_LAYER_LUNARG_standard_validation"};
+// Without VK_EXT_headless_surface, headless mode renders to offscreen images
+	int headlessSurface = headless && !forceOffscreen &&
+	has_instance_extension(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME);
+	int offscreen = headless && !headlessSurface;
+	const char *extensions[4];
+	uint32_t extensionCount = 0;
+	// Lets create_logical_device() query features on a 1.0 instance
+	if (has_instance_extension(
+	VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME))
+		extensions[extensionCount++] =
+		VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME;
+	if (!offscreen) {
+		extensions[extensionCount++] = VK_KHR_SURFACE_EXTENSION_NAME;
+		extensions[extensionCount++] = headless ?
+		VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME : VK_KHR_DISPLAY_EXTENSION_NAME;
+	}
+	if (!fastStart)
+		extensions[extensionCount++] = VK_EXT_DEBUG_UTILS_EXTENSION_NAME;
 	VkInstanceCreateInfo createInfo = {0};
 	createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-	createInfo.pNext = &createInfo2;
-	createInfo.enabledLayerCount = sizeof(layers)/sizeof(char*);
+	createInfo.pNext = fastStart ? NULL : &createInfo2;
+	createInfo.enabledLayerCount = validation ? 1 : 0;
 	createInfo.ppEnabledLayerNames = layers;
-	createInfo.enabledExtensionCount = sizeof(extensions)/sizeof(char*);
+	createInfo.enabledExtensionCount = extensionCount;
 	createInfo.ppEnabledExtensionNames = extensions;
 	VkInstance instance;
-	vkCreateInstance(&createInfo, 0, &instance);
+	if (vkCreateInstance(&createInfo, 0, &instance) != VK_SUCCESS) {
+		fprintf(stderr, "ERROR: vkCreateInstance() failed.\n");
+		return EXIT_FAILURE;
+	}
+	startup_phase(&startup, "instance");
+	vkGetFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)
+	vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR");
 
 	PFN_vkCreateDebugUtilsMessengerEXT vkCreateDebugUtilsMessenger =
 	(PFN_vkCreateDebugUtilsMessengerEXT) vkGetInstanceProcAddr(instance,
@@ -182,106 +2827,294 @@ int main() {
 //	vkCreateDebugUtilsMessenger(instance, &createInfo2, 0, &debugMessenger);
 
 	VkPhysicalDevice gpu = get_gpu(instance);
-	VkDevice dev = create_logical_device(gpu);
-	VkQueue queue;
-	vkGetDeviceQueue(dev, 0, 0, &queue);
-
-	VkDisplayPropertiesKHR displayProperties = get_display(gpu);
-	VkSurfaceKHR surf = create_surface(instance, gpu, displayProperties.display);
-
-	VkBool32 supp;
-	vkGetPhysicalDeviceSurfaceSupportKHR(gpu, 0, surf, &supp);
-	printf("supported? %d\n", supp);
-
-	VkSwapchainKHR swp = create_swapchain(gpu, dev, surf);
-	uint32_t imageCount = 4;
-	VkImage imgs[4];
-	vkGetSwapchainImagesKHR(dev, swp, &imageCount, imgs);
-
-/*	VkImageView = view;
-	VkImageViewCreateInfo createInfo = {};
-	createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-	createInfo.image = view;
-	createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-	createInfo.format = swapChainImageFormat;
-	createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-	createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-	createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-	createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-	createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	createInfo.subresourceRange.baseMipLevel = 0;
-	createInfo.subresourceRange.levelCount = 1;
-	createInfo.subresourceRange.baseArrayLayer = 0;
-	createInfo.subresourceRange.layerCount = 1;
-	vkCreateImageView(dev, &createInfo, NULL, &view);*/
-
-	VkImageSubresourceRange aaa = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
-	VkClearColorValue color = {0.8984375f, 0.8984375f, 0.9765625f, 1.0f};
+	struct queues queues;
+	if (find_queue_families(gpu, &queues) < 0)
+		return EXIT_FAILURE;
+	struct surface_setup surfaceSetup = {
+		.instance = instance,
+		.gpu = gpu,
+		.headless = headlessSurface,
+		.mode = displayMode,
+		.surfCount = 0
+	};
+	pthread_t surfaceWorker;
+	int threaded = !offscreen && !pthread_create(&surfaceWorker, NULL,
+	surface_thread, &surfaceSetup);
+	int presentWait = measure &&
+	has_device_extension(gpu, VK_KHR_PRESENT_ID_EXTENSION_NAME) &&
+	has_device_extension(gpu, VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+	if (measure && !presentWait)
+		printf("VK_KHR_present_wait not available, measuring until GPU completion\n");
+	startup_phase(&startup, "physical device");
+	int incrementalPresent = damageSize && !offscreen &&
+	has_device_extension(gpu, VK_KHR_INCREMENTAL_PRESENT_EXTENSION_NAME);
+	VkDevice dev = create_logical_device(gpu, &queues, !offscreen,
+	presentWait && !offscreen, incrementalPresent);
+	if (dev == VK_NULL_HANDLE) {
+		// The worker still uses the instance
+		if (threaded)
+			pthread_join(surfaceWorker, NULL);
+		return EXIT_FAILURE;
+	}
+	startup_phase(&startup, "device");
+	vkGetDeviceQueue(dev, queues.graphicsFamily, 0, &queues.graphics);
+	vkGetDeviceQueue(dev, queues.transferFamily, 0, &queues.transfer);
+	pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+	queues.lock = &queueLock;
+	printf("Queue families: graphics %u, transfer %u\n",
+	queues.graphicsFamily, queues.transferFamily);
 
-	VkCommandPool commandPool;
-	VkCommandPoolCreateInfo poolInfo = {};
-	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	poolInfo.queueFamilyIndex = 0;
-	vkCreateCommandPool(dev, &poolInfo, NULL, &commandPool);
-
-	VkCommandBufferAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	allocInfo.commandPool = commandPool;
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocInfo.commandBufferCount = 1;
-	VkCommandBuffer cmdbuf;
-	vkAllocateCommandBuffers(dev, &allocInfo, &cmdbuf);
+	if (threaded)
+		pthread_join(surfaceWorker, NULL);
+	else if (!offscreen)
+		surface_thread(&surfaceSetup);
+	if (!offscreen && surfaceSetup.surfCount == 0)
+		return EXIT_FAILURE;
+	/* Only the time spent waiting for the worker is on the critical path. */
+	if (!offscreen) {
+		startup_phase(&startup, "surface");
+		printf("surface setup took %.3f ms%s\n", surfaceSetup.ms,
+		threaded ? " on a worker thread" : "");
+	}
 
-	VkCommandBufferBeginInfo beginInfo = {};
-	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-	vkBeginCommandBuffer(cmdbuf, &beginInfo);
+	uint32_t headCount = offscreen ? 1 : surfaceSetup.surfCount;
+	struct head heads[maxDisplayCount];
+	memset(heads, 0, sizeof(heads));
+	for (uint32_t i=0; i<headCount; i++) {
+		struct head *h = &heads[i];
+		h->dev = dev;
+		h->surf = offscreen ? VK_NULL_HANDLE : surfaceSetup.surfs[i];
+		h->queues = queues;
+		if (create_timeline(dev, &h->queues.graphicsTimeline) < 0 ||
+		create_timeline(dev, &h->queues.transferTimeline) < 0)
+			return EXIT_FAILURE;
+		h->sc.extent = extent;
+		pthread_mutex_init(&h->sc.lock, NULL);
+		if (offscreen)
+			continue;
 
-	VkImageMemoryBarrier bbb = {
-		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-		.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		.image = imgs[0],
-		.subresourceRange = aaa
-	};
-	vkCmdPipelineBarrier(cmdbuf, 1, 1, 0, 0, 0, 0, 0, 1, &bbb);
-	vkCmdClearColorImage(cmdbuf, imgs[0],
-	VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &aaa);
-	bbb.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	vkCmdPipelineBarrier(cmdbuf, 1, 1, 0, 0, 0, 0, 0, 1, &bbb);
+		VkBool32 supp;
+		vkGetPhysicalDeviceSurfaceSupportKHR(gpu, queues.graphicsFamily, h->surf,
+		&supp);
+		if (!supp) {
+			fprintf(stderr, "ERROR: queue family %u cannot present.\n",
+			queues.graphicsFamily);
+			return EXIT_FAILURE;
+		}
 
-	vkEndCommandBuffer(cmdbuf);
+		VkPresentModeKHR mode = choose_present_mode(gpu, h->surf, presentMode);
+		printf("Using present mode %s\n", present_mode_name(mode));
+		h->run.presentMode = present_mode_name(mode);
+		h->sc.swp = create_swapchain(gpu, dev, h->surf, mode, &h->sc.extent);
+		if (h->sc.swp == VK_NULL_HANDLE)
+			return EXIT_FAILURE;
+	}
+	if (!offscreen)
+		startup_phase(&startup, "swapchain");
 
-	uint32_t index;
-	vkAcquireNextImageKHR(dev, swp, UINT64_MAX, VK_NULL_HANDLE,
-	VK_NULL_HANDLE, &index);
-
-
-VkSubmitInfo submitInfo = {};
-submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-//VkSemaphore waitSemaphores[] = {imageAvailableSemaphore};
-//VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-//submitInfo.waitSemaphoreCount = 1;
-//submitInfo.pWaitSemaphores = waitSemaphores;
-//submitInfo.pWaitDstStageMask = waitStages;
-submitInfo.commandBufferCount = 1;
-submitInfo.pCommandBuffers = &cmdbuf;
-//VkSemaphore signalSemaphores[] = {renderFinishedSemaphore};
-//submitInfo.signalSemaphoreCount = 1;
-//submitInfo.pSignalSemaphores = signalSemaphores;
-vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-
-	VkPresentInfoKHR presentInfo = {
-		.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-		.swapchainCount = 1,
-		.pSwapchains = &swp,
-		.pImageIndices = &index
-	};
-	vkQueuePresentKHR(queue, &presentInfo);
-	sleep(3);
-	
-	vkDestroyCommandPool(dev, commandPool, NULL);
-	vkDestroySwapchainKHR(dev, swp, 0);
-	vkDestroySurfaceKHR(instance, surf, 0);
+	if (readback && !offscreen) {
+		printf("Readback needs offscreen rendering (-o), disabled\n");
+		readback = 0;
+	}
+	VkCommandPool transferPool = VK_NULL_HANDLE;
+	if (readback) {
+		transferPool = create_command_pool(dev, queues.transferFamily, 0);
+		if (transferPool == VK_NULL_HANDLE)
+			return EXIT_FAILURE;
+	}
+
+	struct allocator allocator;
+	init_allocator(&allocator, gpu, dev);
+
+	// The cache turns pipeline compilation into a lookup after the first run
+	struct pipeline pipeline;
+	if (draw) {
+		char cachePath[64];
+		pipeline_cache_path(gpu, cachePath, sizeof(cachePath));
+		int hit;
+		VkPipelineCache cache = load_pipeline_cache(gpu, dev, cachePath, &hit);
+		if (cache == VK_NULL_HANDLE)
+			return EXIT_FAILURE;
+		uint64_t t = now_ns();
+		if (create_pipeline(dev, cache, VK_FORMAT_B8G8R8A8_UNORM, offscreen ?
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+		&pipeline) < 0)
+			return EXIT_FAILURE;
+		printf("Pipeline created in %.3f ms (cache %s)\n", (now_ns() - t) / 1e6,
+		hit ? "hit" : "miss");
+		if (save_pipeline_cache(dev, cache, cachePath) < 0)
+			fprintf(stderr, "ERROR: could not write %s\n", cachePath);
+		vkDestroyPipelineCache(dev, cache, NULL);
+	}
+
+	// Only the draw has work to split; a clear is a single command
+	if (recordThreads && !draw) {
+		printf("Multithreaded recording needs -d, recording on one thread\n");
+		recordThreads = 0;
+	}
+	if (recordThreads && damageSize) {
+		printf("Damage updates are too small to split, recording on one "
+		"thread\n");
+		recordThreads = 0;
+	}
+
+	for (uint32_t i=0; i<headCount; i++) {
+		struct head *h = &heads[i];
+		struct swapchain *sc = &h->sc;
+		VkExtent2D headExtent = sc->extent;
+		sc->measure = !measure ? MEASURE_NONE :
+		presentWait && !offscreen ? MEASURE_PRESENT_WAIT : MEASURE_TIMELINE;
+		if (offscreen) {
+			printf("Rendering to %ux%u offscreen images\n", headExtent.width,
+			headExtent.height);
+			if (init_offscreen_images(&allocator, dev, sc, headExtent,
+			3) < 0)
+				return EXIT_FAILURE;
+			if (readback && init_readback(&allocator, dev, transferPool,
+			&h->queues, sc) < 0)
+				return EXIT_FAILURE;
+			print_allocator(&allocator);
+		} else if (init_swapchain_images(dev, sc) < 0) {
+			return EXIT_FAILURE;
+		}
+
+		/* Damage mode moves a square over a still background: one tile holds
+		 * the background and each frame in flight gets its own tile for the
+		 * square. */
+		if (damageSize) {
+			uint32_t size = damageSize;
+			if (size > headExtent.width)
+				size = headExtent.width;
+			if (size > headExtent.height)
+				size = headExtent.height;
+			if (create_tiles(&allocator, dev, size, 1 + framesInFlight,
+			&sc->tiles) < 0)
+				return EXIT_FAILURE;
+			fill_tile(&sc->tiles, 0, 0xffe5e5f9);
+			VkRect2D full = {{0, 0}, headExtent};
+			for (uint32_t j=0; j<sc->imageCount; j++) {
+				sc->pending[j].count = 0;
+				add_damage(&sc->pending[j], full);
+			}
+			sc->damageSize = size;
+			sc->incrementalPresent = incrementalPresent;
+			printf("Redrawing only the damage of a %ux%u square%s\n", size,
+			size, offscreen ? "" : incrementalPresent ?
+			", present regions enabled" : ", no incremental present");
+		}
+
+		if (draw) {
+			sc->pipeline = &pipeline;
+			if (init_framebuffers(dev, sc) < 0)
+				return EXIT_FAILURE;
+		}
+
+		init_gpu_timing(gpu, queues.graphicsFamily, &sc->timing);
+
+		h->framesInFlight = framesInFlight;
+		h->frameCount = frameCount;
+		if (create_frames(dev, queues.graphicsFamily, h->frames, framesInFlight,
+		sc->timing.mask != 0) < 0)
+			return EXIT_FAILURE;
+
+		if (recordThreads) {
+			if (init_recorder(&h->recorder, dev, queues.graphicsFamily,
+			framesInFlight, recordThreads) < 0)
+				return EXIT_FAILURE;
+			sc->recorder = &h->recorder;
+		}
+
+		h->run.scenario = damageSize ? (draw ? "draw+damage" : "clear+damage") :
+		readback ? (draw ? "draw+readback" : "clear+readback") :
+		offscreen ? (draw ? "draw" : "clear") :
+		(draw ? "draw+present" : "clear+present");
+		h->run.extent = headExtent;
+		h->run.framesInFlight = framesInFlight;
+		h->run.recordThreads = recordThreads;
+		h->run.damageSize = sc->damageSize;
+		h->startup = i == 0 ? &startup : NULL;
+	}
+	if (recordThreads)
+		printf("Recording on %u threads%s\n", recordThreads,
+		headCount > 1 ? " per display" : "");
+	startup_phase(&startup, "resources");
+
+	uint32_t started;
+	for (started = 0; started < headCount; started++) {
+		if (pthread_create(&heads[started].thread, NULL, render_thread,
+		&heads[started])) {
+			fprintf(stderr, "ERROR: pthread_create() failed.\n");
+			break;
+		}
+	}
+	for (uint32_t i=0; i<started; i++)
+		pthread_join(heads[i].thread, NULL);
+	int error = started < headCount;
+	vkDeviceWaitIdle(dev);
+
+	for (uint32_t i=0; i<headCount; i++) {
+		struct head *h = &heads[i];
+		struct swapchain *sc = &h->sc;
+		struct run *run = &h->run;
+		uint64_t n = run->frames;
+		error |= h->error;
+		if (headCount > 1)
+			printf("Display %u:\n", i);
+		printf("%" PRIu64 " frames in %.3f s: %.1f frames/s\n", n, run->seconds,
+		n / run->seconds);
+		for (uint32_t j=0; j<framesInFlight; j++)
+			if (h->frames[j].queriesPending)
+				collect_timestamps(dev, &sc->timing, &h->frames[j]);
+		if (readback) {
+			for (uint32_t j=0; j<sc->imageCount; j++)
+				check_readback(sc, j);
+			printf("Read back %" PRIu64 " frames on queue family %u, "
+			"%" PRIu64 " with unexpected contents\n", sc->readbackCount,
+			queues.transferFamily, sc->readbackErrors);
+		}
+		if (damageSize && n > 0) {
+			run->damageFraction = (double) sc->damagedPixels / n /
+			((uint64_t) sc->extent.width * sc->extent.height);
+			printf("Redrew %.2f%% of the pixels per frame\n",
+			100 * run->damageFraction);
+		}
+		print_latency(sc);
+		print_gpu_timing(&sc->timing);
+	}
+	print_startup(&heads[0].run.startup);
+	// The JSON results describe the first display
+	if (jsonPath && write_json(jsonPath, &heads[0].run, &heads[0].sc))
+		fprintf(stderr, "ERROR: could not write %s\n", jsonPath);
+
+	for (uint32_t i=0; i<headCount; i++) {
+		struct head *h = &heads[i];
+		struct swapchain *sc = &h->sc;
+		fini_gpu_timing(&sc->timing);
+		free_samples(&sc->latency);
+		free_samples(&h->run.cpu);
+		free_samples(&h->run.interval);
+
+		destroy_frames(dev, h->frames, framesInFlight);
+		if (readback)
+			fini_readback(&allocator, dev, transferPool, sc);
+		if (recordThreads)
+			fini_recorder(&h->recorder);
+		fini_swapchain_images(&allocator, dev, sc);
+		if (damageSize)
+			destroy_tiles(&allocator, dev, &sc->tiles);
+		vkDestroySemaphore(dev, h->queues.graphicsTimeline.sem, NULL);
+		vkDestroySemaphore(dev, h->queues.transferTimeline.sem, NULL);
+		if (sc->swp != VK_NULL_HANDLE)
+			vkDestroySwapchainKHR(dev, sc->swp, 0);
+		pthread_mutex_destroy(&sc->lock);
+	}
+	if (draw)
+		destroy_pipeline(dev, &pipeline);
+	fini_allocator(&allocator);
+	if (transferPool != VK_NULL_HANDLE)
+		vkDestroyCommandPool(dev, transferPool, NULL);
+	for (uint32_t i=0; i<surfaceSetup.surfCount; i++)
+		vkDestroySurfaceKHR(instance, surfaceSetup.surfs[i], 0);
 	vkDestroyDevice(dev, 0);
 
 	PFN_vkDestroyDebugUtilsMessengerEXT vkDestroyDebugUtilsMessenger =
@@ -290,5 +3123,5 @@ vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
 //	vkDestroyDebugUtilsMessenger(instance, debugMessenger, 0);
 	vkDestroyInstance(instance, 0);
 
-	return 0;
+	return error ? EXIT_FAILURE : 0;
 }